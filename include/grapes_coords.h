@@ -0,0 +1,42 @@
+#ifndef GRAPES_COORDS_H
+#define GRAPES_COORDS_H
+
+/** @file grapes_coords.h
+ *
+ * @brief Network coordinates.
+ *
+ * Vivaldi network coordinates: each peer is placed in a 2D space (plus
+ * a "height", modelling its access link) so that the distance between
+ * two peers estimates their round trip time. Once coords_init() is
+ * called, the topology messages (of the peer samplers and of TMAN)
+ * piggyback the coordinates of their senders and the timestamps needed
+ * to measure RTTs, which are used to refine the local coordinates. They
+ * are only sent to peers that announced they understand them, so peers
+ * running older versions keep working (without coordinates); so,
+ * ranking functions and scheduler evaluators can estimate the RTT to any
+ * peer whose coordinates are known, without probing it.
+ */
+
+struct nodeID;
+
+/**
+  @brief Enable the network coordinates.
+
+  @param myID the ID of this peer.
+  @param config configuration tags: "size" is the number of remote
+         peers whose coordinates are remembered (1024 by default).
+  @return 0 in case of success; -1 in case of error.
+*/
+int coords_init(struct nodeID *myID, const char *config);
+
+/**
+  @brief Estimate the RTT between two peers.
+
+  @param a a peer, or NULL for the one given to coords_init().
+  @param b another peer.
+  @return the estimated RTT, in microseconds; -1 if the coordinates of
+          one of the peers are not known.
+*/
+double coord_distance(const struct nodeID *a, const struct nodeID *b);
+
+#endif	/* GRAPES_COORDS_H */
@@ -0,0 +1,82 @@
+#ifndef GRAPES_TIMERS_H
+#define GRAPES_TIMERS_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/** @file grapes_timers.h
+ *
+ * @brief Timer service.
+ *
+ * The overlay protocols (peer samplers and topology managers) register
+ * their periods with this timer service, based on CLOCK_MONOTONIC.
+ * The timers are fired by timers_run(), which is invoked by
+ * psample_parse_data() and tmanParseData(); an event loop can instead
+ * sleep until the deadline returned by timers_next() and then call
+ * timers_run(), without polling.
+ */
+
+/**
+  @brief A periodic timer.
+ */
+struct timer;
+
+typedef void (*timer_callback)(void *arg);
+
+/**
+  @brief Current time.
+
+  @return the current (monotonic) time, in microseconds.
+*/
+uint64_t timers_now(void);
+
+/**
+  @brief Register a periodic timer.
+
+  The callback is invoked (from timers_run()) every period microseconds,
+  the first time period microseconds from now. The expiration times do
+  not drift: if timers_run() is late, the next expiration is not delayed
+  (and the missed ones are skipped). A callback can modify or remove its
+  own timer, or any other one.
+  @param period the period of the timer, in microseconds.
+  @param cb the function to be invoked when the timer expires.
+  @param arg argument passed to cb.
+  @return the timer in case of success; NULL in case of error.
+*/
+struct timer *timer_add(uint64_t period, timer_callback cb, void *arg);
+
+/**
+  @brief Change the period of a timer.
+
+  The next expiration of the timer is moved to one (new) period after
+  its last expiration (or after its registration).
+  @param t the timer.
+  @param period the new period, in microseconds.
+*/
+void timer_mod(struct timer *t, uint64_t period);
+
+/**
+  @brief Remove a timer.
+
+  @param t the timer, which is freed.
+*/
+void timer_del(struct timer *t);
+
+/**
+  @brief Fire the expired timers.
+
+  @return the number of callbacks invoked.
+*/
+int timers_run(void);
+
+/**
+  @brief Time to the next expiration.
+
+  @param tout pointer to a timeval filled with the time remaining before
+         the next expiration (0 if a timer already expired), to be used
+         as a timeout for wait4data().
+  @return 0 in case of success; -1 if no timer is registered.
+*/
+int timers_next(struct timeval *tout);
+
+#endif	/* GRAPES_TIMERS_H */
@@ -132,6 +132,47 @@ const char *node_addr(const struct nodeID *s);
 */
 struct nodeID *nodeid_undump(const uint8_t *b, int *len);
 
+/**
+* @brief Get the size of a serialized nodeID.
+*
+* Return the number of bytes that nodeid_undump() would read from a byte
+* array, without building the nodeID and without reading more than
+* max_len bytes.
+* @param[in] b A pointer to the byte array containing the serialized nodeID.
+* @param[in] max_len The number of bytes available in the byte array.
+* @return The size of the serialized nodeID, or -1 if it does not fit in
+*         max_len bytes.
+*/
+int nodeid_dump_len(const uint8_t *b, size_t max_len);
+
+/**
+* @brief Serialize a nodeID in a compact form.
+*
+* Serialize a nodeID using as few bytes as possible (for example, 6 bytes
+* for an IPv4 address and port), for the protocols that negotiated it.
+* @param[in] b A pointer to the byte array that will contain the nodeID serialization.
+* @param[in] s A pointer to the nodeID to be serialized.
+* @param[in] max_write_size A number of bytes available in b
+* @return The number of bytes written in the buffer, or -1 if error (or if
+*         the nodeID has no compact form)
+*/
+int nodeid_dump_compact(uint8_t *b, const struct nodeID *s, size_t max_write_size);
+
+/**
+* @brief Convert a compact serialization into a regular one.
+*
+* Read a nodeID serialized by nodeid_dump_compact(), and write it in the
+* form produced by nodeid_dump() (so that it can be used with
+* nodeid_undump()).
+* @param[in] b A pointer to the byte array that will contain the nodeID serialization.
+* @param[in] c A pointer to the compact serialization.
+* @param[in] max_write_size A number of bytes available in b
+* @param[in,out] len The number of bytes available in c; on return, the
+*                number of bytes read from it.
+* @return The number of bytes written in b, or -1 if error
+*/
+int nodeid_compact_expand(uint8_t *b, const uint8_t *c, size_t max_write_size, int *len);
+
 /**
 * @brief Serialize a nodeID in a byte array.
 *
@@ -11,12 +11,26 @@
 
 #include <sys/time.h>
 
+/**
+ * Performance statistics of a peer (exponentially weighted moving
+ * averages), maintained by the PeerSet
+ */
+struct peer_stats {
+    double rtt; ///< smoothed round trip time in us (0 if unknown)
+    double rtt_var; ///< round trip time variation in us
+    double throughput; ///< throughput of the chunks received from the peer, in bytes/s (0 if unknown)
+    double loss; ///< fraction of the requested chunks that never arrived
+    double dup; ///< fraction of duplicate chunks among the ones received from the peer
+    int outstanding; ///< number of chunks requested and not received yet
+};
+
 struct peer {
     struct nodeID *id; ///< NodeId associated to the peer
     struct timeval creation_timestamp; ///< creation timestamp
     struct chunkID_set *bmap; ///< buffermap of the peer
     struct timeval bmap_timestamp; ///< buffermap timestamp
     int cb_size; ///< chunk buffer size
+    struct peer_stats stats; ///< performance statistics
 };
 
 
@@ -45,6 +45,10 @@ struct psample_context;
   known peers), and its size. Note that the current cache 
   size can be different from the requested one, because of how the peer 
   sampling protocols work. 
+  The cache is returned as a snapshot, which is never modified: it stays
+  valid until a call to psample_get_cache(), psample_get_metadata(),
+  psample_get_version() or psample_get_changes() returns a new version
+  (that is, until the set of known peers or their metadata change).
 
   @param tc the pointer to the current topology manager instance context
   @param n pointer to an integer where the cache size is returned.
@@ -75,6 +79,41 @@ const struct nodeID **psample_get_cache(struct psample_context *tc, int *n);
 */
 const void *psample_get_metadata(struct psample_context *tc, int *metadata_size);
 
+/**
+  @brief Get the version of the cache.
+
+  The version is incremented each time the set of known peers, or their
+  metadata, change.
+  @param tc the pointer to the current topology manager instance context
+  @return the version of the cache returned by psample_get_cache(); -1
+          in case of error.
+*/
+int psample_get_version(struct psample_context *tc);
+
+/**
+  @brief Get the changes of the cache.
+
+  This function returns the peers added to and removed from the cache
+  since a given version, so that the data structures built on the cache
+  can be updated incrementally. A peer whose metadata changed is
+  returned as added. The arrays stay valid until the next call.
+  @param tc the pointer to the current topology manager instance context
+  @param since_version a version returned by psample_get_version() or
+         psample_get_changes().
+  @param added pointer to an array of the added peers.
+  @param n_added pointer to an integer where the number of added peers is
+         returned.
+  @param removed pointer to an array of the removed peers.
+  @param n_removed pointer to an integer where the number of removed peers
+         is returned.
+  @return the current version in case of success; -1 in case of error, or
+          if since_version is too old (the changes are not remembered
+          anymore, and the whole cache must be re-read).
+*/
+int psample_get_changes(struct psample_context *tc, int since_version,
+                        const struct nodeID ***added, int *n_added,
+                        const struct nodeID ***removed, int *n_removed);
+
 /**
   @brief Increase the cache size.
 
@@ -103,6 +142,9 @@ int psample_shrink_cache(struct psample_context *tc, int n);
   This function can be used to remove a specified peer from the
   cache. Note that the requested cache size is not
   modified, so the peer will be soon replaced by a different one.
+  With the "hyparview" protocol the replacement is requested
+  immediately: this should be called as soon as a neighbour is known
+  to have failed (for example, when sending chunks to it fails).
   @param tc the pointer to the current topology manager instance context
   @param neighbour the id of the peer to be removed from the
          cache.
@@ -128,13 +170,19 @@ int psample_change_metadata(struct psample_context *tc, const void *metadata, in
 /**
   @brief Initialise the Peer Sampler.
 
+  Many contexts (running the same or different protocols) can share
+  the same nodeID, if they are configured with different overlay
+  instances (the "instance" tag, from 0 to 255, 0 by default): their
+  messages are then tagged with the instance, and can be passed to
+  psample_dispatch().
   @param myID the ID of this peer.
   @param metadata pointer to the metadata associated to this peer (will be
          gossiped).
   @param metadata_size size of the metadata associated to this peer.
   @param config configuration parameter for the peer sampling module (specifying the
-         peer sampling algorithm, the cache size, etc...)
-  @return the topology manager context in case of success; NULL in case of error.
+         peer sampling algorithm, the cache size, the instance, etc...)
+  @return the topology manager context in case of success; NULL in case of
+          error (or if myID already has a context for the same instance).
 */
 struct psample_context *psample_init(struct nodeID *myID, const void *metadata, int metadata_size, const char *config);
 
@@ -168,4 +216,17 @@ int psample_add_peer(struct psample_context *tc, struct nodeID *neighbour, const
 */
 int psample_parse_data(struct psample_context *tc, const uint8_t *buff, int len);
 
+/**
+  @brief Pass a received packet to the Peer Sampler it is directed to.
+
+  Like psample_parse_data(), but the context is the one that myID
+  created for the overlay instance the message is tagged with.
+  @param myID the ID of this peer (on which the packet has been received).
+  @param buff a memory buffer containing the received message.
+  @param len the size of such a memory buffer.
+  @return 0 in case of success; -1 in case of error (or if no context
+          handles the instance).
+*/
+int psample_dispatch(const struct nodeID *myID, const uint8_t *buff, int len);
+
 #endif /* PEERSAMPLER_H */
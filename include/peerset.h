@@ -5,12 +5,23 @@
  * The Peer Set is an abstract data structure that can contain a set of
  * peer structures. It handles peers by their nodeIDs. Peer structures
  * are created and accessed based on their nodeID (i.e. unique address).
+ * Lookups by nodeID are O(1), and the peers are stored in a dense array
+ * that can be iterated quickly. Since removing a peer can move another
+ * one, pointers to the peer structures should not be kept across
+ * removals: peer handles (see peerset_get_handle()) remain valid instead.
  *
  */
  
 #ifndef PEERSET_H
 #define PEERSET_H
 
+#include <stdint.h>
+
+/**
+* Invalid peer handle
+*/
+#define PEERSET_NO_HANDLE UINT32_MAX
+
 
 /**
 * Opaque data type representing a Peer Set
@@ -26,6 +37,14 @@ typedef struct peerset PeerSet;
   *                   For example, the "size" tag indicates the expected
   *                   number of peers that will be stored in the set;
   *                   0 or not present if such a number is not known.
+  *                   The "window" tag indicates for how many chunks (the
+  *                   most recent ones, rounded up to a multiple of 64)
+  *                   the availability is counted, and
+  *                   "request_timeout" after how many us a chunk request
+  *                   is considered lost. The "expire" tag indicates after
+  *                   how many us of inactivity a peer is removed by
+  *                   peerset_expire(); 0 or not present if peers never
+  *                   expire.
   * @return the pointer to the new set on success, NULL on error
   */
 struct peerset *peerset_init(const char *config);
@@ -59,7 +78,8 @@ void peerset_add_peers(struct peerset *h, struct nodeID **ids, int n);
   * @brief Remove a peer from the set.
   * 
   * Remove a peer from the set, distroying all associated data.
-  * If peer exists, pointers of peerset_get_peers move backwards.
+  * If peer exists, the last peer of peerset_get_peers is moved
+  * in its position.
   *
   * @param h a pointer to the set where the peer has to be added
   * @param id the ID of the peer to be removed from the set
@@ -109,6 +129,30 @@ struct peer *peerset_get_peers(const struct peerset *h);
   */
 int peerset_check(const struct peerset *h, const struct nodeID *id);
 
+ /**
+  * @brief Get the handle of a peer
+  * 
+  * A handle identifies a peer as long as it is in the set: it is not
+  * affected by the removal of other peers, and it becomes invalid when
+  * the peer is removed (or the set is cleared).
+  *
+  * @param h a pointer to the set
+  * @param id the nodeID we are searching for
+  * @return the handle of the peer, or PEERSET_NO_HANDLE if the peer
+  *         is not in the set
+  */
+uint32_t peerset_get_handle(const struct peerset *h, const struct nodeID *id);
+
+ /**
+  * @brief Get a peer from its handle
+  * 
+  * @param h a pointer to the set
+  * @param handle the handle returned by peerset_get_handle()
+  * @return a pointer to the peer, or NULL if the handle is no more
+  *         valid
+  */
+struct peer *peerset_get_peer_by_handle(const struct peerset *h, uint32_t handle);
+
 
  /**
   * @brief Clear a set
@@ -121,4 +165,172 @@ int peerset_check(const struct peerset *h, const struct nodeID *id);
   */
 void peerset_clear(struct peerset *h, int size);
 
+struct peer;
+struct chunkID_set;
+
+ /**
+  * @brief Update the buffermap of a peer
+  * 
+  * Replace the buffermap of a peer of the set with a new one (which is
+  * copied, and remains owned by the caller), updating the chunks'
+  * availability counters and the buffermap timestamp.
+  * Buffermaps should always be updated through this function, otherwise
+  * peerset_chunk_availability() returns wrong results.
+  *
+  * @param h a pointer to the set
+  * @param p the peer (as returned by peerset_get_peer())
+  * @param bmap the new buffermap
+  * @return the size of the new buffermap, < 0 on error
+  */
+int peerset_set_bmap(struct peerset *h, struct peer *p, struct chunkID_set *bmap);
+
+ /**
+  * @brief Get the availability of a chunk
+  * 
+  * Return the number of peers of the set that have a chunk in their
+  * buffermap, in O(1). Only the most recent chunks (see the "window"
+  * tag of peerset_init()) are counted: the chunks older than the window,
+  * or never seen in a buffermap, are not tracked.
+  *
+  * @param h a pointer to the set
+  * @param chunk_id the chunk ID
+  * @return the number of peers having the chunk, or -1 if the chunk is
+  *         not tracked
+  */
+int peerset_chunk_availability(const struct peerset *h, int chunk_id);
+
+/**
+* Column-oriented (structure of arrays) view of the peers of a set, for
+* the schedulers: element i of each array refers to the i-th peer of
+* peerset_get_peers(), and the buffermaps of the most recent chunks are
+* stored as one row of words bits per peer, where chunk c is bit
+* c % window (if chunk_ids[c % window] == c).
+*/
+struct peerset_view {
+  int n_peers;
+  int window;  ///< multiple of 64
+  int words;  ///< 64 bits words per row (window / 64)
+  const uint64_t *bits;  ///< n_peers rows of words words
+  const int *chunk_ids;  ///< chunk ID of each bit, < 0 if none
+  const double *rtt;
+  const double *throughput;
+  const double *loss;
+  const double *dup;
+  const int *outstanding;
+  const int *cb_size;
+};
+
+ /**
+  * @brief Get the column-oriented view of a set
+  * 
+  * Return a view of the peers of a set, with the statistics (see struct
+  * peer_stats) refreshed. The view is owned by the set, and is valid
+  * until the set is modified.
+  *
+  * @param h a pointer to the set
+  * @return the view
+  */
+const struct peerset_view *peerset_get_view(struct peerset *h);
+
+ /**
+  * @brief Check if a peer has a chunk, using the view
+  * 
+  * @param v the view
+  * @param i the position of the peer in the set
+  * @param chunk_id the chunk ID
+  * @return 1 if the peer has the chunk, 0 if not, < 0 if the chunk is
+  *         not in the window (and the buffermap must be checked)
+  */
+static inline int peerset_view_has(const struct peerset_view *v, int i, int chunk_id)
+{
+  int c;
+
+  if (chunk_id < 0) {
+    return -1;
+  }
+  c = chunk_id % v->window;
+  if (v->chunk_ids[c] != chunk_id) {
+    return -1;
+  }
+
+  return (v->bits[i * v->words + c / 64] >> (c % 64)) & 1;
+}
+
+ /**
+  * @brief Account for a chunk request sent to a peer
+  * 
+  * The PeerSet keeps performance statistics for each peer (see
+  * struct peer_stats in peer.h), based on the signalling and the chunks
+  * exchanged with it: the application has to call this function when
+  * requesting chunks (or sending another signalling message that
+  * expects a reply), peerset_received_reply() when the reply arrives,
+  * and peerset_received_chunk() for every chunk received.
+  * Requests that are not completed within the "request_timeout" (in
+  * us, see peerset_init()) are considered lost.
+  *
+  * @param h a pointer to the set
+  * @param p the peer
+  * @param trans_id the transaction ID of the request
+  * @param n the number of requested chunks
+  * @return the number of outstanding chunk requests, < 0 on error
+  */
+int peerset_sent_request(struct peerset *h, struct peer *p, uint16_t trans_id, int n);
+
+ /**
+  * @brief Account for a reply to a request, updating the RTT estimate
+  * 
+  * @param h a pointer to the set
+  * @param p the peer
+  * @param trans_id the transaction ID of the reply
+  * @return 1 if the reply matches a pending request, 0 if not,
+  *         < 0 on error
+  */
+int peerset_received_reply(struct peerset *h, struct peer *p, uint16_t trans_id);
+
+ /**
+  * @brief Account for a chunk received from a peer
+  * 
+  * @param h a pointer to the set
+  * @param p the peer
+  * @param size the size of the chunk
+  * @param duplicate true if we already had the chunk
+  * @return 1 on success, < 0 on error
+  */
+int peerset_received_chunk(struct peerset *h, struct peer *p, int size, int duplicate);
+
+/**
+* Function called for every expired peer, just before its removal
+*/
+typedef void (*peerset_expire_cb)(struct peerset *h, struct peer *p, void *arg);
+
+ /**
+  * @brief Record some activity of a peer
+  * 
+  * Postpone the expiry of a peer (for example, when a message is received
+  * from it). Updating the buffermap with peerset_set_bmap() and the
+  * peerset_received_*() functions do this implicitly.
+  *
+  * @param h a pointer to the set
+  * @param p the peer
+  * @return 0 on success, < 0 on error
+  */
+int peerset_touch(struct peerset *h, struct peer *p);
+
+ /**
+  * @brief Remove the expired peers
+  * 
+  * Remove the peers that have not been active for the time set with the
+  * "expire" tag of peerset_init(), with a precision of 1/62 of the
+  * expiry time. It should be called periodically: the peers are kept in
+  * a timer wheel, so the peers that are not expiring are visited at most
+  * once per expiry time.
+  *
+  * @param h a pointer to the set
+  * @param cb function called for every expired peer before removing it
+  *           (it must not modify the set), or NULL
+  * @param arg argument passed to cb
+  * @return the number of removed peers
+  */
+int peerset_expire(struct peerset *h, peerset_expire_cb cb, void *arg);
+
 #endif	/* PEERSET_H */
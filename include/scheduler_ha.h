@@ -1,8 +1,11 @@
-#ifndef SCHEDULER_LA_H
-#define SCHEDULER_LA_H
+#ifndef SCHEDULER_HA_H
+#define SCHEDULER_HA_H
 
 #include "scheduler_common.h"
 
+struct chunk_buffer;
+struct peerset;
+
 /** @file scheduler_ha.h
 
   @brief Scheduling functions for chunk and peer selection.
@@ -28,9 +31,64 @@
 /**
   Initialize the scheduler
 
+  The peers passed to the selection functions are the ones of a PeerSet, and
+  the scheduler looks at their buffermaps to know which chunks they have.
+  The configuration string can contain the following tags:
+	- "ordering": "best" (default) or "weighted" (see scheduler_la.h);
+	- "push": how to evaluate the chunks to push, offer or propose:
+	  "latest" (default), "oldest", "random", "rarest_first" or "edf"
+	  (earliest playout deadline first);
+	- "pull": how to evaluate the chunks to request or accept:
+	  "rarest_first" (default), "latest", "oldest", "random" or "edf";
+	- "peer": how to evaluate the peers: "random" (default), "fresh"
+	  (prefer the peers with the most recent buffermap), "bandwidth"
+	  (prefer the peers delivering chunks faster) or "rtt" (prefer the
+	  closest peers), using the statistics in struct peer_stats (the
+	  RTT of the peers without measurements is estimated from their
+	  network coordinates, if enabled: see grapes_coords.h);
+	- "playout_delay": delay between the chunk timestamp and its playout
+	  (in the timebase of the timestamps, usually microseconds). When set,
+	  chunks that cannot reach a peer before their playout deadline are
+	  never selected (see schedSetChunkBuffer());
+	- "rtt": round trip time used for the peers without RTT
+	  measurements or coordinates (100000 by default);
+	- "budget": maximum number of outstanding chunk requests to a single
+	  peer, including the ones selected (unlimited by default);
+	- "seed": seed for the random choices.
+
+  Example: "push=rarest_first,peer=fresh,ordering=weighted".
+  If the scheduler is not initialized, the default configuration is used.
+
   @param[in] cfg configuration string
+  @return 1 on success, < 0 on error (e.g., unknown evaluator)
+*/
+int schedInit(const char *cfg);
+
+/**
+  Set the chunk buffer used to know the chunk timestamps
+
+  The deadline of a chunk is its timestamp plus the playout delay, and
+  the current time is the timestamp of the most recent chunk in the buffer.
+  The timestamps of the chunks not in the buffer (e.g., the ones to be
+  requested) are extrapolated from the buffered ones.
+
+  @param[in] cb the chunk buffer (NULL disables the deadline checks)
+*/
+void schedSetChunkBuffer(struct chunk_buffer *cb);
+
+/**
+  Set the PeerSet the scheduled peers belong to
+
+  If the PeerSet is known, the "rarest_first" evaluator reads the chunk
+  availability counters it maintains (see peerset_chunk_availability())
+  instead of scanning the buffermaps of all the peers for every chunk
+  (the buffermaps are still scanned for the chunks it does not track).
+  The buffermaps of its peers are also read from the PeerSet view (see
+  peerset_get_view()), so they must be updated with peerset_set_bmap().
+
+  @param[in] ps the PeerSet (NULL to scan the buffermaps)
 */
-int schedInit(char *cfg);
+void schedSetPeerSet(struct peerset *ps);
 
 /**
   Select a list of peer-chunk pairs for sending.
@@ -54,6 +112,9 @@ void schedSelectPushList(schedPeerID  *peers, int peers_len, schedChunkID  *chun
   In a pull model, chunk requests shuold be explicitly signaled. This selection function serves to select the peer-chunk combinations for such
   requests. E.g. one well known implementation of this selection creates a partitioning of the missing chunk set and assigns a peer to each of
   these subsets.
+  This implementation requests each chunk from exactly one of the peers having it,
+  choosing the peer that would deliver it first given its measured throughput and the
+  chunks already assigned to it, and never exceeding the configured per-peer budget.
 
   @param[in] peers list of peers to choose from.
   @param[in] peers_len length of the peers list
@@ -113,4 +174,4 @@ void schedSelectProposeList(schedPeerID  *peers, int peers_len, schedChunkID  *c
 void schedSelectAcceptList(schedPeerID  *peers, int peers_len, schedChunkID  *chunks, int chunks_len, 	//in
                      struct PeerChunk *selected, int *selected_len);	//out, inout
 
-#endif /* SCHEDULER_LA_H */
+#endif /* SCHEDULER_HA_H */
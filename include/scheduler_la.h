@@ -17,6 +17,14 @@
 		-# Weighted: Weighted random selection accorging to the given weight functions
 	-# filter functions: selections are typically filtered by functions such as whether a given peer (according to local knowledge) needs a given chunk.
 		The abstraction of the filter concept allows for easy modification of these filter conditions.
+	-# batch evaluators: the *Batch selector functions take evaluator functions assigning the weights
+		of a whole array of peers, chunks or pairs in a single call, so that evaluators can be written
+		as tight loops over arrays of per-peer or per-chunk data (see schedEvaluatePeersRandom(),
+		schedEvaluateChunksAge(), schedEvaluatePeersBandwidth()).
+	-# scheduler context: the schedCtx* selector functions run in a scheduler context, owning the
+		random number generator and the scratch memory used during the selection. Different contexts
+		can be used in parallel (e.g. one per channel or thread) without locking. The selector
+		functions without a context share a single, default context and are not thread safe.
 */
 
 /**
@@ -24,6 +32,31 @@
   */
 typedef enum {SCHED_BEST,SCHED_WEIGHTED} SchedOrdering;
 
+/**
+  * @brief Opaque scheduler context
+  */
+struct sched_context;
+
+/**
+  @brief Create a scheduler context.
+
+  @param [in] config a configuration string containing tags which describe the context.
+         The "seed" tag sets the seed of the context's random number generator (useful to
+         obtain deterministic selections); if not present, the seed is taken from rand().
+  @return the new context on success, NULL on error
+ */
+struct sched_context *schedContextInit(const char *config);
+
+/**
+  @brief Re-seed the random number generator of a scheduler context.
+ */
+void schedContextSeed(struct sched_context *ctx, unsigned int seed);
+
+/**
+  @brief Destroy a scheduler context, freeing all the associated memory.
+ */
+void schedContextFree(struct sched_context *ctx);
+
 /**
   * @brief Prototype for filter functions that select useful peer-chunk combinations
   * @return true if the combination is valid, false otherwise
@@ -53,6 +86,54 @@ typedef double (*pairEvaluateFunction)(struct PeerChunk*);
   */
 typedef double (*double2op)(double,double);
 
+/**
+  * @brief Prototype for function assigning weights to an array of peers
+  * @param [in] arg opaque argument given to the selector function
+  * @param [in] peers the peers to evaluate
+  * @param [in] n length of the peers array
+  * @param [out] weights the weights of the peers (weights[i] is the weight of peers[i])
+  */
+typedef void (*peerEvaluateBatchFunction)(void *arg, const schedPeerID *peers, size_t n, double *weights);
+
+/**
+  * @brief Prototype for function assigning weights to an array of chunks
+  * @see peerEvaluateBatchFunction
+  */
+typedef void (*chunkEvaluateBatchFunction)(void *arg, const schedChunkID *chunks, size_t n, double *weights);
+
+/**
+  * @brief Prototype for function assigning weights to an array of peer-chunk pairs
+  * @see peerEvaluateBatchFunction
+  */
+typedef void (*pairEvaluateBatchFunction)(void *arg, const struct PeerChunk *pairs, size_t n, double *weights);
+
+/**
+  * @brief Batch evaluator assigning random weights to the peers.
+  * @param [in] arg the scheduler context providing the random numbers
+  */
+void schedEvaluatePeersRandom(void *arg, const schedPeerID *peers, size_t n, double *weights);
+
+/**
+  * @brief Batch evaluator assigning random weights to the chunks.
+  * @param [in] arg the scheduler context providing the random numbers
+  */
+void schedEvaluateChunksRandom(void *arg, const schedChunkID *chunks, size_t n, double *weights);
+
+/**
+  * @brief Batch evaluator preferring the most recent chunks.
+  *
+  * The weight of a chunk is 1 for the oldest one, and grows with the chunk timestamp.
+  * @param [in] arg array of the chunk timestamps (arg[i] is the timestamp of chunks[i], as
+  *        uint64_t), or NULL to use the chunk IDs instead of the timestamps
+  */
+void schedEvaluateChunksAge(void *arg, const schedChunkID *chunks, size_t n, double *weights);
+
+/**
+  * @brief Batch evaluator preferring the peers with the highest upload bandwidth.
+  * @param [in] arg array of the peer bandwidths (arg[i] is the bandwidth of peers[i], as double)
+  */
+void schedEvaluatePeersBandwidth(void *arg, const schedPeerID *peers, size_t n, double *weights);
+
 
 
 /**
@@ -101,6 +182,14 @@ void schedSelectPeerFirst(SchedOrdering ordering, schedPeerID  *peers, size_t pe
                      filterFunction filter,
                      peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate);
 
+/**
+  * @brief Same as schedSelectPeerFirst, in the given scheduler context.
+  */
+void schedCtxSelectPeerFirst(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate);
+
 /*---ChunkFirst----------------*/
 
 /**
@@ -114,6 +203,14 @@ void schedSelectChunkFirst(SchedOrdering ordering, schedPeerID  *peers, size_t p
                      filterFunction filter,
                      peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate);
 
+/**
+  * @brief Same as schedSelectChunkFirst, in the given scheduler context.
+  */
+void schedCtxSelectChunkFirst(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate);
+
 /*---Composed----------------*/
 
 /**
@@ -129,6 +226,14 @@ void schedSelectComposed(SchedOrdering ordering, schedPeerID  *peers, size_t pee
                      filterFunction filter,
                      peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate, double2op weightcombine);
 
+/**
+  * @brief Same as schedSelectComposed, in the given scheduler context (and thread safe).
+  */
+void schedCtxSelectComposed(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate, double2op weightcombine);
+
 /*---Hybrid----------------*/
 
 /**
@@ -142,4 +247,51 @@ void schedSelectHybrid(SchedOrdering ordering, schedPeerID  *peers, size_t peers
                      filterFunction filter,
                      pairEvaluateFunction pairevaluate);
 
+/**
+  * @brief Same as schedSelectHybrid, in the given scheduler context.
+  */
+void schedCtxSelectHybrid(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     pairEvaluateFunction pairevaluate);
+
+/*---Batch evaluators----------------*/
+
+/**
+  * @brief Same as schedCtxSelectPeerFirst, using batch evaluators.
+  * @param [in] peerarg argument passed to peerevaluate
+  * @param [in] chunkarg argument passed to chunkevaluate
+  */
+void schedCtxSelectPeerFirstBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateBatchFunction peerevaluate, void *peerarg, chunkEvaluateBatchFunction chunkevaluate, void *chunkarg);
+
+/**
+  * @brief Same as schedCtxSelectChunkFirst, using batch evaluators.
+  * @see schedCtxSelectPeerFirstBatch
+  */
+void schedCtxSelectChunkFirstBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateBatchFunction peerevaluate, void *peerarg, chunkEvaluateBatchFunction chunkevaluate, void *chunkarg);
+
+/**
+  * @brief Same as schedCtxSelectComposed, using batch evaluators.
+  * @see schedCtxSelectPeerFirstBatch
+  */
+void schedCtxSelectComposedBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateBatchFunction peerevaluate, void *peerarg, chunkEvaluateBatchFunction chunkevaluate, void *chunkarg, double2op weightcombine);
+
+/**
+  * @brief Same as schedCtxSelectHybrid, using a batch evaluator.
+  * @param [in] pairarg argument passed to pairevaluate
+  */
+void schedCtxSelectHybridBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID  *peers, size_t peers_len, schedChunkID  *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     pairEvaluateBatchFunction pairevaluate, void *pairarg);
+
 #endif /* SCHEDULER_LA_H */
@@ -1,14 +1,14 @@
 #ifndef BLIST_CACHE
 #define BLIST_CACHE
 
-struct peer_cache;
-struct cache_entry;
-typedef int (*ranking_function)(const void *target, const void *p1, const void *p2);	// FIXME!
+#include "topocache.h"
 
 struct peer_cache *blist_cache_init(int n, int metadata_size, int max_timestamp);
 void blist_cache_free(struct peer_cache *c);
 void blist_cache_update(struct peer_cache *c);
 void blist_cache_update_tout(struct peer_cache *c);
+/* Size and timeout (usecs) of the blacklists of the caches created from now on */
+void blist_blacklist_set(int size, uint64_t timeout);
 
 struct nodeID *blist_nodeid(const struct peer_cache *c, int i);
 const void *blist_get_metadata(const struct peer_cache *c, int *size);
@@ -17,7 +17,7 @@ int blist_cache_add_ranked(struct peer_cache *c, struct nodeID *neighbour, const
 int blist_cache_add(struct peer_cache *c, struct nodeID *neighbour, const void *meta, int meta_size);
 int blist_cache_del(struct peer_cache *c, struct nodeID *neighbour);
 
-struct nodeID *blist_rand_peer(struct peer_cache *c, void **meta, int max);
+struct nodeID *blist_rand_peer(struct peer_cache *c, void **meta, int max, struct prng *r);
 
 struct peer_cache *blist_entries_undump(const uint8_t *buff, int size);
 int blist_cache_header_dump(uint8_t *b, const struct peer_cache *c);
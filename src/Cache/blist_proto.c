@@ -11,12 +11,16 @@
 #include "net_helper.h"
 #include "blist_cache.h"
 #include "proto.h"
+#include "topo_proto.h"
 #include "blist_proto.h"
 #include "grapes_msg_types.h"
 
 #define MAX_MSG_SIZE 1500
+#define CAPABLE_PEERS 64
 
 static struct peer_cache *myEntry;
+static struct peer_cache *capable;	/* peers known to understand the options */
+static struct topo_echo echo;
 
 static int blist_payload_fill(uint8_t *payload, int size, struct peer_cache *c, struct nodeID *snot, int max_peers)
 {
@@ -46,7 +50,7 @@ static int blist_topo_reply(const struct peer_cache *c, struct peer_cache *local
 {
   uint8_t pkt[MAX_MSG_SIZE];
   struct topo_header *h = (struct topo_header *)pkt;
-  int len, res;
+  int len, res, hlen;
   struct nodeID *dst;
 
 #if 0
@@ -58,10 +62,11 @@ static int blist_topo_reply(const struct peer_cache *c, struct peer_cache *local
 #endif
   dst = blist_nodeid(c, 0);
   h->protocol = protocol;
-  h->type = type;
-  len = blist_payload_fill(pkt + sizeof(struct topo_header), MAX_MSG_SIZE - sizeof(struct topo_header), local_cache, dst, max_peers);
+  h->type = type | TOPO_F_CAPS;
+  hlen = topo_opts_fill(pkt, blist_nodeid(myEntry, 0), dst, 0, 0, cache_pos(capable, dst) >= 0, &echo);
+  len = blist_payload_fill(pkt + hlen, MAX_MSG_SIZE - hlen, local_cache, dst, max_peers);
 
-  res = len > 0 ? send_to_peer(blist_nodeid(myEntry, 0), dst, pkt, sizeof(struct topo_header) + len) : len;
+  res = len > 0 ? send_to_peer(blist_nodeid(myEntry, 0), dst, pkt, hlen + len) : len;
 
   return res;
 }
@@ -70,12 +75,40 @@ static int blist_topo_query_peer(struct peer_cache *local_cache, struct nodeID *
 {
   uint8_t pkt[MAX_MSG_SIZE];
   struct topo_header *h = (struct topo_header *)pkt;
-  int len;
+  int caps = cache_pos(capable, dst) >= 0;
+  int len, hlen;
 
+  /* Old peers only answer queries with the plain type */
   h->protocol = protocol;
-  h->type = type;
-  len = blist_payload_fill(pkt + sizeof(struct topo_header), MAX_MSG_SIZE - sizeof(struct topo_header), local_cache, dst, max_peers);
-  return len > 0  ? send_to_peer(blist_nodeid(myEntry, 0), dst, pkt, sizeof(struct topo_header) + len) : len;
+  h->type = caps ? type | TOPO_F_CAPS : type;
+  hlen = topo_opts_fill(pkt, blist_nodeid(myEntry, 0), dst, 0, 0, caps, &echo);
+  len = blist_payload_fill(pkt + hlen, MAX_MSG_SIZE - hlen, local_cache, dst, max_peers);
+  return len > 0  ? send_to_peer(blist_nodeid(myEntry, 0), dst, pkt, hlen + len) : len;
+}
+
+struct peer_cache *blist_proto_parse(const uint8_t *buff, int len)
+{
+  const struct topo_header *h = (const struct topo_header *)buff;
+  struct peer_cache *c;
+  int hlen = topo_header_len(buff, len);
+
+  if (hlen < 0) {
+    return NULL;
+  }
+  c = blist_entries_undump(buff + hlen, len - hlen);
+  if (c && blist_nodeid(c, 0)) {
+    struct nodeID *sender = blist_nodeid(c, 0);
+
+    topo_opts_parse(buff, len, blist_nodeid(myEntry, 0), sender, &echo);
+    if ((h->type & TOPO_F_CAPS) && cache_pos(capable, sender) < 0) {
+      if (cache_add(capable, sender, NULL, 0) == -2) {
+        cache_del(capable, last_peer(capable));
+        cache_add(capable, sender, NULL, 0);
+      }
+    }
+  }
+
+  return c;
 }
 
 int blist_ncast_reply(const struct peer_cache *c, struct peer_cache *local_cache)
@@ -98,11 +131,11 @@ int blist_tman_query_peer(struct peer_cache *local_cache, struct nodeID *dst, in
   return blist_topo_query_peer(local_cache, dst, MSG_TYPE_TMAN, TMAN_QUERY, max_peers);
 }
 
-int blist_ncast_query(struct peer_cache *local_cache)
+int blist_ncast_query(struct peer_cache *local_cache, struct prng *r)
 {
   struct nodeID *dst;
 
-  dst = blist_rand_peer(local_cache, NULL, 0);
+  dst = blist_rand_peer(local_cache, NULL, 0, r);
   if (dst == NULL) {
     return 0;
   }
@@ -123,6 +156,7 @@ int blist_proto_init(struct nodeID *s, void *meta, int meta_size)
   if (!myEntry) {
 	myEntry = blist_cache_init(1, meta_size, 0);
 	blist_cache_add(myEntry, s, meta, meta_size);
+	capable = cache_init(CAPABLE_PEERS, 0, 0);
   }
   return 0;
 }
@@ -3,10 +3,12 @@
 
 int blist_ncast_reply(const struct peer_cache *c, struct peer_cache *local_cache);
 int blist_tman_reply(const struct peer_cache *c, struct peer_cache *local_cache, int max_peers);
-int blist_ncast_query(struct peer_cache *local_cache);
+int blist_ncast_query(struct peer_cache *local_cache, struct prng *r);
 int blist_tman_query(struct peer_cache *local_cache);
 int blist_tman_query_peer(struct peer_cache *local_cache, struct nodeID *dst, int max_peers);
 int blist_ncast_query_peer(struct peer_cache *local_cache, struct nodeID *dst);
+/* The entries of a received message (handling its options), or NULL */
+struct peer_cache *blist_proto_parse(const uint8_t *buff, int len);
 int blist_proto_metadata_update(void *meta, int meta_size);
 int blist_proto_init(struct nodeID *s, void *meta, int meta_size);
 
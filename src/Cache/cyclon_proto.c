@@ -45,6 +45,21 @@ int cyclon_query(struct cyclon_proto_context *context, const struct peer_cache *
   return topo_query_peer(context->context, sent_cache, dst, MSG_TYPE_TOPOLOGY, CYCLON_QUERY, 0);
 }
 
+int cyclon_proto_mtu_set(struct cyclon_proto_context *context, int mtu)
+{
+  return topo_proto_mtu_set(context->context, mtu);
+}
+
+int cyclon_proto_instance_set(struct cyclon_proto_context *context, int instance)
+{
+  return topo_proto_instance_set(context->context, instance);
+}
+
+int cyclon_proto_parse(struct cyclon_proto_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len)
+{
+  return topo_parse(context->context, v, ref, buff, len);
+}
+
 int cyclon_proto_change_metadata(struct cyclon_proto_context *context, const void *metadata, int metadata_size)
 {
   if (topo_proto_metadata_update(context->context, metadata, metadata_size) <= 0) {
@@ -8,6 +8,9 @@ struct cyclon_proto_context* cyclon_proto_init(struct nodeID *s, const void *met
 
 int cyclon_reply(struct cyclon_proto_context *context, const struct peer_cache *c, const struct peer_cache *local_cache);
 int cyclon_query(struct cyclon_proto_context *context, const struct peer_cache *local_cache, struct nodeID *dst);
+int cyclon_proto_mtu_set(struct cyclon_proto_context *context, int mtu);
+int cyclon_proto_instance_set(struct cyclon_proto_context *context, int instance);
+int cyclon_proto_parse(struct cyclon_proto_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len);
 
 int cyclon_proto_change_metadata(struct cyclon_proto_context *context, const void *metadata, int metadata_size);
 #endif	/* CYCLON_PROTO */
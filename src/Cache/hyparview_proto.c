@@ -0,0 +1,76 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "net_helper.h"
+#include "topocache.h"
+#include "proto.h"
+#include "topo_proto.h"
+#include "hyparview_proto.h"
+#include "grapes_msg_types.h"
+
+/*
+ * All the HyParView messages start with their sender (so that any of
+ * them proves that it is alive), followed by some entries of its views
+ */
+struct hyparview_proto_context {
+  struct topo_context *context;
+  struct peer_cache *none;	/* empty, for the messages without entries */
+};
+
+struct hyparview_proto_context* hyparview_proto_init(struct nodeID *s, const void *meta, int meta_size)
+{
+  struct hyparview_proto_context *con;
+  con = malloc(sizeof(struct hyparview_proto_context));
+
+  if (!con) return NULL;
+
+  con->none = cache_init(1, meta_size, 0);
+  if (!con->none) {
+    free(con);
+    return NULL;
+  }
+  con->context = topo_proto_init(s, meta, meta_size);
+  if (!con->context){
+    cache_free(con->none);
+    free(con);
+    return NULL;
+  }
+
+  return con;
+}
+
+int hyparview_send(struct hyparview_proto_context *context, int type, const struct peer_cache *entries, struct nodeID *dst)
+{
+  return topo_query_peer(context->context, entries ? entries : context->none, dst, MSG_TYPE_TOPOLOGY, type, 0);
+}
+
+int hyparview_proto_mtu_set(struct hyparview_proto_context *context, int mtu)
+{
+  return topo_proto_mtu_set(context->context, mtu);
+}
+
+int hyparview_proto_instance_set(struct hyparview_proto_context *context, int instance)
+{
+  return topo_proto_instance_set(context->context, instance);
+}
+
+int hyparview_proto_parse(struct hyparview_proto_context *context, struct peer_cache *v, const uint8_t *buff, int len)
+{
+  return topo_parse(context->context, v, NULL, buff, len);
+}
+
+int hyparview_proto_change_metadata(struct hyparview_proto_context *context, const void *metadata, int metadata_size)
+{
+  if (topo_proto_metadata_update(context->context, metadata, metadata_size) <= 0) {
+    return -1;
+  }
+
+  return 1;
+}
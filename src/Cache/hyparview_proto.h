@@ -0,0 +1,15 @@
+#ifndef HYPARVIEW_PROTO
+#define HYPARVIEW_PROTO
+
+struct hyparview_proto_context;
+
+struct hyparview_proto_context* hyparview_proto_init(struct nodeID *s, const void *meta, int meta_size);
+
+/* Send a message of the given type (starting with the sender) with some entries (can be NULL) */
+int hyparview_send(struct hyparview_proto_context *context, int type, const struct peer_cache *entries, struct nodeID *dst);
+int hyparview_proto_mtu_set(struct hyparview_proto_context *context, int mtu);
+int hyparview_proto_instance_set(struct hyparview_proto_context *context, int instance);
+int hyparview_proto_parse(struct hyparview_proto_context *context, struct peer_cache *v, const uint8_t *buff, int len);
+
+int hyparview_proto_change_metadata(struct hyparview_proto_context *context, const void *metadata, int metadata_size);
+#endif	/* HYPARVIEW_PROTO */
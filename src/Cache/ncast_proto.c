@@ -14,9 +14,11 @@
 #include "topo_proto.h"
 #include "ncast_proto.h"
 #include "grapes_msg_types.h"
+#include "../prng.h"
 
 struct ncast_proto_context {
   struct topo_context *context;
+  struct prng rng;	/* choice of the gossiping partner */
 };
 
 struct ncast_proto_context* ncast_proto_init(struct nodeID *s, const void *meta, int meta_size)
@@ -31,6 +33,7 @@ struct ncast_proto_context* ncast_proto_init(struct nodeID *s, const void *meta,
     free(con);
     return NULL;
   }
+  prng_seed(&con->rng, rand());
 
   return con;
 }
@@ -49,13 +52,28 @@ int ncast_query(struct ncast_proto_context *context, const struct peer_cache *lo
 {
   struct nodeID *dst;
 
-  dst = rand_peer(local_cache, NULL, 0);
+  dst = rand_peer(local_cache, NULL, 0, &context->rng);
   if (dst == NULL) {
     return 0;
   }
   return topo_query_peer(context->context, local_cache, dst, MSG_TYPE_TOPOLOGY, NCAST_QUERY, 0);
 }
 
+int ncast_proto_mtu_set(struct ncast_proto_context *context, int mtu)
+{
+  return topo_proto_mtu_set(context->context, mtu);
+}
+
+int ncast_proto_instance_set(struct ncast_proto_context *context, int instance)
+{
+  return topo_proto_instance_set(context->context, instance);
+}
+
+int ncast_proto_parse(struct ncast_proto_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len)
+{
+  return topo_parse(context->context, v, ref, buff, len);
+}
+
 int ncast_proto_metadata_update(struct ncast_proto_context *context, const void *meta, int meta_size){
   return topo_proto_metadata_update(context->context, meta, meta_size);
 }
@@ -8,6 +8,9 @@ struct ncast_proto_context* ncast_proto_init(struct nodeID *s, const void *meta,
 int ncast_reply(struct ncast_proto_context *context, const struct peer_cache *c, const struct peer_cache *local_cache);
 int ncast_query(struct ncast_proto_context *context, const struct peer_cache *local_cache);
 int ncast_query_peer(struct ncast_proto_context *context, const struct peer_cache *local_cache, struct nodeID *dst);
+int ncast_proto_mtu_set(struct ncast_proto_context *context, int mtu);
+int ncast_proto_instance_set(struct ncast_proto_context *context, int instance);
+int ncast_proto_parse(struct ncast_proto_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len);
 int ncast_proto_metadata_update(struct ncast_proto_context *context, const void *meta, int meta_size);
 
 #endif	/* NCAST_PROTO */
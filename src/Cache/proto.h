@@ -12,5 +12,41 @@ struct topo_header {
 #define TMAN_REPLY 0x04
 #define CYCLON_QUERY 0x05
 #define CYCLON_REPLY 0x06
+#define PROXIMITY_QUERY 0x07
+#define PROXIMITY_REPLY 0x08
+#define HYPARVIEW_JOIN 0x09
+#define HYPARVIEW_NEIGHBOUR 0x0a
+#define HYPARVIEW_ACCEPT 0x0b
+#define HYPARVIEW_DISCONNECT 0x0c
+#define HYPARVIEW_SHUFFLE 0x0d
+#define HYPARVIEW_SHUFFLE_REPLY 0x0e
+
+/*
+ * The high bits of the type are flags: CAPS means that the sender
+ * understands the compact encoding (and is the first entry of the
+ * message), COMPACT that the payload uses it, EXT that the message is
+ * a fragment. OPTS means that the header is followed by some options:
+ * a byte with their size (including itself), then the kind, the size
+ * and the value of each option; unknown options are ignored.
+ */
+#define TOPO_TYPE_MASK 0x0f
+#define TOPO_F_EXT 0x80
+#define TOPO_F_CAPS 0x40
+#define TOPO_F_COMPACT 0x20
+#define TOPO_F_OPTS 0x10
+
+/*
+ * Options: INSTANCE is the overlay instance (1 byte; messages without it
+ * belong to instance 0); STAMP is the send time of the message and the
+ * echo of the last one received from the destination, corrected by the
+ * time elapsed since then (4 + 4 bytes, in usecs; 0 if there is no echo);
+ * COORD are the network coordinates of the sender (see coords.h). STAMP
+ * and COORD are sent only if the sender is the first entry of the message;
+ * old peers do not skip the options, so the ones enabled by the coordinates
+ * are only sent to the peers that advertised TOPO_F_CAPS
+ */
+#define TOPO_OPT_INSTANCE 1
+#define TOPO_OPT_STAMP 2
+#define TOPO_OPT_COORD 3
 
 #endif	/* PROTO */
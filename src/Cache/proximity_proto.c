@@ -0,0 +1,80 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "net_helper.h"
+#include "topocache.h"
+#include "proto.h"
+#include "topo_proto.h"
+#include "proximity_proto.h"
+#include "grapes_msg_types.h"
+
+/*
+ * Cyclon-like shuffles, where both the query and the reply include the
+ * sender and are stamped, so that the RTT to the other peer is measured
+ */
+struct proximity_proto_context {
+  struct topo_context *context;
+};
+
+struct proximity_proto_context* proximity_proto_init(struct nodeID *s, const void *meta, int meta_size)
+{
+  struct proximity_proto_context *con;
+  con = malloc(sizeof(struct proximity_proto_context));
+
+  if (!con) return NULL;
+
+  con->context = topo_proto_init(s, meta, meta_size);
+  if (!con->context){
+    free(con);
+    return NULL;
+  }
+  topo_proto_stamps_set(con->context, 1);
+
+  return con;
+}
+
+int proximity_reply(struct proximity_proto_context *context, const struct peer_cache *c, const struct peer_cache *local_cache)
+{
+  return topo_reply(context->context, c, local_cache, MSG_TYPE_TOPOLOGY, PROXIMITY_REPLY, 0, 1);
+}
+
+int proximity_query(struct proximity_proto_context *context, const struct peer_cache *sent_cache, struct nodeID *dst)
+{
+  return topo_query_peer(context->context, sent_cache, dst, MSG_TYPE_TOPOLOGY, PROXIMITY_QUERY, 0);
+}
+
+int proximity_proto_mtu_set(struct proximity_proto_context *context, int mtu)
+{
+  return topo_proto_mtu_set(context->context, mtu);
+}
+
+int proximity_proto_instance_set(struct proximity_proto_context *context, int instance)
+{
+  return topo_proto_instance_set(context->context, instance);
+}
+
+int proximity_proto_parse(struct proximity_proto_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len)
+{
+  return topo_parse(context->context, v, ref, buff, len);
+}
+
+int proximity_proto_rtt(const struct proximity_proto_context *context)
+{
+  return topo_proto_rtt(context->context);
+}
+
+int proximity_proto_change_metadata(struct proximity_proto_context *context, const void *metadata, int metadata_size)
+{
+  if (topo_proto_metadata_update(context->context, metadata, metadata_size) <= 0) {
+    return -1;
+  }
+
+  return 1;
+}
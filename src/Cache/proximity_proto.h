@@ -0,0 +1,17 @@
+#ifndef PROXIMITY_PROTO
+#define PROXIMITY_PROTO
+
+struct proximity_proto_context;
+
+struct proximity_proto_context* proximity_proto_init(struct nodeID *s, const void *meta, int meta_size);
+
+int proximity_reply(struct proximity_proto_context *context, const struct peer_cache *c, const struct peer_cache *local_cache);
+int proximity_query(struct proximity_proto_context *context, const struct peer_cache *local_cache, struct nodeID *dst);
+int proximity_proto_mtu_set(struct proximity_proto_context *context, int mtu);
+int proximity_proto_instance_set(struct proximity_proto_context *context, int instance);
+int proximity_proto_parse(struct proximity_proto_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len);
+/* RTT (in usecs) to the sender of the last parsed message, or -1 */
+int proximity_proto_rtt(const struct proximity_proto_context *context);
+
+int proximity_proto_change_metadata(struct proximity_proto_context *context, const void *metadata, int metadata_size);
+#endif	/* PROXIMITY_PROTO */
@@ -4,39 +4,99 @@
  *  This is free software; see lgpl-2.1.txt
  */
 
+#include <sys/time.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "topocache.h"
 #include "proto.h"
 #include "topo_proto.h"
+#include "int_coding.h"
+#include "../coords.h"
+#include "../prng.h"
+
+#define CAPABLE_PEERS 64
+#define DEFAULT_MTU 1400		/* UDP payload fitting in an ethernet frame, with some room */
+#define MIN_MTU 256
+#define MAX_LEGACY_SIZE (60 * 1024)	/* largest message for peers not understanding fragments */
+#define MAX_FRAGS 256
+#define REASM_SLOTS 4
+
+/*
+ * Fragments (TOPO_F_EXT): the topology header (with the options), the
+ * message id, the size of the payload, the fragment index and the
+ * fragment size (the last fragment can be shorter), followed by a slice
+ * of the payload
+ */
+#define FRAG_HEADER_SIZE(hlen) ((hlen) + 12)
+#define MAX_HEADER_SIZE (sizeof(struct topo_header) + 1 + 3 + 10 + 2 + COORD_SIZE)	/* with all the options */
+#define MAX_FRAG_SIZE (0xffff - FRAG_HEADER_SIZE(MAX_HEADER_SIZE))
+#define MAX_REASM_SIZE(mtu) (4 * (uint32_t)(mtu) * MAX_FRAGS)	/* largest message accepted in fragments */
+
+struct reassembly {
+  uint32_t id;
+  int total;
+  int frag_size;
+  int received;		/* 0 if the slot is free */
+  unsigned int last_used;
+  uint8_t done[MAX_FRAGS / 8];
+  uint8_t *buff;	/* topology header + payload */
+  int hlen;	/* of the topology header */
+  int buff_size;
+};
 
 struct topo_context{
  struct peer_cache *myEntry;
- uint8_t *pkt;
+ struct peer_cache *capable;	/* peers known to understand the compact encoding */
+ uint8_t *pkt;		/* the whole message, grown as needed */
  int pkt_size;
+ uint8_t *frag;		/* a single datagram */
+ int mtu;
+ int instance;
+ int stamps;		/* send TOPO_OPT_STAMP */
+ struct topo_echo echo;
+ int rtt;		/* measured by the last parsed message */
+ struct prng rng;	/* message ids */
+ struct reassembly reasm[REASM_SLOTS];
+ unsigned int reasm_clock;
 };
 
-static int topo_payload_fill(struct topo_context *context, uint8_t *payload, int size, const struct peer_cache *c, const struct nodeID *snot, int max_peers, int include_me)
+static int entry_fill(uint8_t *p, const struct peer_cache *c, int i, int size, struct meta_dict *d)
 {
-  int i;
+  return d ? entry_dump_compact(p, c, i, size, d) : entry_dump(p, c, i, size);
+}
+
+static int topo_payload_fill(struct topo_context *context, uint8_t *payload, int size, const struct peer_cache *c, const struct nodeID *snot, int max_peers, int include_me, int compact)
+{
+  struct meta_dict dict, *d = NULL;
+  int i, res;
   uint8_t *p = payload;
 
   if (!max_peers) max_peers = 1000; // FIXME: just to be sure to dump the whole cache...
-  p += cache_header_dump(p, c, include_me);
+  if (compact) {
+    d = &dict;
+    d->n = 0;
+    p += cache_header_dump_compact(p, c, include_me);
+  } else {
+    p += cache_header_dump(p, c, include_me);
+  }
   if (include_me) {
-    p += entry_dump(p, context->myEntry, 0, size - (p - payload));
+    res = entry_fill(p, context->myEntry, 0, size - (p - payload), d);
+    if (res < 0) {
+      return res;
+    }
+    p += res;
     max_peers--;
   }
   for (i = 0; nodeid(c, i) && max_peers; i++) {
     if (!nodeid_equal(nodeid(c, i), snot)) {
-      int res;
-      res = entry_dump(p, c, i, size - (p - payload));
+      res = entry_fill(p, c, i, size - (p - payload), d);
       if (res < 0) {
-        fprintf(stderr, "too many entries!\n");
-        return -1;
+        return res;
       }
       p += res;
       --max_peers;
@@ -46,9 +106,261 @@ static int topo_payload_fill(struct topo_context *context, uint8_t *payload, int
   return p - payload;
 }
 
+static int pkt_grow(struct topo_context *context, int max_size)
+{
+  int size = context->pkt_size * 2 < max_size ? context->pkt_size * 2 : max_size;
+  uint8_t *p;
+
+  p = realloc(context->pkt, size);
+  if (p == NULL) {
+    return -1;
+  }
+  context->pkt = p;
+  context->pkt_size = size;
+
+  return 0;
+}
+
+static uint32_t stamp_now(void)
+{
+  return timers_now();
+}
+
+int topo_opts_fill(uint8_t *buff, struct nodeID *me, const struct nodeID *dst, int instance, int stamps, int coords, struct topo_echo *e)
+{
+  uint8_t *opts = buff + sizeof(struct topo_header);
+  uint8_t *p = opts + 1;
+
+  if (instance) {
+    *p++ = TOPO_OPT_INSTANCE;
+    *p++ = 1;
+    *p++ = instance;
+  }
+  coords = coords && coords_enabled();
+  if (me && (stamps || coords)) {
+    uint32_t now = stamp_now(), echo = 0;
+
+    if (e->id && nodeid_equal(e->id, dst)) {
+      echo = e->stamp + (now - e->time);
+      echo = echo ? echo : 1;
+    }
+    *p++ = TOPO_OPT_STAMP;
+    *p++ = 8;
+    int_cpy(p, now);
+    int_cpy(p + 4, echo);
+    p += 8;
+  }
+  if (me && coords && coord_dump(p + 2, me) == COORD_SIZE) {
+    *p++ = TOPO_OPT_COORD;
+    *p++ = COORD_SIZE;
+    p += COORD_SIZE;
+  }
+  if (p == opts + 1) {
+    return sizeof(struct topo_header);
+  }
+  buff[1] |= TOPO_F_OPTS;
+  *opts = p - opts;
+
+  return p - buff;
+}
+
+int topo_opts_parse(const uint8_t *buff, int len, struct nodeID *me, struct nodeID *sender, struct topo_echo *e)
+{
+  const uint8_t *val;
+  int rtt = -1;
+
+  if (topo_option(buff, len, TOPO_OPT_STAMP, &val) == 8) {
+    uint32_t now = stamp_now(), echo = int_rcpy(val + 4);
+
+    if (echo && now - echo <= INT32_MAX) {
+      rtt = now - echo;
+    }
+    if (e->id == NULL || !nodeid_equal(e->id, sender)) {
+      nodeid_free(e->id);
+      e->id = nodeid_dup(sender);
+    }
+    e->stamp = int_rcpy(val);
+    e->time = now;
+  }
+  if (coords_enabled() && topo_option(buff, len, TOPO_OPT_COORD, &val) == COORD_SIZE) {
+    coord_update(me, sender, val, rtt);
+  }
+
+  return rtt;
+}
+
+/*
+ * Fill the packet, in compact form if dst is known to understand it;
+ * returns its size. caps is set if dst will not be confused by the flags
+ * (old peers only compare the type of queries).
+ * Capable peers receive large messages in fragments, so the packet can
+ * grow up to MAX_FRAGS datagrams, and the coordinates; the others get at
+ * most MAX_LEGACY_SIZE bytes, as before.
+ */
+static int topo_pkt_fill(struct topo_context *context, const struct peer_cache *c, const struct nodeID *dst, int protocol, int type, int max_peers, int include_me, int caps)
+{
+  int capable = cache_pos(context->capable, dst) >= 0;
+  int compact = capable;
+  int len;
+
+  for (;;) {
+    struct topo_header *h = (struct topo_header *)context->pkt;
+    int hlen, max_size;
+
+    h->protocol = protocol;
+    h->type = type;
+    if (caps && include_me) {
+      h->type |= TOPO_F_CAPS;
+    }
+    if (compact) {
+      h->type |= TOPO_F_COMPACT;
+    }
+    hlen = topo_opts_fill(context->pkt, include_me ? nodeid(context->myEntry, 0) : NULL, dst, context->instance, context->stamps, capable, &context->echo);
+    max_size = compact ? MAX_FRAGS * (context->mtu - FRAG_HEADER_SIZE(hlen)) + hlen : MAX_LEGACY_SIZE;
+    len = topo_payload_fill(context, context->pkt + hlen, context->pkt_size - hlen, c, dst, max_peers, include_me, compact);
+    if (len == -2) {
+      /* No compact form for some nodeID: use the plain encoding */
+      compact = 0;
+    } else if (len >= 0) {
+      return hlen + len;
+    } else if (context->pkt_size >= max_size || pkt_grow(context, max_size) < 0) {
+      fprintf(stderr, "too many entries!\n");
+
+      return -1;
+    }
+  }
+}
+
+/* Send the packet to dst, split in MTU-sized fragments if dst supports them */
+static int topo_send(struct topo_context *context, struct nodeID *dst, int len)
+{
+  struct topo_header *fh = (struct topo_header *)context->frag;
+  int hlen = topo_header_len(context->pkt, len);
+  int frag_size, total, i, n;
+  uint32_t id;
+
+  if (len <= context->mtu || cache_pos(context->capable, dst) < 0) {
+    return send_to_peer(nodeid(context->myEntry, 0), dst, context->pkt, len);
+  }
+  frag_size = context->mtu - FRAG_HEADER_SIZE(hlen);
+  total = len - hlen;
+  n = (total + frag_size - 1) / frag_size;
+  id = prng_next(&context->rng);
+  memcpy(context->frag, context->pkt, hlen);
+  fh->type |= TOPO_F_EXT;
+  for (i = 0; i < n; i++) {
+    int size = i < n - 1 ? frag_size : total - i * frag_size;
+    uint8_t *p = context->frag + hlen;
+    int res;
+
+    int_cpy(p, id);
+    int_cpy(p + 4, total);
+    int16_cpy(p + 8, i);
+    int16_cpy(p + 10, frag_size);
+    memcpy(context->frag + FRAG_HEADER_SIZE(hlen), context->pkt + hlen + i * frag_size, size);
+    res = send_to_peer(nodeid(context->myEntry, 0), dst, context->frag, FRAG_HEADER_SIZE(hlen) + size);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  return len;
+}
+
+/* The slot reassembling message id, or a free one, or the least recently used */
+static struct reassembly *reasm_slot(struct topo_context *context, uint32_t id, int total, int frag_size, int hlen)
+{
+  struct reassembly *r = NULL;
+  int i;
+
+  for (i = 0; i < REASM_SLOTS; i++) {
+    struct reassembly *s = &context->reasm[i];
+
+    if (s->received && s->id == id && s->total == total && s->frag_size == frag_size && s->hlen == hlen) {
+      return s;
+    }
+    if (r == NULL || (r->received && (!s->received || s->last_used < r->last_used))) {
+      r = s;
+    }
+  }
+  if (r->buff_size < hlen + total) {
+    uint8_t *p = realloc(r->buff, hlen + total);
+
+    if (p == NULL) {
+      return NULL;
+    }
+    r->buff = p;
+    r->buff_size = hlen + total;
+  }
+  r->id = id;
+  r->hlen = hlen;
+  r->total = total;
+  r->frag_size = frag_size;
+  r->received = 0;
+  memset(r->done, 0, sizeof(r->done));
+
+  return r;
+}
+
+/*
+ * Store a fragment; returns the reassembled message (setting *len to its
+ * size) when complete, or NULL (setting *len to 0, or to -1 on error)
+ */
+static const uint8_t *reasm_add(struct topo_context *context, const uint8_t *buff, int *len)
+{
+  int hlen = topo_header_len(buff, *len);
+  const uint8_t *p = buff + hlen;
+  struct reassembly *r;
+  uint32_t id, total, idx, frag_size, size, offset;
+
+  if (hlen < 0 || *len < FRAG_HEADER_SIZE(hlen)) {
+    *len = -1;
+
+    return NULL;
+  }
+  id = int_rcpy(p);
+  total = int_rcpy(p + 4);
+  idx = int16_rcpy(p + 8);
+  frag_size = int16_rcpy(p + 10);
+  size = *len - FRAG_HEADER_SIZE(hlen);
+  if (idx >= MAX_FRAGS || frag_size == 0 || frag_size > MAX_FRAG_SIZE ||
+      total > MAX_FRAGS * frag_size || total > MAX_REASM_SIZE(context->mtu)) {
+    *len = -1;
+
+    return NULL;
+  }
+  offset = idx * frag_size;
+  if (offset >= total || size != (total - offset < frag_size ? total - offset : frag_size)) {
+    *len = -1;
+
+    return NULL;
+  }
+  r = reasm_slot(context, id, total, frag_size, hlen);
+  if (r == NULL) {
+    *len = -1;
+
+    return NULL;
+  }
+  *len = 0;
+  if (r->done[idx / 8] & (1 << (idx % 8))) {
+    return NULL;
+  }
+  r->done[idx / 8] |= 1 << (idx % 8);
+  r->last_used = ++context->reasm_clock;
+  memcpy(r->buff + hlen + offset, p + 12, size);
+  if (++r->received < (total + frag_size - 1) / frag_size) {
+    return NULL;
+  }
+  memcpy(r->buff, buff, hlen);
+  r->buff[1] &= ~TOPO_F_EXT;
+  r->received = 0;
+  *len = hlen + total;
+
+  return r->buff;
+}
+
 int topo_reply(struct topo_context *context, const struct peer_cache *c, const struct peer_cache *local_cache, int protocol, int type, int max_peers, int include_me)
 {
-  struct topo_header *h = (struct topo_header *)context->pkt;
   int len, res;
   struct nodeID *dst;
 
@@ -60,24 +372,146 @@ int topo_reply(struct topo_context *context, const struct peer_cache *c, const s
   }
 #endif
   dst = nodeid(c, 0);
-  h->protocol = protocol;
-  h->type = type;
-  len = topo_payload_fill(context, context->pkt + sizeof(struct topo_header), context->pkt_size - sizeof(struct topo_header), local_cache, dst, max_peers, include_me);
+  len = topo_pkt_fill(context, local_cache, dst, protocol, type, max_peers, include_me, 1);
 
-  res = len > 0 ? send_to_peer(nodeid(context->myEntry, 0), dst, context->pkt, sizeof(struct topo_header) + len) : len;
+  res = len > 0 ? topo_send(context, dst, len) : len;
 
   return res;
 }
 
 int topo_query_peer(struct topo_context *context, const struct peer_cache *local_cache, struct nodeID *dst, int protocol, int type, int max_peers)
 {
-  struct topo_header *h = (struct topo_header *)context->pkt;
   int len;
 
-  h->protocol = protocol;
-  h->type = type;
-  len = topo_payload_fill(context, context->pkt + sizeof(struct topo_header), context->pkt_size - sizeof(struct topo_header), local_cache, dst, max_peers, 1);
-  return len > 0  ? send_to_peer(nodeid(context->myEntry, 0), dst, context->pkt, sizeof(struct topo_header) + len) : len;
+  len = topo_pkt_fill(context, local_cache, dst, protocol, type, max_peers, 1, cache_pos(context->capable, dst) >= 0);
+  return len > 0  ? topo_send(context, dst, len) : len;
+}
+
+int topo_parse(struct topo_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len)
+{
+  const struct topo_header *h = (const struct topo_header *)buff;
+  int res, hlen;
+
+  context->rtt = -1;
+  if (topo_instance(buff, len) != context->instance) {
+    return -1;
+  }
+  if (h->type & TOPO_F_EXT) {
+    buff = reasm_add(context, buff, &len);
+    if (buff == NULL) {
+      return len;
+    }
+    h = (const struct topo_header *)buff;
+  }
+  hlen = topo_header_len(buff, len);
+  if (h->type & TOPO_F_COMPACT) {
+    res = entries_parse_compact(v, ref, buff + hlen, len - hlen);
+  } else {
+    res = entries_parse(v, ref, buff + hlen, len - hlen);
+  }
+  if (res < 0) {
+    return -1;
+  }
+  if ((h->type & TOPO_F_CAPS) && res > 0 && cache_pos(context->capable, nodeid(v, 0)) < 0) {
+    if (cache_add(context->capable, nodeid(v, 0), NULL, 0) == -2) {
+      cache_del(context->capable, last_peer(context->capable));
+      cache_add(context->capable, nodeid(v, 0), NULL, 0);
+    }
+  }
+  if (res > 0) {
+    context->rtt = topo_opts_parse(buff, len, nodeid(context->myEntry, 0), nodeid(v, 0), &context->echo);
+  }
+
+  return h->type & TOPO_TYPE_MASK;
+}
+
+int topo_header_len(const uint8_t *buff, int len)
+{
+  int hlen = sizeof(struct topo_header);
+
+  if (len < hlen) {
+    return -1;
+  }
+  if (buff[1] & TOPO_F_OPTS) {
+    if (len < hlen + 1 || buff[hlen] < 1 || len < hlen + buff[hlen]) {
+      return -1;
+    }
+    hlen += buff[hlen];
+  }
+
+  return hlen;
+}
+
+int topo_option(const uint8_t *buff, int len, int kind, const uint8_t **val)
+{
+  const uint8_t *p, *end;
+  int hlen = topo_header_len(buff, len);
+
+  if (hlen < 0 || !(buff[1] & TOPO_F_OPTS)) {
+    return -1;
+  }
+  p = buff + sizeof(struct topo_header) + 1;
+  end = buff + hlen;
+  while (p + 2 <= end && p + 2 + p[1] <= end) {
+    if (p[0] == kind) {
+      *val = p + 2;
+
+      return p[1];
+    }
+    p += 2 + p[1];
+  }
+
+  return -1;
+}
+
+int topo_instance(const uint8_t *buff, int len)
+{
+  const uint8_t *val;
+
+  if (topo_header_len(buff, len) < 0) {
+    return -1;
+  }
+
+  return topo_option(buff, len, TOPO_OPT_INSTANCE, &val) == 1 ? val[0] : 0;
+}
+
+int topo_proto_mtu_set(struct topo_context *context, int mtu)
+{
+  uint8_t *p;
+
+  if (mtu < MIN_MTU || mtu - FRAG_HEADER_SIZE(sizeof(struct topo_header)) > MAX_FRAG_SIZE) {
+    return -1;
+  }
+  p = realloc(context->frag, mtu);
+  if (p == NULL) {
+    return -1;
+  }
+  context->frag = p;
+  context->mtu = mtu;
+
+  return 0;
+}
+
+int topo_proto_instance_set(struct topo_context *context, int instance)
+{
+  if (instance < 0 || instance > 0xff) {
+    return -1;
+  }
+  context->instance = instance;
+
+  return 0;
+}
+
+int topo_proto_stamps_set(struct topo_context *context, int enable)
+{
+  context->stamps = enable;
+
+  return 0;
+}
+
+int topo_proto_rtt(const struct topo_context *context)
+{
+  return context->rtt;
 }
 
 int topo_proto_metadata_update(struct topo_context *context, const void *meta, int meta_size)
@@ -92,19 +526,25 @@ int topo_proto_metadata_update(struct topo_context *context, const void *meta, i
 struct topo_context* topo_proto_init(struct nodeID *s, const void *meta, int meta_size)
 {
   struct topo_context* con;
+  struct timeval tv;
 
-  con = malloc(sizeof(struct topo_context));
+  con = calloc(1, sizeof(struct topo_context));
   if (!con) return NULL;
-  con->pkt_size = 60 * 1024;	// FIXME: Do something smarter, here!
+  con->pkt_size = DEFAULT_MTU;
   con->pkt = malloc(con->pkt_size);
-  if (!con->pkt) {
+  if (!con->pkt || topo_proto_mtu_set(con, DEFAULT_MTU) < 0) {
+    free(con->pkt);
     free(con);
 
     return NULL;
   }
+  con->rtt = -1;
+  gettimeofday(&tv, NULL);
+  prng_seed(&con->rng, (tv.tv_sec * 1000000ull + tv.tv_usec) ^ (uintptr_t)con);
 
   con->myEntry = cache_init(1, meta_size, 0);
   cache_add(con->myEntry, s, meta, meta_size);
+  con->capable = cache_init(CAPABLE_PEERS, 0, 0);
 
   return con;
 }
@@ -2,11 +2,41 @@
 #define TOPO_PROTO
 
 struct topo_context;
+struct peer_cache;
+struct nodeID;
+
+/* The last stamp received, to be echoed */
+struct topo_echo {
+  struct nodeID *id;	/* sender */
+  uint32_t stamp;
+  uint32_t time;	/* when it was received */
+};
 
 int topo_reply(struct topo_context *context, const struct peer_cache *c, const struct peer_cache *local_cache, int protocol, int type, int max_peers, int include_me);
 int topo_query_peer(struct topo_context *context, const struct peer_cache *local_cache, struct nodeID *dst, int protocol, int type, int max_peers);
+int topo_parse(struct topo_context *context, struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int len);
 
+int topo_proto_mtu_set(struct topo_context *context, int mtu);
+int topo_proto_instance_set(struct topo_context *context, int instance);
+int topo_proto_stamps_set(struct topo_context *context, int enable);
+/* RTT (in usecs) measured by the last parsed message, or -1 */
+int topo_proto_rtt(const struct topo_context *context);
 int topo_proto_metadata_update(struct topo_context *context, const void *meta, int meta_size);
 struct topo_context* topo_proto_init(struct nodeID *s, const void *meta, int meta_size);
 
+/* Size of the header of a message (with the options), or -1 if malformed */
+int topo_header_len(const uint8_t *buff, int len);
+/* Size of the option of the given kind, pointed by *val, or -1 */
+int topo_option(const uint8_t *buff, int len, int kind, const uint8_t **val);
+/* Overlay instance of a message, or -1 if it is malformed */
+int topo_instance(const uint8_t *buff, int len);
+/*
+ * Write the options of a message to dst after its header, returning the
+ * header size; me is the sender, if it is the first entry of the message,
+ * and coords is set if dst understands the options (it sent TOPO_F_CAPS)
+ */
+int topo_opts_fill(uint8_t *buff, struct nodeID *me, const struct nodeID *dst, int instance, int stamps, int coords, struct topo_echo *e);
+/* Handle the stamp and the coordinates of a message; returns the RTT measured, or -1 */
+int topo_opts_parse(const uint8_t *buff, int len, struct nodeID *me, struct nodeID *sender, struct topo_echo *e);
+
 #endif	/* TOPO_PROTO */
@@ -11,12 +11,23 @@
 #include <stdio.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "topocache.h"
 #include "int_coding.h"
+#include "nodeid_map.h"
+#include "../prng.h"
+
+#define INDEX_MIN_SIZE 16	/* smaller caches are just scanned */
+#define MAX_DUMP_SIZE 256
+#define MAX_COMPACT_SIZE 32
+#define MAX_ENTRIES 1024	/* initial room for the entries of a parsed message */
+#define MAX_METADATA_SIZE 1024
 
 struct cache_entry {
   struct nodeID *id;
   uint32_t timestamp;
+  uint32_t hash;	/* nodeid_hash(id) */
+  uint8_t flags;	/* owned by the user of the cache (see cache_flags()) */
 };
 
 struct peer_cache {
@@ -26,34 +37,110 @@ struct peer_cache {
   int metadata_size;
   uint8_t *metadata;
   int max_timestamp;
+  struct nodeid_map *index;	/* nodeID -> position, or NULL */
+  /*
+   * Views (see entries_parse()) do not own the nodeIDs of their entries:
+   * they are borrowed from a reference cache, or from the pool of the
+   * nodeIDs undumped by the view (reused by the following messages)
+   */
+  struct peer_cache *pool;	/* NULL if this is not a view */
+  uint32_t generation;	/* parsed messages; pool entries: last use */
+  int metadata_room;	/* bytes allocated for the metadata of a view */
+  struct blacklist *blist;	/* or NULL */
+};
+
+/*
+ * Blacklists: FIFO lists (oldest first, hence sorted by expiry time) of
+ * nodeIDs, linked through the slots of an array and indexed by a
+ * nodeid_map. cache_rank() shares the blacklist of the ranked cache
+ * instead of copying it
+ */
+struct blacklist_entry {
+  struct nodeID *id;
+  uint64_t expiry;	/* usecs, as timers_now() */
+  int prev, next;	/* -1: none */
+};
+
+struct blacklist {
+  struct blacklist_entry *entries;
+  int size;
+  int head, tail;	/* oldest, newest */
+  int free;	/* free slots, linked through next */
+  uint64_t timeout;	/* 0: never expire */
+  struct nodeid_map *map;	/* nodeID -> slot */
+  int refs;
 };
 
-static int cache_insert(struct peer_cache *c, struct cache_entry *e, const void *meta)
+static void index_drop(struct peer_cache *c)
 {
-  int i, position;
+  nodeid_map_free(c->index);
+  c->index = NULL;
+}
 
-  if (c->current_size == c->cache_size) {
-    return -2;
+/* The entries from "from" to "to" (excluded) have been moved */
+static void index_update(struct peer_cache *c, int from, int to)
+{
+  int i;
+
+  if (c->index == NULL) {
+    return;
+  }
+  for (i = from; i < to; i++) {
+    if (nodeid_map_put_hashed(c->index, c->entries[i].id, c->entries[i].hash, i) < 0) {
+      index_drop(c);	/* fall back to linear searches */
+      return;
+    }
+  }
+}
+
+/* The i-th entry is being removed (or its ID is being moved to another cache) */
+static void index_forget(const struct peer_cache *c, int i)
+{
+  if (c->index) {
+    nodeid_map_del_hashed(c->index, c->entries[i].id, c->entries[i].hash);
+  }
+}
+
+static int index_find(const struct peer_cache *c, const struct nodeID *id, uint32_t hash)
+{
+  int i;
+
+  if (c->index) {
+    return nodeid_map_get_hashed(c->index, id, hash);
   }
-  position = c->current_size;
   for (i = 0; i < c->current_size; i++) {
-if (e->id == NULL) {fprintf(stderr, "e->ID = NULL!!!\n"); *((char *)0) = 1;}
-if (c->entries[i].id == NULL) {fprintf(stderr, "entries[%d]->ID = NULL!!!\n", i); exit(-1);}
-    if (nodeid_equal(e->id, c->entries[i].id)) {
-      return -1;
+    if (c->entries[i].hash == hash && nodeid_equal(c->entries[i].id, id)) {
+      return i;
     }
-    if (e->timestamp < c->entries[i].timestamp) {
-       position = i;
-     }
   }
 
-  memmove(c->entries + position + 1, c->entries + position, sizeof(struct cache_entry) * (c->current_size - position));
-  memmove(c->metadata + (position + 1) * c->metadata_size, c->metadata + position * c->metadata_size, (c->current_size - position) * c->metadata_size);
-  c->current_size++;
-  c->entries[position] = *e;
-  memcpy(c->metadata + position * c->metadata_size, meta, c->metadata_size);
+  return -1;
+}
+
+static int index_find_dump(const struct peer_cache *c, const uint8_t *b, int len, uint32_t hash)
+{
+  int i;
+
+  if (c->index) {
+    return nodeid_map_get_dump(c->index, b, len, hash);
+  }
+  for (i = 0; i < c->current_size; i++) {
+    if (c->entries[i].hash == hash && c->entries[i].id && nodeid_dump_equal(c->entries[i].id, b, len)) {
+      return i;
+    }
+  }
 
-  return position;
+  return -1;
+}
+
+static int cache_find(const struct peer_cache *c, const struct nodeID *id)
+{
+  return index_find(c, id, nodeid_hash(id));
+}
+
+static int in_cache(const struct peer_cache *c, const struct cache_entry *elem)
+{
+  return index_find(c, elem->id, elem->hash);
 }
 
 struct nodeID *nodeid(const struct peer_cache *c, int i)
@@ -78,16 +165,106 @@ int cache_metadata_update(struct peer_cache *c, const struct nodeID *p, const vo
   if (!meta_size || meta_size != c->metadata_size) {
     return -3;
   }
-  for (i = 0; i < c->current_size; i++) {
-    if (nodeid_equal(c->entries[i].id, p)) {
-      memcpy(c->metadata + i * meta_size, meta, meta_size);
-      return 1;
-    }
+  i = cache_find(c, p);
+  if (i >= 0) {
+    memcpy(c->metadata + i * meta_size, meta, meta_size);
+    return 1;
   }
 
   return 0;
 }
 
+static struct blacklist *blacklist_init(int size, uint64_t timeout)
+{
+  struct blacklist *b;
+  int i;
+
+  b = malloc(sizeof(struct blacklist));
+  if (b == NULL) {
+    return NULL;
+  }
+  b->size = size > 0 ? size : 1;
+  b->entries = malloc(b->size * sizeof(struct blacklist_entry));
+  b->map = nodeid_map_init(b->size);
+  if (b->entries == NULL || b->map == NULL) {
+    free(b->entries);
+    if (b->map) {
+      nodeid_map_free(b->map);
+    }
+    free(b);
+
+    return NULL;
+  }
+  for (i = 0; i < b->size; i++) {
+    b->entries[i].id = NULL;
+    b->entries[i].next = i + 1 < b->size ? i + 1 : -1;
+  }
+  b->head = b->tail = -1;
+  b->free = 0;
+  b->timeout = timeout;
+  b->refs = 1;
+
+  return b;
+}
+
+static void blacklist_free(struct blacklist *b)
+{
+  int i;
+
+  if (b == NULL || --b->refs) {
+    return;
+  }
+  for (i = 0; i < b->size; i++) {
+    nodeid_free(b->entries[i].id);
+  }
+  nodeid_map_free(b->map);
+  free(b->entries);
+  free(b);
+}
+
+static void blacklist_unlink(struct blacklist *b, int i)
+{
+  struct blacklist_entry *e = &b->entries[i];
+
+  nodeid_map_del(b->map, e->id);
+  nodeid_free(e->id);
+  e->id = NULL;
+  if (e->prev >= 0) {
+    b->entries[e->prev].next = e->next;
+  } else {
+    b->head = e->next;
+  }
+  if (e->next >= 0) {
+    b->entries[e->next].prev = e->prev;
+  } else {
+    b->tail = e->prev;
+  }
+  e->next = b->free;
+  b->free = i;
+}
+
+static void blacklist_expire(struct blacklist *b)
+{
+  uint64_t now;
+
+  if (b->timeout == 0 || b->head < 0) {
+    return;
+  }
+  now = timers_now();
+  while (b->head >= 0 && b->entries[b->head].expiry <= now) {
+    blacklist_unlink(b, b->head);
+  }
+}
+
+static void blacklist_del(struct blacklist *b, const struct nodeID *id)
+{
+  int i = nodeid_map_get(b->map, id);
+
+  if (i >= 0) {
+    blacklist_unlink(b, i);
+  }
+}
+
 int cache_add_ranked(struct peer_cache *c, struct nodeID *neighbour, const void *meta, int meta_size, ranking_function f, const void *tmeta)
 {
   int i, pos = 0;
@@ -95,17 +272,15 @@ int cache_add_ranked(struct peer_cache *c, struct nodeID *neighbour, const void
   if (meta_size && meta_size != c->metadata_size) {
     return -3;
   }
-  for (i = 0; i < c->current_size; i++) {
-    if (nodeid_equal(c->entries[i].id, neighbour)) {
-      if (f != NULL) {
-        cache_del(c,neighbour);
-        if (i == c->current_size) break;
-      } else {
-          cache_metadata_update(c,neighbour,meta,meta_size);
-          return -1;
-      }
+  if (cache_find(c, neighbour) >= 0) {
+    if (f == NULL) {
+      cache_metadata_update(c,neighbour,meta,meta_size);
+      return -1;
     }
-    if ((f != NULL) && f(tmeta, meta, c->metadata+(c->metadata_size * i)) == 2) {
+    cache_del(c,neighbour);
+  }
+  for (i = 0; (f != NULL) && i < c->current_size; i++) {
+    if (f(tmeta, meta, c->metadata+(c->metadata_size * i)) == 2) {
       pos++;
     }
   }
@@ -125,7 +300,13 @@ int cache_add_ranked(struct peer_cache *c, struct nodeID *neighbour, const void
   }
   c->entries[pos].id = nodeid_dup(neighbour);
   c->entries[pos].timestamp = 1;
+  c->entries[pos].hash = nodeid_hash(neighbour);
+  c->entries[pos].flags = 0;
   c->current_size++;
+  index_update(c, pos, c->current_size);
+  if (c->blist) {
+    blacklist_del(c->blist, neighbour);	/* explicitly added: not blacklisted anymore */
+  }
 
   return c->current_size;
 }
@@ -137,24 +318,21 @@ int cache_add(struct peer_cache *c, struct nodeID *neighbour, const void *meta,
 
 int cache_del(struct peer_cache *c, const struct nodeID *neighbour)
 {
-  int i;
-  int found = 0;
+  int i = cache_find(c, neighbour);
 
-  for (i = 0; i < c->current_size; i++) {
-    if (nodeid_equal(c->entries[i].id, neighbour)) {
-      nodeid_free(c->entries[i].id);
-      c->current_size--;
-      found = 1;
-      if (c->metadata_size && (i < c->current_size)) {
-        memmove(c->metadata + c->metadata_size * i,
-                c->metadata + c->metadata_size * (i + 1),
-                c->metadata_size * (c->current_size - i));
-      }
-    }
-    if (found && (i < c->current_size)) {
-      c->entries[i] = c->entries[i + 1];
-    }
+  if (i < 0) {
+    return c->current_size;
+  }
+  index_forget(c, i);
+  nodeid_free(c->entries[i].id);
+  c->current_size--;
+  memmove(c->entries + i, c->entries + i + 1, sizeof(struct cache_entry) * (c->current_size - i));
+  if (c->metadata_size) {
+    memmove(c->metadata + c->metadata_size * i,
+            c->metadata + c->metadata_size * (i + 1),
+            c->metadata_size * (c->current_size - i));
   }
+  index_update(c, i, c->current_size);
 
   return c->current_size;
 }
@@ -168,6 +346,7 @@ void cache_update(struct peer_cache *c)
       int j = i;
 
       while(j < c->current_size && c->entries[j].id) {
+        index_forget(c, j);
         nodeid_free(c->entries[j].id);
         c->entries[j++].id = NULL;
       }
@@ -181,6 +360,82 @@ void cache_update(struct peer_cache *c)
   }
 }
 
+int cache_flags(const struct peer_cache *c, int i)
+{
+  return i < c->current_size ? c->entries[i].flags : -1;
+}
+
+void cache_flags_set(struct peer_cache *c, int i, int flags)
+{
+  if (i >= 0 && i < c->current_size) {
+    c->entries[i].flags = flags;
+  }
+}
+
+int cache_blacklist_init(struct peer_cache *c, int size, uint64_t timeout)
+{
+  if (c->blist == NULL) {
+    c->blist = blacklist_init(size ? size : c->cache_size, timeout);
+  }
+
+  return c->blist ? 0 : -1;
+}
+
+struct nodeID *cache_blacklist(struct peer_cache *c, struct nodeID *id)
+{
+  struct blacklist *b = c->blist;
+  struct blacklist_entry *e;
+  struct nodeID *res;
+  int i;
+
+  if (b == NULL) {
+    return NULL;
+  }
+  res = nodeid_dup(id);	/* id might belong to c */
+  if (res == NULL) {
+    return NULL;
+  }
+  cache_del(c, res);
+  blacklist_del(b, res);	/* blacklisted again: restart its timeout */
+  blacklist_expire(b);
+  if (b->free < 0) {
+    blacklist_unlink(b, b->head);	/* forget the oldest */
+  }
+  i = b->free;
+  e = &b->entries[i];
+  b->free = e->next;
+  e->id = res;
+  e->expiry = b->timeout ? timers_now() + b->timeout : 0;
+  e->prev = b->tail;
+  e->next = -1;
+  if (b->tail >= 0) {
+    b->entries[b->tail].next = i;
+  } else {
+    b->head = i;
+  }
+  b->tail = i;
+  nodeid_map_put(b->map, res, i);
+
+  return res;
+}
+
+int cache_blacklisted(const struct peer_cache *c, const struct nodeID *id)
+{
+  if (c->blist == NULL) {
+    return 0;
+  }
+  blacklist_expire(c->blist);
+
+  return nodeid_map_get(c->blist->map, id) >= 0;
+}
+
+void cache_unblacklist(struct peer_cache *c, const struct nodeID *id)
+{
+  if (c->blist) {
+    blacklist_del(c->blist, id);
+  }
+}
+
 struct peer_cache *cache_init(int n, int metadata_size, int max_timestamp)
 {
   struct peer_cache *res;
@@ -198,6 +453,11 @@ struct peer_cache *cache_init(int n, int metadata_size, int max_timestamp)
 
     return NULL;
   }
+  res->index = n >= INDEX_MIN_SIZE ? nodeid_map_init(n) : NULL;
+  res->pool = NULL;
+  res->generation = 0;
+  res->metadata_room = 0;
+  res->blist = NULL;
   
   memset(res->entries, 0, sizeof(struct cache_entry) * n);
   if (metadata_size) {
@@ -220,30 +480,24 @@ void cache_free(struct peer_cache *c)
 {
   int i;
 
-  for (i = 0; i < c->current_size; i++) {
+  if (c->pool) {
+    cache_free(c->pool);
+  }
+  for (i = 0; c->pool == NULL && i < c->current_size; i++) {
     if(c->entries[i].id) {
       nodeid_free(c->entries[i].id);
     }
   }
   free(c->entries);
   free(c->metadata);
-  free(c);
-}
-
-static int in_cache(const struct peer_cache *c, const struct cache_entry *elem)
-{
-  int i;
-
-  for (i = 0; i < c->current_size; i++) {
-    if (nodeid_equal(c->entries[i].id, elem->id)) {
-      return i;
-    }
+  if (c->index) {
+    nodeid_map_free(c->index);
   }
-
-  return -1;
+  blacklist_free(c->blist);
+  free(c);
 }
 
-struct nodeID *rand_peer(const struct peer_cache *c, void **meta, int max)
+struct nodeID *rand_peer(const struct peer_cache *c, void **meta, int max, struct prng *r)
 {
   int j;
 
@@ -254,7 +508,7 @@ struct nodeID *rand_peer(const struct peer_cache *c, void **meta, int max)
     max = c->current_size;
   else
     ++max;
-  j = ((double)rand() / (double)RAND_MAX) * max;
+  j = prng_uniform(r, max);
 
   if (meta) {
     *meta = c->metadata + (j * c->metadata_size);
@@ -272,61 +526,385 @@ struct nodeID *last_peer(const struct peer_cache *c)
   return c->entries[c->current_size - 1].id;
 }
 
-struct peer_cache *rand_cache(struct peer_cache *c, int n)
+/*
+ * Move n random entries to a new cache: the first n steps of a
+ * Fisher-Yates shuffle of the positions select them, then a single pass
+ * moves them out (both caches keep the original order)
+ */
+struct peer_cache *rand_cache(struct peer_cache *c, int n, struct prng *r)
 {
   struct peer_cache *res;
+  int size = c->current_size;
+  int *perm, i, j, first = size;
+  uint8_t *taken;
 
-cache_check(c);
-  if (c->current_size < n) {
-    n = c->current_size;
+  if (size < n) {
+    n = size;
   }
   res = cache_init(n, c->metadata_size, c->max_timestamp);
+  perm = malloc(size * (sizeof(int) + 1) + 1);
+  if (res == NULL || perm == NULL) {
+    if (res) cache_free(res);
+    free(perm);
+
+    return NULL;
+  }
+  taken = (uint8_t *)(perm + size);
+  memset(taken, 0, size);
+  for (i = 0; i < size; i++) {
+    perm[i] = i;
+  }
+  for (i = 0; i < n; i++) {
+    int tmp;
+
+    j = i + prng_uniform(r, size - i);
+    tmp = perm[i];
+    perm[i] = perm[j];
+    perm[j] = tmp;
+    taken[perm[i]] = 1;
+    if (perm[i] < first) {
+      first = perm[i];
+    }
+  }
 
-  while(res->current_size < n) {
-    int j;
+  for (i = first, j = first; i < size; i++) {
+    const uint8_t *meta = c->metadata + c->metadata_size * i;
 
-    j = ((double)rand() / (double)RAND_MAX) * c->current_size;
-    cache_insert(res, c->entries + j, c->metadata + c->metadata_size * j);
-    c->current_size--;
-    memmove(c->entries + j, c->entries + j + 1, sizeof(struct cache_entry) * (c->current_size - j));
-    memmove(c->metadata + c->metadata_size * j, c->metadata + c->metadata_size * (j + 1), c->metadata_size * (c->current_size - j));
-    c->entries[c->current_size].id = NULL;
-cache_check(c);
+    if (taken[i]) {
+      index_forget(c, i);
+      res->entries[res->current_size] = c->entries[i];
+      if (c->metadata_size) {
+        memcpy(res->metadata + c->metadata_size * res->current_size, meta, c->metadata_size);
+      }
+      res->current_size++;
+    } else {
+      c->entries[j] = c->entries[i];
+      if (c->metadata_size) {
+        memmove(c->metadata + c->metadata_size * j, meta, c->metadata_size);
+      }
+      j++;
+    }
   }
+  memset(c->entries + j, 0, sizeof(struct cache_entry) * (size - j));
+  c->current_size = j;
+  index_update(c, first, j);
+  index_update(res, 0, res->current_size);
+  free(perm);
 
   return res;
 }
 
-struct peer_cache *entries_undump(const uint8_t *buff, int size)
+struct peer_cache *cache_view_init(int pool_size)
 {
-  struct peer_cache *res;
-  int i = 0;
-  const uint8_t *p = buff;
-  uint8_t *meta;
-  int cache_size, metadata_size;
+  struct peer_cache *v;
+
+  if (pool_size < 1) {
+    pool_size = 1;
+  }
+  v = cache_init(pool_size, 0, 0);
+  if (v == NULL) {
+    return NULL;
+  }
+  v->pool = cache_init(pool_size, 0, 0);
+  if (v->pool == NULL) {
+    cache_free(v);
+
+    return NULL;
+  }
+  if (v->index) {
+    index_drop(v);	/* views are only scanned */
+  }
+
+  return v;
+}
+
+/* Make room for n entries with metadata_size bytes of metadata each */
+static int view_reserve(struct peer_cache *v, int n, int metadata_size)
+{
+  if (n > v->cache_size) {
+    struct cache_entry *e = realloc(v->entries, n * sizeof(struct cache_entry));
+
+    if (e == NULL) {
+      return -1;
+    }
+    v->entries = e;
+    v->cache_size = n;
+  }
+  if (metadata_size * v->cache_size > v->metadata_room) {
+    uint8_t *m = realloc(v->metadata, metadata_size * v->cache_size);
+
+    if (m == NULL) {
+      return -1;
+    }
+    v->metadata = m;
+    v->metadata_room = metadata_size * v->cache_size;
+  }
+  v->metadata_size = metadata_size;
+
+  return 0;
+}
+
+/* Free the pool nodeIDs not used by the current message (or grow the pool) */
+static int pool_sweep(struct peer_cache *v)
+{
+  struct peer_cache *pool = v->pool;
+  int i, n = 0;
+
+  for (i = 0; i < pool->current_size; i++) {
+    if (pool->entries[i].timestamp == v->generation) {
+      pool->entries[n++] = pool->entries[i];
+    } else {
+      index_forget(pool, i);
+      nodeid_free(pool->entries[i].id);
+    }
+  }
+  pool->current_size = n;
+  index_update(pool, 0, n);
+  if (n == pool->cache_size) {
+    struct cache_entry *e = realloc(pool->entries, 2 * n * sizeof(struct cache_entry));
+
+    if (e == NULL) {
+      return -1;
+    }
+    pool->entries = e;
+    pool->cache_size = 2 * n;
+  }
+
+  return 0;
+}
 
-  cache_size = int_rcpy(buff);
+static struct nodeID *view_borrow(struct peer_cache *v, const struct peer_cache *ref, const uint8_t *b, int len, uint32_t hash)
+{
+  struct peer_cache *pool = v->pool;
+  int i;
+
+  if (ref && (i = index_find_dump(ref, b, len, hash)) >= 0) {
+    return ref->entries[i].id;
+  }
+  i = index_find_dump(pool, b, len, hash);
+  if (i < 0) {
+    struct nodeID *id;
+
+    if (pool->current_size == pool->cache_size && pool_sweep(v) < 0) {
+      return NULL;
+    }
+    id = nodeid_undump(b, &len);
+    if (id == NULL) {
+      return NULL;
+    }
+    i = pool->current_size++;
+    pool->entries[i].id = id;
+    pool->entries[i].hash = hash;
+    index_update(pool, i, i + 1);
+  }
+  pool->entries[i].timestamp = v->generation;
+
+  return pool->entries[i].id;
+}
+
+/* Add the i-th entry (nodeID serialized as dump, of len bytes) to a view */
+static int view_add(struct peer_cache *v, const struct peer_cache *ref, int i, uint32_t timestamp, int flags, const uint8_t *dump, int len, const uint8_t *meta)
+{
+  struct cache_entry *e;
+
+  if (i == v->cache_size && view_reserve(v, 2 * i, v->metadata_size) < 0) {
+    return -1;
+  }
+  e = &v->entries[i];
+  e->timestamp = timestamp;
+  e->flags = flags;
+  e->hash = nodeid_hash_dump(dump, len);
+  e->id = view_borrow(v, ref, dump, len, e->hash);
+  if (e->id == NULL) {
+    return -1;
+  }
+  if (v->metadata_size) {
+    memcpy(v->metadata + i * v->metadata_size, meta, v->metadata_size);
+  }
+  v->current_size = i + 1;
+
+  return 0;
+}
+
+/* with_flags: the entries include their flags (after the timestamp) */
+static int parse(struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int size, int with_flags)
+{
+  const uint8_t *p = buff + 8;
+  int metadata_size;
+
+  if (v->pool == NULL || size < 8) {
+    return -1;
+  }
   metadata_size = int_rcpy(buff + 4);
-  p = buff + 8;
-  res = cache_init(cache_size, metadata_size, 0);
-  meta = res->metadata;
+  if (metadata_size < 0 || metadata_size > MAX_METADATA_SIZE ||
+      view_reserve(v, int_rcpy(buff) < MAX_ENTRIES ? int_rcpy(buff) : MAX_ENTRIES, metadata_size) < 0) {
+    return -1;
+  }
+  v->generation++;
+  v->current_size = 0;
   while (p - buff < size) {
+    const uint8_t *dump = p + sizeof(uint32_t) + (with_flags ? 1 : 0);
     int len;
 
-    res->entries[i].timestamp = int_rcpy(p);
-    p += sizeof(uint32_t);
-    res->entries[i++].id = nodeid_undump(p, &len);
+    if (dump >= buff + size) {
+      return -1;
+    }
+    len = nodeid_dump_len(dump, buff + size - dump);
+    if (len < 0 || dump + len + metadata_size > buff + size) {
+      return -1;
+    }
+    if (view_add(v, ref, v->current_size, int_rcpy(p), with_flags ? p[sizeof(uint32_t)] : 0, dump, len, dump + len) < 0) {
+      return -1;
+    }
+    p = dump + len + metadata_size;
+  }
+
+  return v->current_size;
+}
+
+int entries_parse(struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int size)
+{
+  return parse(v, ref, buff, size, 0);
+}
+
+/* Parse the message into a temporary view, and copy it in a new cache */
+static struct peer_cache *undump(const uint8_t *buff, int size, int with_flags)
+{
+  struct peer_cache *v, *res = NULL;
+  int i, n;
+
+  v = cache_view_init(INDEX_MIN_SIZE);
+  if (v == NULL) {
+    return NULL;
+  }
+  n = parse(v, NULL, buff, size, with_flags);
+  if (n >= 0) {
+    res = cache_init(n ? n : 1, v->metadata_size, 0);
+  }
+  for (i = 0; res && i < n; i++) {
+    res->entries[i] = v->entries[i];
+    res->entries[i].id = nodeid_dup(v->entries[i].id);
+    if (res->entries[i].id == NULL) {
+      res->current_size = i;
+      cache_free(res);
+      res = NULL;
+    }
+  }
+  if (res) {
+    if (res->metadata_size) {
+      memcpy(res->metadata, v->metadata, n * res->metadata_size);
+    }
+    res->current_size = n;
+    index_update(res, 0, n);
+  }
+  cache_free(v);
+
+  return res;
+}
+
+struct peer_cache *entries_undump(const uint8_t *buff, int size)
+{
+  return undump(buff, size, 0);
+}
+
+struct peer_cache *entries_undump_flags(const uint8_t *buff, int size)
+{
+  return undump(buff, size, 1);
+}
+
+int entries_parse_compact(struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int size)
+{
+  const uint8_t *p = buff + 1, *end = buff + size;
+  const uint8_t *dict[META_DICT_SIZE];
+  uint32_t cache_size, metadata_size;
+  int n_dict = 0, res;
+
+  if (v->pool == NULL || size < 1 || buff[0] != TOPO_COMPACT_VERSION) {
+    return -1;
+  }
+  if ((res = varint_rcpy(p, end, &cache_size)) < 0) {
+    return -1;
+  }
+  p += res;
+  if ((res = varint_rcpy(p, end, &metadata_size)) < 0 || metadata_size > MAX_METADATA_SIZE ||
+      view_reserve(v, cache_size < MAX_ENTRIES ? cache_size : MAX_ENTRIES, metadata_size) < 0) {
+    return -1;
+  }
+  p += res;
+  v->generation++;
+  v->current_size = 0;
+  while (p < end) {
+    uint8_t dump[MAX_DUMP_SIZE];
+    const uint8_t *meta = NULL;
+    uint32_t timestamp, m;
+    int len;
+
+    if ((res = varint_rcpy(p, end, &timestamp)) < 0) {
+      return -1;
+    }
+    p += res;
+    len = end - p;
+    if (nodeid_compact_expand(dump, p, sizeof(dump), &len) < 0) {
+      return -1;
+    }
     p += len;
     if (metadata_size) {
-      memcpy(meta, p, metadata_size);
-      p += metadata_size;
-      meta += metadata_size;
+      /* 0: the metadata follows (and goes in the dictionary), k: dictionary entry k - 1 */
+      if ((res = varint_rcpy(p, end, &m)) < 0) {
+        return -1;
+      }
+      p += res;
+      if (m == 0) {
+        if (end - p < metadata_size) {
+          return -1;
+        }
+        meta = p;
+        p += metadata_size;
+        if (n_dict < META_DICT_SIZE) {
+          dict[n_dict++] = meta;
+        }
+      } else if (m <= n_dict) {
+        meta = dict[m - 1];
+      } else {
+        return -1;
+      }
+    }
+    if (p > end || (len = nodeid_dump_len(dump, sizeof(dump))) < 0 ||
+        view_add(v, ref, v->current_size, timestamp, 0, dump, len, meta) < 0) {
+      return -1;
     }
   }
-  res->current_size = i;
-if (p - buff != size) { fprintf(stderr, "Waz!! %d != %d\n", (int)(p - buff), size); exit(-1);}
 
-  return res;
+  return v->current_size;
+}
+
+/*
+ * Take the nodeID of the i-th entry of a view: from its pool, from the
+ * cache owning it (if known), or as a copy
+ */
+static struct nodeID *view_take(const struct peer_cache *v, int i, const struct peer_cache *owner)
+{
+  const struct cache_entry *e = &v->entries[i];
+  struct peer_cache *pool = v->pool;
+  int pos;
+
+  pos = index_find(pool, e->id, e->hash);
+  if (pos >= 0 && pool->entries[pos].id == e->id) {
+    index_forget(pool, pos);
+    pool->entries[pos] = pool->entries[--pool->current_size];
+    index_update(pool, pos, pos < pool->current_size ? pos + 1 : pos);
+
+    return e->id;
+  }
+  pos = owner ? index_find(owner, e->id, e->hash) : -1;
+  if (pos >= 0 && owner->entries[pos].id == e->id) {
+    index_forget(owner, pos);
+    owner->entries[pos].id = NULL;
+
+    return e->id;
+  }
+
+  return nodeid_dup(e->id);
 }
 
 int cache_header_dump(uint8_t *b, const struct peer_cache *c, int include_me)
@@ -337,7 +915,7 @@ int cache_header_dump(uint8_t *b, const struct peer_cache *c, int include_me)
   return 8;
 }
 
-int entry_dump(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_size)
+static int dump(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_size, int with_flags)
 {
   int res;
   int size = 0;
@@ -347,6 +925,9 @@ int entry_dump(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_s
   }
   int_cpy(b, c->entries[i].timestamp);
   size = +4;
+  if (with_flags) {
+    b[size++] = c->entries[i].flags;
+  }
   res = nodeid_dump(b + size, c->entries[i].id, max_write_size - size);
   if (res < 0 ) {
     return -1;
@@ -363,46 +944,209 @@ int entry_dump(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_s
   return size;
 }
 
+int entry_dump(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_size)
+{
+  return dump(b, c, i, max_write_size, 0);
+}
+
+int entry_dump_flags(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_size)
+{
+  return dump(b, c, i, max_write_size, 1);
+}
+
+int cache_header_dump_compact(uint8_t *b, const struct peer_cache *c, int include_me)
+{
+  int size = 1;
+
+  b[0] = TOPO_COMPACT_VERSION;
+  size += varint_cpy(b + size, c->cache_size + (include_me ? 1 : 0));
+  size += varint_cpy(b + size, c->metadata_size);
+
+  return size;
+}
+
+int entry_dump_compact(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_size, struct meta_dict *d)
+{
+  uint8_t tmp[5 + MAX_COMPACT_SIZE];
+  const uint8_t *meta = c->metadata + c->metadata_size * i;
+  int res, size, k;
+
+  if (i && (i >= c->cache_size - 1)) {
+    return 0;
+  }
+  size = varint_cpy(tmp, c->entries[i].timestamp);
+  res = nodeid_dump_compact(tmp + size, c->entries[i].id, sizeof(tmp) - size);
+  if (res < 0) {
+    return -2;
+  }
+  size += res;
+  if (size > max_write_size) {
+    return -1;
+  }
+  memcpy(b, tmp, size);
+  if (c->metadata_size) {
+    for (k = 0; k < d->n; k++) {
+      if (memcmp(d->meta[k], meta, c->metadata_size) == 0) {
+        break;
+      }
+    }
+    if (k < d->n) {
+      if (max_write_size - size < 5) {
+        return -1;
+      }
+      size += varint_cpy(b + size, k + 1);
+    } else {
+      if (max_write_size - size < 1 + c->metadata_size) {
+        return -1;
+      }
+      b[size++] = 0;
+      memcpy(b + size, meta, c->metadata_size);
+      size += c->metadata_size;
+      if (d->n < META_DICT_SIZE) {
+        d->meta[d->n++] = meta;
+      }
+    }
+  }
+
+  return size;
+}
+
+int cache_pos(const struct peer_cache *c, const struct nodeID *id)
+{
+  return cache_find(c, id);
+}
+
+struct rank_context {
+  const struct peer_cache *c;
+  ranking_function rank;
+  const void *target_meta;
+};
+
+/* Entry b must be ranked before entry a */
+static int ranks_before(const struct rank_context *r, int b, int a)
+{
+  const struct peer_cache *c = r->c;
+
+  if (r->rank == NULL) {
+    return c->entries[b].timestamp < c->entries[a].timestamp;
+  }
+
+  return r->rank(r->target_meta, c->metadata + c->metadata_size * a, c->metadata + c->metadata_size * b) == 2;
+}
+
+/* Stable merge sort of the entries positions, O(n log n) calls to the ranking function */
+static void rank_sort(const struct rank_context *r, int *v, int *tmp, int n)
+{
+  int i, j, k, half = n / 2;
+
+  if (n < 2) {
+    return;
+  }
+  rank_sort(r, v, tmp, half);
+  rank_sort(r, v + half, tmp, n - half);
+  memcpy(tmp, v, half * sizeof(int));
+  for (i = 0, j = half, k = 0; i < half && j < n; k++) {
+    v[k] = ranks_before(r, v[j], tmp[i]) ? v[j++] : tmp[i++];
+  }
+  while (i < half) {
+    v[k++] = tmp[i++];
+  }
+}
+
 struct peer_cache *cache_rank (const struct peer_cache *c, ranking_function rank, const struct nodeID *target, const void *target_meta)
 {
   struct peer_cache *res;
-  int i,j,pos;
+  struct rank_context r;
+  int i, n, *v;
 
   res = cache_init(c->cache_size, c->metadata_size, c->max_timestamp);
   if (res == NULL) {
     return res;
   }
+  v = malloc((2 * c->current_size + 1) * sizeof(int));
+  if (v == NULL) {
+    cache_free(res);
 
-  for (i = 0; i < c->current_size; i++) {
+    return NULL;
+  }
+
+  /*
+   * Entries that rank the same are in reverse order (a new entry used to
+   * be inserted before the equivalent ones)
+   */
+  for (i = c->current_size - 1, n = 0; i >= 0; i--) {
     if (!target || !nodeid_equal(c->entries[i].id,target)) {
-      pos = 0;
-      for (j=0; j<res->current_size;j++) {
-        if (((rank != NULL) && rank(target_meta, c->metadata+(c->metadata_size * i), res->metadata+(res->metadata_size * j)) == 2) ||
-            ((rank == NULL) && res->entries[j].timestamp < c->entries[i].timestamp)) {
-          pos++;
-        }
-      }
-      if (c->metadata_size) {
-        memmove(res->metadata + (pos + 1) * res->metadata_size, res->metadata + pos * res->metadata_size, (res->current_size - pos) * res->metadata_size);
-        memcpy(res->metadata + pos * res->metadata_size, c->metadata+(c->metadata_size * i), res->metadata_size);
-      }
-      for (j = res->current_size; j > pos; j--) {
-        res->entries[j] = res->entries[j - 1];
-      }
-      res->entries[pos].id = nodeid_dup(c->entries[i].id);
-      res->entries[pos].timestamp = c->entries[i].timestamp;
-      res->current_size++;
+      v[n++] = i;
     }
   }
+  r.c = c;
+  r.rank = rank;
+  r.target_meta = target_meta;
+  rank_sort(&r, v, v + n, n);
+
+  for (i = 0; i < n; i++) {
+    res->entries[i] = c->entries[v[i]];
+    res->entries[i].id = nodeid_dup(c->entries[v[i]].id);
+    if (c->metadata_size) {
+      memcpy(res->metadata + res->metadata_size * i, c->metadata + c->metadata_size * v[i], c->metadata_size);
+    }
+  }
+  res->current_size = n;
+  index_update(res, 0, n);
+  free(v);
+  res->blist = c->blist;
+  if (res->blist) {
+    res->blist->refs++;
+  }
 
   return res;
 }
 
-struct peer_cache *cache_union(const struct peer_cache *c1, const struct peer_cache *c2, int *size)
+/*
+ * Move the i-th entry of c (if it is not already there) at the end of dst;
+ * if c is a view, owner is the cache its nodeIDs might be borrowed from
+ */
+static int cache_append(struct peer_cache *dst, const struct peer_cache *c, int i, const struct peer_cache *owner)
+{
+  struct cache_entry e = c->entries[i];
+
+  if (e.id == NULL || in_cache(dst, &e) >= 0) {
+    return 0;
+  }
+  if (c->pool) {
+    e.id = view_take(c, i, owner);
+    if (e.id == NULL) {
+      return 0;
+    }
+  } else {
+    index_forget(c, i);
+  }
+  if (dst->metadata_size) {
+    memcpy(dst->metadata + dst->current_size * dst->metadata_size, c->metadata + i * c->metadata_size, c->metadata_size);
+  }
+  dst->entries[dst->current_size++] = e;
+  c->entries[i].id = NULL;
+  index_update(dst, dst->current_size - 1, dst->current_size);
+
+  return 1;
+}
+
+/* The blacklist of c1 goes to dst, and refuses the entries of c2 */
+static void blist_move(struct peer_cache *dst, struct peer_cache *c1)
+{
+  dst->blist = c1->blist;
+  c1->blist = NULL;
+}
+
+static int admitted(const struct peer_cache *dst, const struct peer_cache *c2, int n)
+{
+  return c2->entries[n].id && !cache_blacklisted(dst, c2->entries[n].id);
+}
+
+struct peer_cache *cache_union(struct peer_cache *c1, const struct peer_cache *c2, int *size)
 {
   int n, pos;
   struct peer_cache *new_cache;
-  uint8_t *meta;
 
   if (c1->metadata_size != c2->metadata_size) {
     return NULL;
@@ -413,30 +1157,25 @@ struct peer_cache *cache_union(const struct peer_cache *c1, const struct peer_ca
     return NULL;
   }
 
-  meta = new_cache->metadata;
-
   for (n = 0; n < c1->current_size; n++) {
-    if (new_cache->metadata_size) {
-      memcpy(meta, c1->metadata + n * c1->metadata_size, c1->metadata_size);
-      meta += new_cache->metadata_size;
-    }
-    new_cache->entries[new_cache->current_size++] = c1->entries[n];
-    c1->entries[n].id = NULL;
+    cache_append(new_cache, c1, n, NULL);
   }
+  blist_move(new_cache, c1);
   
   for (n = 0; n < c2->current_size; n++) {
+    if (c2->entries[n].id == NULL) {
+      continue;
+    }
     pos = in_cache(new_cache, &c2->entries[n]);
     if (pos >= 0 && new_cache->entries[pos].timestamp > c2->entries[n].timestamp) {
-      cache_metadata_update(new_cache, c2->entries[n].id, c2->metadata + n * c2->metadata_size, c2->metadata_size);
-      new_cache->entries[pos].timestamp = c2->entries[n].timestamp;
-    }
-    if (pos < 0) {
       if (new_cache->metadata_size) {
-        memcpy(meta, c2->metadata + n * c2->metadata_size, c2->metadata_size);
-        meta += new_cache->metadata_size;
+        memcpy(new_cache->metadata + pos * new_cache->metadata_size, c2->metadata + n * c2->metadata_size, c2->metadata_size);
       }
-      new_cache->entries[new_cache->current_size++] = c2->entries[n];
-      c2->entries[n].id = NULL;
+      new_cache->entries[pos].timestamp = c2->entries[n].timestamp;
+      new_cache->entries[pos].flags = c2->entries[n].flags;
+    }
+    if (pos < 0 && admitted(new_cache, c2, n)) {
+      cache_append(new_cache, c2, n, c1);
     }
   }
   *size = new_cache->current_size;
@@ -452,12 +1191,23 @@ int cache_resize (struct peer_cache *c, int size)
     return c->current_size;
   }
 
+  if (dif < 0) {
+    int i;
+
+    for (i = size; i < c->current_size; i++) {
+      index_forget(c, i);
+    }
+  }
   c->entries = realloc(c->entries, sizeof(struct cache_entry) * size);
   if (dif > 0) {
     memset(c->entries + c->cache_size, 0, sizeof(struct cache_entry) * dif);
   } else if (c->current_size > size) {
     c->current_size = size;
   }
+  if (c->index == NULL && size >= INDEX_MIN_SIZE) {
+    c->index = nodeid_map_init(size);
+    index_update(c, 0, c->current_size);
+  }
 
   if (c->metadata_size) {
     c->metadata = realloc(c->metadata, c->metadata_size * size);
@@ -471,85 +1221,54 @@ int cache_resize (struct peer_cache *c, int size)
   return c->current_size;
 }
   
-struct peer_cache *merge_caches(const struct peer_cache *c1, const struct peer_cache *c2, int newsize, int *source)
+struct peer_cache *merge_caches(struct peer_cache *c1, const struct peer_cache *c2, int newsize, int *source)
 {
   int n1, n2;
   struct peer_cache *new_cache;
-  uint8_t *meta;
 
   new_cache = cache_init(newsize, c1->metadata_size, c1->max_timestamp);
   if (new_cache == NULL) {
     return NULL;
   }
+  blist_move(new_cache, c1);
 
-  meta = new_cache->metadata;
   *source = 0;
   for (n1 = 0, n2 = 0; new_cache->current_size < new_cache->cache_size;) {
     if ((n1 == c1->current_size) && (n2 == c2->current_size)) {
       return new_cache;
     }
-    if (n1 == c1->current_size) {
-      if (in_cache(new_cache, &c2->entries[n2]) < 0) {
-        if (new_cache->metadata_size) {
-          memcpy(meta, c2->metadata + n2 * c2->metadata_size, c2->metadata_size);
-          meta += new_cache->metadata_size;
-        }
-        new_cache->entries[new_cache->current_size++] = c2->entries[n2];
-        c2->entries[n2].id = NULL;
-        *source |= 0x02;
-      }
-      n2++;
-    } else if (n2 == c2->current_size) {
-      if (in_cache(new_cache, &c1->entries[n1]) < 0) {
-        if (new_cache->metadata_size) {
-          memcpy(meta, c1->metadata + n1 * c1->metadata_size, c1->metadata_size);
-          meta += new_cache->metadata_size;
-        }
-        new_cache->entries[new_cache->current_size++] = c1->entries[n1];
-        c1->entries[n1].id = NULL;
+    /* the youngest entry first (c2 on ties) */
+    if (n2 == c2->current_size ||
+        (n1 < c1->current_size && c2->entries[n2].timestamp > c1->entries[n1].timestamp)) {
+      if (cache_append(new_cache, c1, n1, NULL)) {
         *source |= 0x01;
       }
       n1++;
     } else {
-      if (c2->entries[n2].timestamp > c1->entries[n1].timestamp) {
-        if (in_cache(new_cache, &c1->entries[n1]) < 0) {
-          if (new_cache->metadata_size) {
-            memcpy(meta, c1->metadata + n1 * c1->metadata_size, c1->metadata_size);
-            meta += new_cache->metadata_size;
-          }
-          new_cache->entries[new_cache->current_size++] = c1->entries[n1];
-          c1->entries[n1].id = NULL;
-          *source |= 0x01;
-        }
-        n1++;
-      } else {
-        if (in_cache(new_cache, &c2->entries[n2]) < 0) {
-          if (new_cache->metadata_size) {
-            memcpy(meta, c2->metadata + n2 * c2->metadata_size, c2->metadata_size);
-            meta += new_cache->metadata_size;
-          }
-          new_cache->entries[new_cache->current_size++] = c2->entries[n2];
-          c2->entries[n2].id = NULL;
-          *source |= 0x02;
-        }
-        n2++;
+      if (admitted(new_cache, c2, n2) && cache_append(new_cache, c2, n2, c1)) {
+        *source |= 0x02;
       }
+      n2++;
     }
   }
 
   return new_cache;
 }
 
+/*
+ * Every entry must have the right hash and be found (by the index, if
+ * any) at its position: this is O(n), and also finds the duplicates
+ */
 void cache_check(const struct peer_cache *c)
 {
-  int i, j;
+  int i;
 
   for (i = 0; i < c->current_size; i++) {
-    for (j = i + 1; j < c->current_size; j++) {
-      if (nodeid_equal(c->entries[i].id, c->entries[j].id)) {
-        fprintf(stderr, "WTF!!!! %d = %d!!!\n", i, j);
-        *((char *)0) = 1;
-      }
+    const struct cache_entry *e = &c->entries[i];
+
+    if (e->id == NULL || e->hash != nodeid_hash(e->id) || index_find(c, e->id, e->hash) != i) {
+      fprintf(stderr, "Inconsistent cache: entry %d!\n", i);
+      abort();
     }
   }
 }
@@ -3,6 +3,7 @@
 
 struct peer_cache;
 struct cache_entry;
+struct prng;
 typedef int (*ranking_function)(const void *target, const void *p1, const void *p2);	// FIXME!
 
 struct peer_cache *cache_init(int n, int metadata_size, int max_timestamp);
@@ -15,19 +16,74 @@ int cache_add_ranked(struct peer_cache *c, struct nodeID *neighbour, const void
 int cache_add(struct peer_cache *c, struct nodeID *neighbour, const void *meta, int meta_size);
 int cache_del(struct peer_cache *c, const struct nodeID *neighbour);
 
-struct nodeID *rand_peer(const struct peer_cache *c, void **meta, int max);
+struct nodeID *rand_peer(const struct peer_cache *c, void **meta, int max, struct prng *r);
 struct nodeID *last_peer(const struct peer_cache *c);
-struct peer_cache *rand_cache(struct peer_cache *c, int n);
+struct peer_cache *rand_cache(struct peer_cache *c, int n, struct prng *r);
 
 struct peer_cache *entries_undump(const uint8_t *buff, int size);
+struct peer_cache *entries_undump_flags(const uint8_t *buff, int size);
+/*
+ * Views: reusable caches to parse messages into. The nodeIDs of the
+ * entries are borrowed from ref (if they are in it) or from the view,
+ * which keeps the ones it undumped for the following messages, so
+ * parsing does not allocate memory in the steady state. A view is valid
+ * until the next entries_parse() or until ref changes; merge_caches()
+ * and cache_union() take its nodeIDs (and the ones borrowed from c1).
+ */
+struct peer_cache *cache_view_init(int pool_size);
+int entries_parse(struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int size);
 int cache_header_dump(uint8_t *b, const struct peer_cache *c, int include_me);
 int entry_dump(uint8_t *b, const struct peer_cache *e, int i, size_t max_write_size);
+int entry_dump_flags(uint8_t *b, const struct peer_cache *e, int i, size_t max_write_size);
 
-struct peer_cache *merge_caches(const struct peer_cache *c1, const struct peer_cache *c2, int newsize, int *source);
+/*
+ * Compact encoding (version TOPO_COMPACT_VERSION): a version byte, the
+ * cache and metadata sizes as varints, then for each entry its age
+ * (varint), its nodeID (nodeid_dump_compact()) and, if there is metadata,
+ * a varint k: the metadata follows if k == 0, or it is the same as the
+ * k-th metadata sent in full in the message.
+ * entry_dump_compact() returns -2 if the nodeID has no compact form.
+ */
+#define TOPO_COMPACT_VERSION 1
+#define META_DICT_SIZE 16
+
+struct meta_dict {
+  const uint8_t *meta[META_DICT_SIZE];
+  int n;
+};
+
+int cache_header_dump_compact(uint8_t *b, const struct peer_cache *c, int include_me);
+int entry_dump_compact(uint8_t *b, const struct peer_cache *c, int i, size_t max_write_size, struct meta_dict *d);
+int entries_parse_compact(struct peer_cache *v, const struct peer_cache *ref, const uint8_t *buff, int size);
+
+/* position of a nodeID in the cache, or -1 */
+int cache_pos(const struct peer_cache *c, const struct nodeID *id);
+
+struct peer_cache *merge_caches(struct peer_cache *c1, const struct peer_cache *c2, int newsize, int *source);
 struct peer_cache *cache_rank (const struct peer_cache *c, ranking_function rank, const struct nodeID *target, const void *target_meta);
-struct peer_cache *cache_union(const struct peer_cache *c1, const struct peer_cache *c2, int *size);
+struct peer_cache *cache_union(struct peer_cache *c1, const struct peer_cache *c2, int *size);
 int cache_resize (struct peer_cache *c, int size);
 
+/*
+ * Policies. Each entry has some flags, reset to 0 when it is added and
+ * kept by the merge functions, that the user of the cache can use to
+ * track the state of a peer (the *_flags() dump functions send them).
+ * A cache can have a blacklist of size nodeIDs (0: as large as the
+ * cache; when full, the oldest blacklisted nodeID is forgotten), which
+ * are forgiven after timeout usecs (0: never): its nodeIDs are refused
+ * by merge_caches() and cache_union(), which move the blacklist of c1
+ * in the new cache; cache_rank() shares it, and cache_add() removes the
+ * added nodeID from it. Ageing is done by cache_update() (entries
+ * older than max_timestamp expire, if it is not 0), and ranking by the
+ * ranking functions.
+ */
+int cache_flags(const struct peer_cache *c, int i);
+void cache_flags_set(struct peer_cache *c, int i, int flags);
+int cache_blacklist_init(struct peer_cache *c, int size, uint64_t timeout);
+struct nodeID *cache_blacklist(struct peer_cache *c, struct nodeID *id);
+int cache_blacklisted(const struct peer_cache *c, const struct nodeID *id);
+void cache_unblacklist(struct peer_cache *c, const struct nodeID *id);
+
 void cache_check(const struct peer_cache *c);
 
 #endif	/* TOPOCACHE */
@@ -4,8 +4,6 @@
  *  This is free software; see lgpl-2.1.txt
  */
 
-#include <sys/time.h>
-#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,20 +11,24 @@
 #include <string.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "peersampler_iface.h"
 #include "../Cache/topocache.h"
 #include "../Cache/cyclon_proto.h"
 #include "../Cache/proto.h"
 #include "config.h"
 #include "grapes_msg_types.h"
+#include "../prng.h"
+#include "../check.h"
 
 #define DEFAULT_CACHE_SIZE 10
 
 struct peersampler_context{
-  uint64_t currtime;
+  struct timer *timer;
   int cache_size;
   int sent_entries;
   struct peer_cache *local_cache;
+  struct peer_cache *remote_cache;	/* view of the last received message */
   bool bootstrap;
   int bootstrap_period;
   int period;
@@ -36,18 +38,9 @@ struct peersampler_context{
 
   struct cyclon_proto_context *pc;
   const struct nodeID **r;
+  struct prng rng;	/* shuffled entries */
 };
 
-
-static uint64_t gettime(void)
-{
-  struct timeval tv;
-
-  gettimeofday(&tv, NULL);
-
-  return tv.tv_usec + tv.tv_sec * 1000000ull;
-}
-
 static struct peersampler_context* cyclon_context_init(void)
 {
   struct peersampler_context* con;
@@ -57,23 +50,10 @@ static struct peersampler_context* cyclon_context_init(void)
   con->bootstrap = true;
   con->bootstrap_period = 2000000;
   con->period = 10000000;
-  con->currtime = gettime();
 
   return con;
 }
 
-static int time_to_send(struct peersampler_context* con)
-{
-  int p = con->bootstrap ? con->bootstrap_period : con->period;
-  if (gettime() - con->currtime > p) {
-    con->currtime += p;
-
-    return 1;
-  }
-
-  return 0;
-}
-
 static void cache_add_cache(struct peer_cache *dst, const struct peer_cache *add)
 {
   int i, meta_size;
@@ -86,6 +66,27 @@ static void cache_add_cache(struct peer_cache *dst, const struct peer_cache *add
 }
 
 
+/* Timer callback: start a shuffle with the oldest peer */
+static void cyclon_send(void *p)
+{
+  struct peersampler_context *context = p;
+
+  if (context->flying_cache) {
+    cache_add_cache(context->local_cache, context->flying_cache);
+    cache_free(context->flying_cache);
+    context->flying_cache = NULL;
+  }
+  cache_update(context->local_cache);
+  context->dst = last_peer(context->local_cache);
+  if (context->dst == NULL) {
+    return;
+  }
+  context->dst = nodeid_dup(context->dst);
+  cache_del(context->local_cache, context->dst);
+  context->flying_cache = rand_cache(context->local_cache, context->sent_entries - 1, &context->rng);
+  cyclon_query(context->pc, context->flying_cache, context->dst);
+}
+
 /*
  * Public Functions!
  */
@@ -93,7 +94,7 @@ static struct peersampler_context* cyclon_init(struct nodeID *myID, const void *
 {
   struct tag *cfg_tags;
   struct peersampler_context *con;
-  int res;
+  int res, mtu, seed, instance;
 
   con = cyclon_context_init();
   if (!con) return NULL;
@@ -107,20 +108,51 @@ static struct peersampler_context* cyclon_init(struct nodeID *myID, const void *
   if (!res) {
     con->sent_entries = con->cache_size / 2;
   }
+  res = config_value_int(cfg_tags, "mtu", &mtu);
+  if (!res) {
+    mtu = 0;
+  }
+  res = config_value_int(cfg_tags, "instance", &instance);
+  if (!res) {
+    instance = 0;
+  }
+  res = config_value_int(cfg_tags, "seed", &seed);
+  if (!res) {
+    seed = rand();
+  }
   free(cfg_tags);
+  prng_seed(&con->rng, seed);
 
   con->local_cache = cache_init(con->cache_size, metadata_size, 0);
   if (con->local_cache == NULL) {
     free(con);
     return NULL;
   }
+  con->remote_cache = cache_view_init(con->cache_size + 1);
+  if (con->remote_cache == NULL) {
+    cache_free(con->local_cache);
+    free(con);
+    return NULL;
+  }
 
   con->pc = cyclon_proto_init(myID, metadata, metadata_size);
   if (!con->pc){
+    cache_free(con->remote_cache);
     free(con->local_cache);
     free(con);
     return NULL;
   }
+  if (mtu && cyclon_proto_mtu_set(con->pc, mtu) < 0) {
+    fprintf(stderr, "Peer Sampler: invalid MTU %d\n", mtu);
+  }
+  cyclon_proto_instance_set(con->pc, instance);	/* checked by psample_init() */
+  con->timer = timer_add(con->bootstrap_period, cyclon_send, con);
+  if (con->timer == NULL) {
+    cache_free(con->remote_cache);
+    cache_free(con->local_cache);
+    free(con);
+    return NULL;
+  }
 
   return con;
 }
@@ -128,7 +160,7 @@ static struct peersampler_context* cyclon_init(struct nodeID *myID, const void *
 static int cyclon_add_neighbour(struct peersampler_context *context, struct nodeID *neighbour, const void *metadata, int metadata_size)
 {
   if (!context->flying_cache) {
-    context->flying_cache = rand_cache(context->local_cache, context->sent_entries - 1);
+    context->flying_cache = rand_cache(context->local_cache, context->sent_entries - 1, &context->rng);
   }
   if (cache_add(context->local_cache, neighbour, metadata, metadata_size) < 0) {
     return -1;
@@ -139,11 +171,11 @@ static int cyclon_add_neighbour(struct peersampler_context *context, struct node
 
 static int cyclon_parse_data(struct peersampler_context *context, const uint8_t *buff, int len)
 {
-  cache_check(context->local_cache);
+  CHECK_CALL(cache_check(context->local_cache));
   if (len) {
     const struct topo_header *h = (const struct topo_header *)buff;
-    struct peer_cache *remote_cache;
     struct peer_cache *sent_cache = NULL;
+    int type;
 
     if (h->protocol != MSG_TYPE_TOPOLOGY) {
       fprintf(stderr, "Peer Sampler: Wrong protocol!\n");
@@ -151,46 +183,40 @@ static int cyclon_parse_data(struct peersampler_context *context, const uint8_t
       return -1;
     }
 
-    context->bootstrap = false;
+    if (context->bootstrap) {
+      context->bootstrap = false;
+      timer_mod(context->timer, context->period);
+    }
+
+    type = cyclon_proto_parse(context->pc, context->remote_cache, context->local_cache, buff, len);
+    if (type < 0) {
+      fprintf(stderr, "Peer Sampler: Malformed message!\n");
 
-    remote_cache = entries_undump(buff + sizeof(struct topo_header), len - sizeof(struct topo_header));
-    if (h->type == CYCLON_QUERY) {
-      sent_cache = rand_cache(context->local_cache, context->sent_entries);
-      cyclon_reply(context->pc, remote_cache, sent_cache);
-      context->dst = NULL;
+      return -1;
     }
-    cache_check(context->local_cache);
-    cache_add_cache(context->local_cache, remote_cache);
-    cache_free(remote_cache);
-    if (sent_cache) {
-      cache_add_cache(context->local_cache, sent_cache);
-      cache_free(sent_cache);
-    } else {
-      if (context->flying_cache) {
-        cache_add_cache(context->local_cache, context->flying_cache);
-        cache_free(context->flying_cache);
-        context->flying_cache = NULL;
+    /* type == 0: fragment of a larger message, not complete yet */
+    if (type > 0) {
+      if (type == CYCLON_QUERY) {
+        sent_cache = rand_cache(context->local_cache, context->sent_entries, &context->rng);
+        cyclon_reply(context->pc, context->remote_cache, sent_cache);
+        context->dst = NULL;
+      }
+      CHECK_CALL(cache_check(context->local_cache));
+      cache_add_cache(context->local_cache, context->remote_cache);
+      if (sent_cache) {
+        cache_add_cache(context->local_cache, sent_cache);
+        cache_free(sent_cache);
+      } else {
+        if (context->flying_cache) {
+          cache_add_cache(context->local_cache, context->flying_cache);
+          cache_free(context->flying_cache);
+          context->flying_cache = NULL;
+        }
       }
     }
   }
 
-  if (time_to_send(context)) {
-    if (context->flying_cache) {
-      cache_add_cache(context->local_cache, context->flying_cache);
-      cache_free(context->flying_cache);
-      context->flying_cache = NULL;
-    }
-    cache_update(context->local_cache);
-    context->dst = last_peer(context->local_cache);
-    if (context->dst == NULL) {
-      return 0;
-    }
-    context->dst = nodeid_dup(context->dst);
-    cache_del(context->local_cache, context->dst);
-    context->flying_cache = rand_cache(context->local_cache, context->sent_entries - 1);
-    return cyclon_query(context->pc, context->flying_cache, context->dst);
-  }
-  cache_check(context->local_cache);
+  CHECK_CALL(cache_check(context->local_cache));
 
   return 0;
 }
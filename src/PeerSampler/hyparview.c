@@ -0,0 +1,504 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "net_helper.h"
+#include "grapes_timers.h"
+#include "peersampler_iface.h"
+#include "../Cache/topocache.h"
+#include "../Cache/hyparview_proto.h"
+#include "../Cache/proto.h"
+#include "config.h"
+#include "grapes_msg_types.h"
+#include "../prng.h"
+#include "../check.h"
+
+#define DEFAULT_CACHE_SIZE 5
+#define DEFAULT_KEEPALIVE_TIMEOUT 3
+
+/*
+ * HyParView: the neighbourhood is a small, symmetric, active view, and a
+ * larger passive view is kept (by periodic shuffles) to repair it. The
+ * active neighbours exchange keepalives (ACCEPT messages without entries)
+ * every keepalive_period; a neighbour is dropped as soon as a message to
+ * it cannot be sent, it disconnects, or it is not heard for keepalive_timeout
+ * periods, and a random passive peer is asked to replace it (with high
+ * priority, so that it cannot refuse, if the active view is empty).
+ * The random walks of the JOIN messages are not implemented: the new peer
+ * learns its passive view from the ACCEPT of its contact, and fills its
+ * active view from there
+ */
+struct peersampler_context{
+  struct timer *timer;
+  struct timer *keepalive;
+  int cache_size;	/* of the active view */
+  int passive_size;
+  int sent_entries;
+  int period;
+  int keepalive_period;
+  int metadata_size;
+  struct peer_cache *active;	/* expires the silent neighbours */
+  struct peer_cache *pending;	/* asked to become neighbours */
+  struct peer_cache *passive;
+  struct peer_cache *remote_cache;	/* view of the last received message */
+  struct nodeID *myID;
+
+  struct hyparview_proto_context *pc;
+  const struct nodeID **r;
+  struct prng rng;
+};
+
+static struct peersampler_context* hyparview_context_init(void)
+{
+  struct peersampler_context* con;
+  con = (struct peersampler_context*) calloc(1,sizeof(struct peersampler_context));
+
+  //Initialize context with default values
+  con->period = 10000000;
+  con->keepalive_period = 1000000;
+
+  return con;
+}
+
+static void hyparview_context_free(struct peersampler_context *con)
+{
+  timer_del(con->timer);
+  timer_del(con->keepalive);
+  if (con->remote_cache) cache_free(con->remote_cache);
+  if (con->passive) cache_free(con->passive);
+  if (con->pending) cache_free(con->pending);
+  if (con->active) cache_free(con->active);
+  free(con);
+}
+
+static int entries(const struct peer_cache *c)
+{
+  int n;
+
+  for (n = 0; nodeid(c, n); n++);
+
+  return n;
+}
+
+/* Refresh the age of a neighbour, returning 0 if it is not in the active view */
+static int active_refresh(struct peersampler_context *context, struct nodeID *id, const void *meta)
+{
+  if (cache_pos(context->active, id) < 0) {
+    return 0;
+  }
+  cache_del(context->active, id);
+  cache_add(context->active, id, meta, context->metadata_size);
+
+  return 1;
+}
+
+/* Add some entries (from the first one) to the passive view, dropping random ones when it is full */
+static void passive_merge(struct peersampler_context *context, struct peer_cache *c, int first)
+{
+  const uint8_t *meta;
+  int i, meta_size;
+
+  meta = get_metadata(c, &meta_size);
+  for (i = first; nodeid(c, i); i++) {
+    struct nodeID *id = nodeid(c, i);
+
+    if (nodeid_equal(id, context->myID) || cache_pos(context->active, id) >= 0 || cache_pos(context->pending, id) >= 0) {
+      continue;
+    }
+    if (cache_add(context->passive, id, meta + (meta_size * i), meta_size) == -2) {
+      cache_del(context->passive, rand_peer(context->passive, NULL, 0, &context->rng));
+      cache_add(context->passive, id, meta + (meta_size * i), meta_size);
+    }
+  }
+}
+
+/* Add n random entries of c to res (selection sampling: c is not modified) */
+static void sample_add(struct peer_cache *res, const struct peer_cache *c, int n, struct prng *r)
+{
+  const uint8_t *meta;
+  int i, size, meta_size;
+
+  meta = get_metadata(c, &meta_size);
+  size = entries(c);
+  for (i = 0; i < size && n > 0; i++) {
+    if (prng_uniform(r, size - i) < n) {
+      cache_add(res, nodeid(c, i), meta + (meta_size * i), meta_size);
+      n--;
+    }
+  }
+}
+
+/* Random entries to be shuffled: half from the active view (if active), the others from the passive one */
+static struct peer_cache *views_sample(struct peersampler_context *context, int n, int active)
+{
+  struct peer_cache *res;
+
+  if (n <= 0) {
+    return NULL;
+  }
+  res = cache_init(n, context->metadata_size, 0);
+  if (res == NULL) {
+    return NULL;
+  }
+  if (active) {
+    sample_add(res, context->active, n / 2, &context->rng);
+  }
+  sample_add(res, context->passive, n - entries(res), &context->rng);
+
+  return res;
+}
+
+/* Move the i-th neighbour to the passive view, telling it */
+static void active_disconnect(struct peersampler_context *context, int i)
+{
+  struct nodeID *id = nodeid(context->active, i);
+  const uint8_t *meta;
+  int meta_size;
+
+  hyparview_send(context->pc, HYPARVIEW_DISCONNECT, NULL, id);
+  meta = get_metadata(context->active, &meta_size);
+  if (cache_add(context->passive, id, meta + (meta_size * i), meta_size) == -2) {
+    cache_del(context->passive, rand_peer(context->passive, NULL, 0, &context->rng));
+    cache_add(context->passive, id, meta + (meta_size * i), meta_size);
+  }
+  cache_del(context->active, id);
+}
+
+/* Ask some passive peers to replace the missing neighbours */
+static void active_fill(struct peersampler_context *context)
+{
+  int n = entries(context->active), pending = entries(context->pending);
+
+  while (n + pending < context->cache_size) {
+    struct nodeID *id;
+    void *meta;
+
+    id = rand_peer(context->passive, &meta, 0, &context->rng);
+    if (id == NULL) {
+      return;
+    }
+    if (cache_add(context->pending, id, meta, context->metadata_size) < 0) {
+      return;
+    }
+    cache_del(context->passive, id);
+    id = nodeid(context->pending, 0);
+    if (hyparview_send(context->pc, n ? HYPARVIEW_NEIGHBOUR : HYPARVIEW_JOIN, NULL, id) < 0) {
+      cache_del(context->pending, id);
+    } else {
+      pending++;
+    }
+  }
+}
+
+/* Timer callback: expire the silent neighbours (and requests), and tell the others that we are alive */
+static void hyparview_keepalive(void *p)
+{
+  struct peersampler_context *context = p;
+  int i;
+
+  cache_update(context->active);
+  cache_update(context->pending);
+  for (i = entries(context->active) - 1; i >= 0; i--) {
+    struct nodeID *id = nodeid(context->active, i);
+
+    if (hyparview_send(context->pc, HYPARVIEW_ACCEPT, NULL, id) < 0) {
+      cache_del(context->active, id);
+    }
+  }
+  active_fill(context);
+}
+
+/* Timer callback: shuffle some entries with a random neighbour */
+static void hyparview_shuffle(void *p)
+{
+  struct peersampler_context *context = p;
+  struct peer_cache *sent_cache;
+  struct nodeID *dst;
+
+  dst = rand_peer(context->active, NULL, 0, &context->rng);
+  if (dst == NULL) {
+    return;
+  }
+  sent_cache = views_sample(context, context->sent_entries - 1, 1);
+  if (hyparview_send(context->pc, HYPARVIEW_SHUFFLE, sent_cache, dst) < 0) {
+    cache_del(context->active, dst);
+    active_fill(context);
+  }
+  if (sent_cache) {
+    cache_free(sent_cache);
+  }
+}
+
+/*
+ * Public Functions!
+ */
+static struct peersampler_context* hyparview_init(struct nodeID *myID, const void *metadata, int metadata_size, const char *config)
+{
+  struct tag *cfg_tags;
+  struct peersampler_context *con;
+  int res, mtu, seed, instance, timeout;
+
+  con = hyparview_context_init();
+  if (!con) return NULL;
+
+  cfg_tags = config_parse(config);
+  res = config_value_int(cfg_tags, "cache_size", &(con->cache_size));
+  if (!res) {
+    con->cache_size = DEFAULT_CACHE_SIZE;
+  }
+  res = config_value_int(cfg_tags, "passive_size", &(con->passive_size));
+  if (!res) {
+    con->passive_size = con->cache_size * 6;
+  }
+  res = config_value_int(cfg_tags, "sent_entries", &(con->sent_entries));
+  if (!res) {
+    con->sent_entries = con->cache_size + 2;
+  }
+  res = config_value_int(cfg_tags, "period", &(con->period));
+  res = config_value_int(cfg_tags, "keepalive_period", &(con->keepalive_period));
+  res = config_value_int(cfg_tags, "keepalive_timeout", &timeout);
+  if (!res || timeout < 1) {
+    timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+  }
+  res = config_value_int(cfg_tags, "mtu", &mtu);
+  if (!res) {
+    mtu = 0;
+  }
+  res = config_value_int(cfg_tags, "instance", &instance);
+  if (!res) {
+    instance = 0;
+  }
+  res = config_value_int(cfg_tags, "seed", &seed);
+  if (!res) {
+    seed = rand();
+  }
+  free(cfg_tags);
+  prng_seed(&con->rng, seed);
+  if (con->cache_size < 1 || con->passive_size < 1) {
+    free(con);
+    return NULL;
+  }
+
+  con->metadata_size = metadata_size;
+  con->myID = myID;
+  /* the entries are refreshed by each message, and aged every keepalive_period */
+  con->active = cache_init(con->cache_size, metadata_size, timeout + 1);
+  con->pending = cache_init(con->cache_size, metadata_size, timeout + 1);
+  con->passive = cache_init(con->passive_size, metadata_size, 0);
+  con->remote_cache = cache_view_init(con->sent_entries + 1);
+  if (con->active == NULL || con->pending == NULL || con->passive == NULL || con->remote_cache == NULL) {
+    hyparview_context_free(con);
+    return NULL;
+  }
+
+  con->pc = hyparview_proto_init(myID, metadata, metadata_size);
+  if (!con->pc){
+    hyparview_context_free(con);
+    return NULL;
+  }
+  if (mtu && hyparview_proto_mtu_set(con->pc, mtu) < 0) {
+    fprintf(stderr, "Peer Sampler: invalid MTU %d\n", mtu);
+  }
+  hyparview_proto_instance_set(con->pc, instance);	/* checked by psample_init() */
+  con->timer = timer_add(con->period, hyparview_shuffle, con);
+  con->keepalive = timer_add(con->keepalive_period, hyparview_keepalive, con);
+  if (con->timer == NULL || con->keepalive == NULL) {
+    hyparview_context_free(con);
+    return NULL;
+  }
+
+  return con;
+}
+
+static int hyparview_add_neighbour(struct peersampler_context *context, struct nodeID *neighbour, const void *metadata, int metadata_size)
+{
+  if (nodeid_equal(neighbour, context->myID) || cache_pos(context->active, neighbour) >= 0) {
+    return -1;
+  }
+  cache_del(context->passive, neighbour);
+  if (cache_add(context->pending, neighbour, metadata, metadata_size) < 0) {
+    return -1;
+  }
+
+  return hyparview_send(context->pc, entries(context->active) ? HYPARVIEW_NEIGHBOUR : HYPARVIEW_JOIN, NULL, neighbour);
+}
+
+static int hyparview_parse_data(struct peersampler_context *context, const uint8_t *buff, int len)
+{
+  CHECK_CALL(cache_check(context->active));
+  if (len) {
+    const struct topo_header *h = (const struct topo_header *)buff;
+    struct peer_cache *sent_cache = NULL;
+    struct nodeID *sender;
+    const uint8_t *meta;
+    int type, meta_size, n;
+
+    if (h->protocol != MSG_TYPE_TOPOLOGY) {
+      fprintf(stderr, "Peer Sampler: Wrong protocol!\n");
+
+      return -1;
+    }
+
+    type = hyparview_proto_parse(context->pc, context->remote_cache, buff, len);
+    if (type < 0) {
+      fprintf(stderr, "Peer Sampler: Malformed message!\n");
+
+      return -1;
+    }
+    /* type == 0: fragment of a larger message, not complete yet */
+    sender = nodeid(context->remote_cache, 0);
+    if (type == 0 || sender == NULL || nodeid_equal(sender, context->myID)) {
+      return 0;
+    }
+    meta = get_metadata(context->remote_cache, &meta_size);
+    if (meta_size != context->metadata_size) {
+      fprintf(stderr, "Peer Sampler: Wrong metadata size!\n");
+
+      return -1;
+    }
+    n = entries(context->active);
+    switch (type) {
+      case HYPARVIEW_JOIN:
+      case HYPARVIEW_NEIGHBOUR:
+        if (!active_refresh(context, sender, meta)) {
+          if (type == HYPARVIEW_NEIGHBOUR && n >= context->cache_size) {
+            hyparview_send(context->pc, HYPARVIEW_DISCONNECT, NULL, sender);
+            break;
+          }
+          if (n >= context->cache_size) {
+            active_disconnect(context, prng_uniform(&context->rng, n));
+          }
+          cache_del(context->pending, sender);
+          cache_del(context->passive, sender);
+          cache_add(context->active, sender, meta, meta_size);
+        }
+        sent_cache = views_sample(context, context->sent_entries - 1, 1);
+        hyparview_send(context->pc, HYPARVIEW_ACCEPT, sent_cache, sender);
+        break;
+      case HYPARVIEW_ACCEPT:
+        if (!active_refresh(context, sender, meta)) {
+          if (cache_pos(context->pending, sender) >= 0 && n < context->cache_size) {
+            cache_del(context->pending, sender);
+            cache_add(context->active, sender, meta, meta_size);
+          } else {
+            /* not a neighbour (anymore) */
+            cache_del(context->pending, sender);
+            hyparview_send(context->pc, HYPARVIEW_DISCONNECT, NULL, sender);
+          }
+        }
+        break;
+      case HYPARVIEW_DISCONNECT:
+        if (cache_pos(context->active, sender) < 0) {
+          /* a refused request: retry at the next keepalive, not in a loop */
+          cache_del(context->pending, sender);
+          passive_merge(context, context->remote_cache, 0);
+
+          return 0;
+        }
+        cache_del(context->active, sender);
+        break;
+      case HYPARVIEW_SHUFFLE:
+        active_refresh(context, sender, meta);
+        sent_cache = views_sample(context, context->sent_entries - 1, 0);
+        hyparview_send(context->pc, HYPARVIEW_SHUFFLE_REPLY, sent_cache, sender);
+        break;
+      case HYPARVIEW_SHUFFLE_REPLY:
+        active_refresh(context, sender, meta);
+        break;
+      default:
+        return 0;
+    }
+    /* the sender, if it is not a neighbour, and its entries are passive peers */
+    passive_merge(context, context->remote_cache, 0);
+    if (sent_cache) {
+      cache_free(sent_cache);
+    }
+    active_fill(context);
+  }
+
+  CHECK_CALL(cache_check(context->active));
+
+  return 0;
+}
+
+static const struct nodeID **hyparview_get_neighbourhood(struct peersampler_context *context, int *n)
+{
+  context->r = realloc(context->r, context->cache_size * sizeof(struct nodeID *));
+  if (context->r == NULL) {
+    return NULL;
+  }
+
+  for (*n = 0; nodeid(context->active, *n) && (*n < context->cache_size); (*n)++) {
+    context->r[*n] = nodeid(context->active, *n);
+  }
+
+  return context->r;
+}
+
+static const void *hyparview_get_metadata(struct peersampler_context *context, int *metadata_size)
+{
+  return get_metadata(context->active, metadata_size);
+}
+
+static int hyparview_grow_neighbourhood(struct peersampler_context *context, int n)
+{
+  context->cache_size += n;
+  cache_resize(context->active, context->cache_size);
+  cache_resize(context->pending, context->cache_size);
+  active_fill(context);
+
+  return context->cache_size;
+}
+
+static int hyparview_shrink_neighbourhood(struct peersampler_context *context, int n)
+{
+  if (context->cache_size <= n) {
+    return -1;
+  }
+  context->cache_size -= n;
+  while (entries(context->active) > context->cache_size) {
+    active_disconnect(context, entries(context->active) - 1);
+  }
+  while (entries(context->pending) > context->cache_size) {
+    cache_del(context->pending, last_peer(context->pending));
+  }
+  cache_resize(context->active, context->cache_size);
+  cache_resize(context->pending, context->cache_size);
+
+  return context->cache_size;
+}
+
+/* The neighbour is known to have failed: replace it immediately */
+static int hyparview_remove_neighbour(struct peersampler_context *context, const struct nodeID *neighbour)
+{
+  int res = cache_del(context->active, neighbour);
+
+  cache_del(context->pending, neighbour);
+  cache_del(context->passive, neighbour);
+  active_fill(context);
+
+  return res;
+}
+
+static int hyparview_change_metadata(struct peersampler_context *context, const void *metadata, int metadata_size)
+{
+  return hyparview_proto_change_metadata(context->pc, metadata, metadata_size);
+}
+
+struct peersampler_iface hyparview = {
+  .init = hyparview_init,
+  .change_metadata = hyparview_change_metadata,
+  .add_neighbour = hyparview_add_neighbour,
+  .parse_data = hyparview_parse_data,
+  .get_neighbourhood = hyparview_get_neighbourhood,
+  .get_metadata = hyparview_get_metadata,
+  .grow_neighbourhood = hyparview_grow_neighbourhood,
+  .shrink_neighbourhood = hyparview_shrink_neighbourhood,
+  .remove_neighbour = hyparview_remove_neighbour,
+};
@@ -4,8 +4,6 @@
  *  This is free software; see lgpl-2.1.txt
  */
 
-#include <sys/time.h>
-#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,6 +11,7 @@
 #include <string.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "peersampler_iface.h"
 #include "../Cache/topocache.h"
 #include "../Cache/ncast_proto.h"
@@ -27,9 +26,10 @@
 #define DEFAULT_PERIOD 10*1000*1000
 
 struct peersampler_context{
-  uint64_t currtime;
+  struct timer *timer;
   int cache_size;
   struct peer_cache *local_cache;
+  struct peer_cache *remote_cache;	/* view of the last received message */
   bool bootstrap;
   int bootstrap_period;
   int bootstrap_cycles;
@@ -39,15 +39,6 @@ struct peersampler_context{
   const struct nodeID **r;
 };
 
-static uint64_t gettime(void)
-{
-  struct timeval tv;
-
-  gettimeofday(&tv, NULL);
-
-  return tv.tv_usec + tv.tv_sec * 1000000ull;
-}
-
 static struct peersampler_context* ncast_context_init(void)
 {
   struct peersampler_context* con;
@@ -55,22 +46,18 @@ static struct peersampler_context* ncast_context_init(void)
 
   //Initialize context with default values
   con->bootstrap = true;
-  con->currtime = gettime();
   con->r = NULL;
 
   return con;
 }
 
-static int time_to_send(struct peersampler_context *context)
+/* Timer callback: gossip with a random peer */
+static void ncast_send(void *p)
 {
-  int p = context->bootstrap ? context->bootstrap_period : context->period;
-  if (gettime() - context->currtime > p) {
-    context->currtime += p;
+  struct peersampler_context *context = p;
 
-    return 1;
-  }
-
-  return 0;
+  cache_update(context->local_cache);
+  ncast_query(context->tc, context->local_cache);
 }
 
 /*
@@ -80,7 +67,7 @@ static struct peersampler_context* ncast_init(struct nodeID *myID, const void *m
 {
   struct tag *cfg_tags;
   struct peersampler_context *context;
-  int res, max_timestamp;
+  int res, max_timestamp, mtu, instance;
 
   context = ncast_context_init();
   if (!context) return NULL;
@@ -106,6 +93,14 @@ static struct peersampler_context* ncast_init(struct nodeID *myID, const void *m
   if (!res) {
     context->bootstrap_cycles = DEFAULT_BOOTSTRAP_CYCLES;
   }
+  res = config_value_int(cfg_tags, "mtu", &mtu);
+  if (!res) {
+    mtu = 0;
+  }
+  res = config_value_int(cfg_tags, "instance", &instance);
+  if (!res) {
+    instance = 0;
+  }
   free(cfg_tags);
   
   context->local_cache = cache_init(context->cache_size, metadata_size, max_timestamp);
@@ -113,13 +108,31 @@ static struct peersampler_context* ncast_init(struct nodeID *myID, const void *m
     free(context);
     return NULL;
   }
+  context->remote_cache = cache_view_init(context->cache_size + 1);
+  if (context->remote_cache == NULL) {
+    cache_free(context->local_cache);
+    free(context);
+    return NULL;
+  }
 
   context->tc = ncast_proto_init(myID, metadata, metadata_size);
   if (!context->tc){
+    cache_free(context->remote_cache);
     free(context->local_cache);
     free(context);
     return NULL;
   }
+  if (mtu && ncast_proto_mtu_set(context->tc, mtu) < 0) {
+    fprintf(stderr, "NCAST: invalid MTU %d\n", mtu);
+  }
+  ncast_proto_instance_set(context->tc, instance);	/* checked by psample_init() */
+  context->timer = timer_add(context->bootstrap_period, ncast_send, context);
+  if (context->timer == NULL) {
+    cache_free(context->remote_cache);
+    cache_free(context->local_cache);
+    free(context);
+    return NULL;
+  }
 
   return context;
 }
@@ -147,7 +160,8 @@ static int ncast_parse_data(struct peersampler_context *context, const uint8_t *
 
   if (len) {
     const struct topo_header *h = (const struct topo_header *)buff;
-    struct peer_cache *new, *remote_cache;
+    struct peer_cache *new;
+    int type;
 
     if (h->protocol != MSG_TYPE_TOPOLOGY) {
       fprintf(stderr, "NCAST: Wrong protocol!\n");
@@ -155,26 +169,31 @@ static int ncast_parse_data(struct peersampler_context *context, const uint8_t *
       return -1;
     }
 
-    context->counter++;
-    if (context->counter == context->bootstrap_cycles) context->bootstrap = false;
+    type = ncast_proto_parse(context->tc, context->remote_cache, context->local_cache, buff, len);
+    if (type < 0) {
+      fprintf(stderr, "NCAST: Malformed message!\n");
 
-    remote_cache = entries_undump(buff + sizeof(struct topo_header), len - sizeof(struct topo_header));
-    if (h->type == NCAST_QUERY) {
-      ncast_reply(context->tc, remote_cache, context->local_cache);
+      return -1;
     }
-    new = merge_caches(context->local_cache, remote_cache, context->cache_size, &dummy);
-    cache_free(remote_cache);
-    if (new != NULL) {
-      cache_free(context->local_cache);
-      context->local_cache = new;
+    /* type == 0: fragment of a larger message, not complete yet */
+    if (type > 0) {
+      context->counter++;
+      if (context->counter == context->bootstrap_cycles) {
+        context->bootstrap = false;
+        timer_mod(context->timer, context->period);
+      }
+
+      if (type == NCAST_QUERY) {
+        ncast_reply(context->tc, context->remote_cache, context->local_cache);
+      }
+      new = merge_caches(context->local_cache, context->remote_cache, context->cache_size, &dummy);
+      if (new != NULL) {
+        cache_free(context->local_cache);
+        context->local_cache = new;
+      }
     }
   }
 
-  if (time_to_send(context)) {
-    cache_update(context->local_cache);
-    return ncast_query(context->tc, context->local_cache);
-  }
-
   return 0;
 }
 
@@ -4,31 +4,98 @@
 #include <string.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "peersampler.h"
 #include "peersampler_iface.h"
 #include "config.h"
+#include "grapes_msg_types.h"
+#include "nodeid_map.h"
+#include "../Cache/topo_proto.h"
+
+#define MIN_CHANGES 64
+#define MAX_DUMP_SIZE 256
 
 extern struct peersampler_iface ncast;
 extern struct peersampler_iface cyclon;
 extern struct peersampler_iface dummy;
+extern struct peersampler_iface proximity;
+extern struct peersampler_iface hyparview;
+
+struct psample_change {
+  struct nodeID *id;
+  int version;
+  int added;	/* 0: removed */
+  int present;	/* the peer was in the previous version */
+};
+
+/*
+ * The cache is returned as a snapshot, which is replaced (and gets a new
+ * version) only when the set of peers or their metadata change. The
+ * changes are logged, so that psample_get_changes() can compute the
+ * differences between two versions
+ */
+struct psample_snapshot {
+  int version;
+  int n;
+  struct nodeID **ids;
+  const struct nodeID **r;	/* ids, as returned to the user */
+  uint8_t *metadata;
+  int metadata_size;
+  struct nodeid_map *index;	/* nodeID -> position */
+};
 
 struct psample_context{
   struct peersampler_iface *ps;
   struct peersampler_context *ps_context;
+  struct psample_snapshot snap;
+  struct psample_change *changes;	/* sorted by version */
+  int n_changes;
+  int changes_size;
+  int first_version;	/* the changes after this version are logged */
+  const struct nodeID **added;
+  const struct nodeID **removed;
+  struct nodeID *myID;
+  int instance;	/* overlay instance, for psample_dispatch() */
+  struct psample_context *next;
 };
 
+static struct psample_context *contexts;
+
+static struct psample_context *context_lookup(const struct nodeID *myID, int instance)
+{
+  struct psample_context *tc;
+
+  for (tc = contexts; tc; tc = tc->next) {
+    if (tc->instance == instance && nodeid_equal(tc->myID, myID)) {
+      return tc;
+    }
+  }
+
+  return NULL;
+}
+
 struct psample_context* psample_init(struct nodeID *myID, const void *metadata, int metadata_size, const char *config)
 {
   struct psample_context *tc;
   struct tag *cfg_tags;
   const char *proto;
+  int res;
 
 
-  tc = malloc(sizeof(struct psample_context));
+  tc = calloc(1, sizeof(struct psample_context));
   if (!tc) return NULL;
 
   tc->ps = &ncast;
   cfg_tags = config_parse(config);
+  res = config_value_int(cfg_tags, "instance", &tc->instance);
+  if (!res) {
+    tc->instance = 0;
+  }
+  if (tc->instance < 0 || tc->instance > 0xff || context_lookup(myID, tc->instance)) {
+    free(cfg_tags);
+    free(tc);
+    return NULL;
+  }
   proto = config_value_str(cfg_tags, "protocol");
   if (proto) {
     if (strcmp(proto, "cyclon") == 0) {
@@ -37,6 +104,12 @@ struct psample_context* psample_init(struct nodeID *myID, const void *metadata,
     if (strcmp(proto, "dummy") == 0) {
       tc->ps = &dummy;
     }
+    if (strcmp(proto, "proximity") == 0) {
+      tc->ps = &proximity;
+    }
+    if (strcmp(proto, "hyparview") == 0) {
+      tc->ps = &hyparview;
+    }
   }
   free(cfg_tags);
   
@@ -45,6 +118,9 @@ struct psample_context* psample_init(struct nodeID *myID, const void *metadata,
     free(tc);
     return NULL;
   }
+  tc->myID = myID;
+  tc->next = contexts;
+  contexts = tc;
   
   return tc;
 }
@@ -61,17 +137,293 @@ int psample_add_peer(struct psample_context *tc, struct nodeID *neighbour, const
 
 int psample_parse_data(struct psample_context *tc, const uint8_t *buff, int len)
 {
-  return tc->ps->parse_data(tc->ps_context, buff, len);
+  int res;
+
+  res = tc->ps->parse_data(tc->ps_context, buff, len);
+  timers_run();
+
+  return res;
+}
+
+int psample_dispatch(const struct nodeID *myID, const uint8_t *buff, int len)
+{
+  struct psample_context *tc;
+  int instance;
+
+  instance = topo_instance(buff, len);
+  if (instance < 0 || buff[0] != MSG_TYPE_TOPOLOGY) {
+    return -1;
+  }
+  tc = context_lookup(myID, instance);
+  if (tc == NULL) {
+    return -1;
+  }
+
+  return psample_parse_data(tc, buff, len);
+}
+
+/* Log a change of the next version; if this is not possible, forget the previous ones */
+static int change_log(struct psample_context *tc, struct nodeID *id, int added, int present)
+{
+  struct psample_change *c;
+
+  if (id == NULL) {
+    tc->first_version = tc->snap.version + 1;
+
+    return -1;
+  }
+  if (tc->n_changes == tc->changes_size) {
+    int drop;
+
+    if (tc->changes_size < MIN_CHANGES || tc->changes_size < 4 * tc->snap.n ||
+        tc->changes[tc->n_changes / 2].version > tc->snap.version) {
+      c = realloc(tc->changes, 2 * (tc->changes_size + MIN_CHANGES) * sizeof(struct psample_change));
+      if (c == NULL) {
+        nodeid_free(id);
+        tc->first_version = tc->snap.version + 1;
+
+        return -1;
+      }
+      tc->changes = c;
+      tc->changes_size = 2 * (tc->changes_size + MIN_CHANGES);
+    } else {	/* forget the oldest versions (not the one being built) */
+      tc->first_version = tc->changes[tc->n_changes / 2].version;
+      for (drop = 0; drop < tc->n_changes && tc->changes[drop].version <= tc->first_version; drop++) {
+        nodeid_free(tc->changes[drop].id);
+      }
+      tc->n_changes -= drop;
+      memmove(tc->changes, tc->changes + drop, tc->n_changes * sizeof(struct psample_change));
+    }
+  }
+  c = &tc->changes[tc->n_changes++];
+  c->id = id;
+  c->version = tc->snap.version + 1;
+  c->added = added;
+  c->present = present;
+
+  return 0;
+}
+
+enum {DROPPED, KEPT, MOVED, REPLACED};
+
+static struct nodeID *nodeid_copy(const struct nodeID *id)
+{
+  uint8_t buff[MAX_DUMP_SIZE];
+  int len;
+
+  if (nodeid_dump(buff, id, sizeof(buff)) <= 0) {
+    return NULL;
+  }
+
+  return nodeid_undump(buff, &len);
+}
+
+/* Compare the current cache with the snapshot, and replace the snapshot if they differ */
+static int snapshot_update(struct psample_context *tc)
+{
+  struct psample_snapshot *s = &tc->snap;
+  const struct nodeID **peers;
+  const uint8_t *meta;
+  struct nodeID **ids;
+  const struct nodeID **r;
+  uint8_t *metadata = NULL;
+  int i, n, msize, changed = 0;
+  char *state;	/* of the entries of the snapshot */
+
+  peers = tc->ps->get_neighbourhood(tc->ps_context, &n);
+  if (peers == NULL || n < 0) {
+    n = 0;
+  }
+  meta = tc->ps->get_metadata(tc->ps_context, &msize);
+  if (meta == NULL || msize < 0) {
+    msize = 0;
+  }
+  if (s->index == NULL) {
+    s->index = nodeid_map_init(n);
+    if (s->index == NULL) {
+      return -1;
+    }
+  }
+
+  state = calloc(s->n + 1, 1);	/* all DROPPED */
+  if (state == NULL) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    int j = nodeid_map_get(s->index, peers[i]);
+
+    if (j < 0) {
+      changed = 1;
+    } else if (state[j] == DROPPED) {
+      if (msize == s->metadata_size && (msize == 0 || memcmp(meta + i * msize, s->metadata + j * msize, msize) == 0)) {
+        state[j] = KEPT;
+      } else {
+        state[j] = REPLACED;
+        changed = 1;
+      }
+    }
+  }
+  for (i = 0; i < s->n && !changed; i++) {
+    changed = state[i] == DROPPED;
+  }
+  if (!changed) {
+    free(state);
+
+    return s->version;
+  }
+
+  ids = malloc((n + 1) * sizeof(struct nodeID *));
+  r = realloc(s->r, (n + 1) * sizeof(struct nodeID *));
+  if (msize) {
+    metadata = malloc(n * msize);
+  }
+  if (ids == NULL || r == NULL || (msize && metadata == NULL)) {
+    free(state);
+    free(ids);
+    free(metadata);
+    if (r) {
+      s->r = r;
+    }
+
+    return -1;
+  }
+  s->r = r;
+  /* new version: the kept nodeIDs move to the new snapshot */
+  for (i = 0; i < n; i++) {
+    int j = nodeid_map_get(s->index, peers[i]);
+
+    ids[i] = NULL;
+    if (j >= 0 && state[j] == KEPT) {
+      ids[i] = s->ids[j];
+      state[j] = MOVED;
+    } else if (j < 0 || state[j] == REPLACED) {
+      ids[i] = nodeid_copy(peers[i]);
+      change_log(tc, ids[i] ? nodeid_dup(ids[i]) : NULL, 1, j >= 0);
+    }
+    if (msize) {
+      memcpy(metadata + i * msize, meta + i * msize, msize);
+    }
+  }
+  for (i = 0; i < s->n; i++) {
+    if (state[i] == DROPPED) {
+      change_log(tc, s->ids[i], 0, 1);	/* the log owns the nodeID now */
+    } else if (state[i] != MOVED) {
+      nodeid_free(s->ids[i]);
+    }
+  }
+  free(state);
+  free(s->ids);
+  free(s->metadata);
+  s->ids = ids;
+  s->metadata = metadata;
+  s->metadata_size = msize;
+  s->version++;
+
+  /* skip the holes and the peers returned twice by the protocol */
+  nodeid_map_clear(s->index);
+  for (i = 0, s->n = 0; i < n; i++) {
+    if (ids[i] == NULL) {
+      continue;
+    }
+    if (nodeid_map_get(s->index, ids[i]) >= 0) {
+      nodeid_free(ids[i]);
+      continue;
+    }
+    if (msize && s->n != i) {
+      memmove(metadata + s->n * msize, metadata + i * msize, msize);
+    }
+    ids[s->n] = ids[i];
+    r[s->n] = ids[i];
+    nodeid_map_put(s->index, ids[s->n], s->n);
+    s->n++;
+  }
+  ids[s->n] = NULL;
+  r[s->n] = NULL;
+
+  return s->version;
 }
 
 const struct nodeID **psample_get_cache(struct psample_context *tc, int *n)
 {
-  return tc->ps->get_neighbourhood(tc->ps_context, n);
+  if (snapshot_update(tc) < 0) {
+    *n = -1;
+
+    return NULL;
+  }
+  *n = tc->snap.n;
+
+  return tc->snap.n ? tc->snap.r : NULL;
 }
 
 const void *psample_get_metadata(struct psample_context *tc, int *metadata_size)
 {
-  return tc->ps->get_metadata(tc->ps_context, metadata_size);
+  if (snapshot_update(tc) < 0) {
+    *metadata_size = -1;
+
+    return NULL;
+  }
+  *metadata_size = tc->snap.metadata_size;
+
+  return tc->snap.metadata;
+}
+
+int psample_get_version(struct psample_context *tc)
+{
+  return snapshot_update(tc);
+}
+
+int psample_get_changes(struct psample_context *tc, int since_version,
+                        const struct nodeID ***added, int *n_added,
+                        const struct nodeID ***removed, int *n_removed)
+{
+  struct nodeid_map *first;
+  int i, version;
+
+  version = snapshot_update(tc);
+  if (version < 0 || since_version > version || since_version < tc->first_version) {
+    return -1;
+  }
+  for (i = tc->n_changes; i > 0 && tc->changes[i - 1].version > since_version; i--);
+  tc->added = realloc(tc->added, (tc->n_changes - i + 1) * sizeof(struct nodeID *));
+  tc->removed = realloc(tc->removed, (tc->n_changes - i + 1) * sizeof(struct nodeID *));
+  first = nodeid_map_init(tc->n_changes - i);
+  if (tc->added == NULL || tc->removed == NULL || first == NULL) {
+    if (first) {
+      nodeid_map_free(first);
+    }
+
+    return -1;
+  }
+  /*
+   * The net change of a peer depends on its last logged change, and on
+   * its presence before the first one: a peer that was there, got new
+   * metadata and left is removed
+   */
+  for (; i < tc->n_changes; i++) {
+    if (nodeid_map_get(first, tc->changes[i].id) < 0) {
+      nodeid_map_put(first, tc->changes[i].id, i);
+    }
+  }
+  *n_added = *n_removed = 0;
+  for (i = tc->n_changes - 1; i >= 0 && tc->changes[i].version > since_version; i--) {
+    const struct psample_change *c = &tc->changes[i];
+    int f = nodeid_map_get(first, c->id);
+
+    if (f < 0) {
+      continue;	/* a later change of this peer has already been considered */
+    }
+    nodeid_map_del(first, c->id);
+    if (c->added) {
+      tc->added[(*n_added)++] = c->id;	/* new, or with new metadata */
+    } else if (tc->changes[f].present) {
+      tc->removed[(*n_removed)++] = c->id;
+    }
+  }
+  nodeid_map_free(first);
+  *added = tc->added;
+  *removed = tc->removed;
+
+  return version;
 }
 
 int psample_grow_cache(struct psample_context *tc, int n)
@@ -0,0 +1,475 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "net_helper.h"
+#include "grapes_timers.h"
+#include "peersampler_iface.h"
+#include "../Cache/topocache.h"
+#include "../Cache/proximity_proto.h"
+#include "../Cache/proto.h"
+#include "config.h"
+#include "grapes_msg_types.h"
+#include "nodeid_map.h"
+#include "../prng.h"
+#include "../check.h"
+
+#define DEFAULT_CACHE_SIZE 10
+#define RTT_HISTORY 4	/* measured peers remembered, per cache entry */
+
+/*
+ * Cyclon, biased toward the peers with the lowest RTT. The RTTs measured
+ * by the shuffles are remembered (smoothed as in TCP); the shuffles
+ * alternate between the oldest peer (as in Cyclon, so that all the peers
+ * are measured) and the nearest one. When the cache is full, a peer that
+ * is among the cache_size - random_links nearest ones replaces the oldest
+ * of the others; the remaining random_links entries are not chosen by
+ * RTT, and keep the overlay connected
+ */
+struct rtt_entry {
+  struct nodeID *id;
+  int rtt;	/* smoothed, in usecs */
+};
+
+struct peersampler_context{
+  struct timer *timer;
+  int cache_size;
+  int sent_entries;
+  int random_links;
+  struct peer_cache *local_cache;
+  struct peer_cache *remote_cache;	/* view of the last received message */
+  bool bootstrap;
+  int bootstrap_period;
+  int period;
+  unsigned int shuffles;
+
+  struct peer_cache *flying_cache;
+  struct nodeID *dst;
+
+  struct proximity_proto_context *pc;
+  const struct nodeID **r;
+  struct prng rng;	/* shuffled entries */
+
+  struct rtt_entry *rtts;	/* FIFO of the measured peers */
+  int rtts_size;
+  int rtts_next;
+  struct nodeid_map *rtt_index;
+};
+
+struct rank {
+  int rtt;
+  int pos;
+};
+
+static struct peersampler_context* proximity_context_init(void)
+{
+  struct peersampler_context* con;
+  con = (struct peersampler_context*) calloc(1,sizeof(struct peersampler_context));
+
+  //Initialize context with default values
+  con->bootstrap = true;
+  con->bootstrap_period = 2000000;
+  con->period = 10000000;
+
+  return con;
+}
+
+static int rtt_get(const struct peersampler_context *context, const struct nodeID *id)
+{
+  int i = nodeid_map_get(context->rtt_index, id);
+
+  return i < 0 ? -1 : context->rtts[i].rtt;
+}
+
+static void rtt_update(struct peersampler_context *context, struct nodeID *id, int rtt)
+{
+  int i = nodeid_map_get(context->rtt_index, id);
+  struct rtt_entry *e;
+
+  if (i >= 0) {
+    e = &context->rtts[i];
+    e->rtt = e->rtt - e->rtt / 8 + rtt / 8;
+
+    return;
+  }
+  /* forget the oldest measured peer */
+  i = context->rtts_next;
+  context->rtts_next = (i + 1) % context->rtts_size;
+  e = &context->rtts[i];
+  if (e->id) {
+    nodeid_map_del(context->rtt_index, e->id);
+    nodeid_free(e->id);
+  }
+  e->id = nodeid_dup(id);
+  e->rtt = rtt;
+  if (e->id && nodeid_map_put(context->rtt_index, e->id, i) < 0) {
+    nodeid_free(e->id);
+    e->id = NULL;
+  }
+}
+
+static int rank_cmp(const void *p1, const void *p2)
+{
+  const struct rank *r1 = p1, *r2 = p2;
+
+  return r1->rtt != r2->rtt ? (r1->rtt < r2->rtt ? -1 : 1) : r1->pos - r2->pos;
+}
+
+/*
+ * The entry to be replaced by a peer at the given RTT in a full cache:
+ * the oldest one that is not among the nearest, or NULL if the new peer
+ * would not be among them
+ */
+static struct nodeID *cache_victim(const struct peersampler_context *context, int rtt)
+{
+  struct rank *ranks;
+  uint8_t *near;
+  struct nodeID *res = NULL;
+  int n_near = context->cache_size - context->random_links;
+  int i, n, m = 0;
+
+  for (n = 0; nodeid(context->local_cache, n); n++);
+  if (n_near <= 0 || n == 0) {
+    return NULL;
+  }
+  ranks = malloc(n * (sizeof(struct rank) + 1));
+  if (ranks == NULL) {
+    return NULL;
+  }
+  near = (uint8_t *)(ranks + n);
+  memset(near, 0, n);
+  for (i = 0; i < n; i++) {
+    int r = rtt_get(context, nodeid(context->local_cache, i));
+
+    if (r >= 0) {
+      ranks[m].rtt = r;
+      ranks[m++].pos = i;
+    }
+  }
+  qsort(ranks, m, sizeof(struct rank), rank_cmp);
+  if (m < n_near || ranks[n_near - 1].rtt > rtt) {
+    /* the new peer takes a near entry: the last one becomes a random one */
+    for (i = 0; i < m && i < n_near - 1; i++) {
+      near[ranks[i].pos] = 1;
+    }
+    for (i = n - 1; i >= 0 && near[i]; i--);
+    if (i >= 0) {
+      res = nodeid(context->local_cache, i);
+    }
+  }
+  free(ranks);
+
+  return res;
+}
+
+/* Add some entries to the cache; when it is full, prefer the nearest peers */
+static void cache_add_near(struct peersampler_context *context, const struct peer_cache *add)
+{
+  int i, meta_size;
+  const uint8_t *meta;
+
+  meta = get_metadata(add, &meta_size);
+  for (i = 0; nodeid(add, i); i++) {
+    struct nodeID *victim;
+    int rtt;
+
+    if (cache_add(context->local_cache, nodeid(add, i), meta + (meta_size * i), meta_size) != -2) {
+      continue;
+    }
+    rtt = rtt_get(context, nodeid(add, i));
+    victim = rtt >= 0 ? cache_victim(context, rtt) : NULL;
+    if (victim) {
+      cache_del(context->local_cache, victim);
+      cache_add(context->local_cache, nodeid(add, i), meta + (meta_size * i), meta_size);
+    }
+  }
+}
+
+/* The nearest peer with a known RTT, or NULL */
+static struct nodeID *nearest_peer(const struct peersampler_context *context)
+{
+  struct nodeID *res = NULL;
+  int i, min = -1;
+
+  for (i = 0; nodeid(context->local_cache, i); i++) {
+    int rtt = rtt_get(context, nodeid(context->local_cache, i));
+
+    if (rtt >= 0 && (min < 0 || rtt < min)) {
+      min = rtt;
+      res = nodeid(context->local_cache, i);
+    }
+  }
+
+  return res;
+}
+
+/* Timer callback: start a shuffle, alternately with the oldest and with the nearest peer */
+static void proximity_send(void *p)
+{
+  struct peersampler_context *context = p;
+  struct nodeID *dst = NULL;
+
+  if (context->flying_cache) {
+    cache_add_near(context, context->flying_cache);
+    cache_free(context->flying_cache);
+    context->flying_cache = NULL;
+  }
+  nodeid_free(context->dst);	/* did not answer */
+  context->dst = NULL;
+  cache_update(context->local_cache);
+  if (context->shuffles++ % 2) {
+    dst = nearest_peer(context);
+  }
+  if (dst == NULL) {
+    dst = last_peer(context->local_cache);
+  }
+  if (dst == NULL) {
+    return;
+  }
+  context->dst = nodeid_dup(dst);
+  cache_del(context->local_cache, context->dst);
+  context->flying_cache = rand_cache(context->local_cache, context->sent_entries - 1, &context->rng);
+  proximity_query(context->pc, context->flying_cache, context->dst);
+}
+
+/*
+ * Public Functions!
+ */
+static struct peersampler_context* proximity_init(struct nodeID *myID, const void *metadata, int metadata_size, const char *config)
+{
+  struct tag *cfg_tags;
+  struct peersampler_context *con;
+  int res, mtu, seed, instance;
+
+  con = proximity_context_init();
+  if (!con) return NULL;
+
+  cfg_tags = config_parse(config);
+  res = config_value_int(cfg_tags, "cache_size", &(con->cache_size));
+  if (!res) {
+    con->cache_size = DEFAULT_CACHE_SIZE;
+  }
+  res = config_value_int(cfg_tags, "sent_entries", &(con->sent_entries));
+  if (!res) {
+    con->sent_entries = con->cache_size / 2;
+  }
+  res = config_value_int(cfg_tags, "random_links", &(con->random_links));
+  if (!res) {
+    con->random_links = con->cache_size / 4;
+  }
+  if (con->random_links < 0 || con->random_links > con->cache_size) {
+    con->random_links = con->cache_size;
+  }
+  res = config_value_int(cfg_tags, "mtu", &mtu);
+  if (!res) {
+    mtu = 0;
+  }
+  res = config_value_int(cfg_tags, "instance", &instance);
+  if (!res) {
+    instance = 0;
+  }
+  res = config_value_int(cfg_tags, "seed", &seed);
+  if (!res) {
+    seed = rand();
+  }
+  free(cfg_tags);
+  prng_seed(&con->rng, seed);
+
+  con->rtts_size = RTT_HISTORY * con->cache_size;
+  con->rtts = calloc(con->rtts_size, sizeof(struct rtt_entry));
+  con->rtt_index = nodeid_map_init(con->rtts_size);
+  if (con->rtts == NULL || con->rtt_index == NULL) {
+    nodeid_map_free(con->rtt_index);
+    free(con->rtts);
+    free(con);
+    return NULL;
+  }
+  con->local_cache = cache_init(con->cache_size, metadata_size, 0);
+  if (con->local_cache == NULL) {
+    nodeid_map_free(con->rtt_index);
+    free(con->rtts);
+    free(con);
+    return NULL;
+  }
+  con->remote_cache = cache_view_init(con->cache_size + 1);
+  if (con->remote_cache == NULL) {
+    cache_free(con->local_cache);
+    nodeid_map_free(con->rtt_index);
+    free(con->rtts);
+    free(con);
+    return NULL;
+  }
+
+  con->pc = proximity_proto_init(myID, metadata, metadata_size);
+  if (!con->pc){
+    cache_free(con->remote_cache);
+    cache_free(con->local_cache);
+    nodeid_map_free(con->rtt_index);
+    free(con->rtts);
+    free(con);
+    return NULL;
+  }
+  if (mtu && proximity_proto_mtu_set(con->pc, mtu) < 0) {
+    fprintf(stderr, "Peer Sampler: invalid MTU %d\n", mtu);
+  }
+  proximity_proto_instance_set(con->pc, instance);	/* checked by psample_init() */
+  con->timer = timer_add(con->bootstrap_period, proximity_send, con);
+  if (con->timer == NULL) {
+    cache_free(con->remote_cache);
+    cache_free(con->local_cache);
+    nodeid_map_free(con->rtt_index);
+    free(con->rtts);
+    free(con);
+    return NULL;
+  }
+
+  return con;
+}
+
+static int proximity_add_neighbour(struct peersampler_context *context, struct nodeID *neighbour, const void *metadata, int metadata_size)
+{
+  if (!context->flying_cache) {
+    context->flying_cache = rand_cache(context->local_cache, context->sent_entries - 1, &context->rng);
+  }
+  if (cache_add(context->local_cache, neighbour, metadata, metadata_size) < 0) {
+    return -1;
+  }
+
+  return proximity_query(context->pc, context->flying_cache, neighbour);
+}
+
+static int proximity_parse_data(struct peersampler_context *context, const uint8_t *buff, int len)
+{
+  CHECK_CALL(cache_check(context->local_cache));
+  if (len) {
+    const struct topo_header *h = (const struct topo_header *)buff;
+    struct peer_cache *sent_cache = NULL;
+    int type, rtt;
+
+    if (h->protocol != MSG_TYPE_TOPOLOGY) {
+      fprintf(stderr, "Peer Sampler: Wrong protocol!\n");
+
+      return -1;
+    }
+
+    if (context->bootstrap) {
+      context->bootstrap = false;
+      timer_mod(context->timer, context->period);
+    }
+
+    type = proximity_proto_parse(context->pc, context->remote_cache, context->local_cache, buff, len);
+    if (type < 0) {
+      fprintf(stderr, "Peer Sampler: Malformed message!\n");
+
+      return -1;
+    }
+    /* type == 0: fragment of a larger message, not complete yet */
+    if (type > 0) {
+      /* both queries and replies start with the sender */
+      rtt = proximity_proto_rtt(context->pc);
+      if (rtt >= 0 && nodeid(context->remote_cache, 0)) {
+        rtt_update(context, nodeid(context->remote_cache, 0), rtt);
+      }
+      if (type == PROXIMITY_QUERY) {
+        sent_cache = rand_cache(context->local_cache, context->sent_entries, &context->rng);
+        proximity_reply(context->pc, context->remote_cache, sent_cache);
+      } else {
+        nodeid_free(context->dst);
+        context->dst = NULL;
+      }
+      CHECK_CALL(cache_check(context->local_cache));
+      cache_add_near(context, context->remote_cache);
+      if (sent_cache) {
+        cache_add_near(context, sent_cache);
+        cache_free(sent_cache);
+      } else {
+        if (context->flying_cache) {
+          cache_add_near(context, context->flying_cache);
+          cache_free(context->flying_cache);
+          context->flying_cache = NULL;
+        }
+      }
+    }
+  }
+
+  CHECK_CALL(cache_check(context->local_cache));
+
+  return 0;
+}
+
+static const struct nodeID **proximity_get_neighbourhood(struct peersampler_context *context, int *n)
+{
+  context->r = realloc(context->r, context->cache_size * sizeof(struct nodeID *));
+  if (context->r == NULL) {
+    return NULL;
+  }
+
+  for (*n = 0; nodeid(context->local_cache, *n) && (*n < context->cache_size); (*n)++) {
+    context->r[*n] = nodeid(context->local_cache, *n);
+  }
+  if (context->flying_cache) {
+    int i;
+
+    for (i = 0; nodeid(context->flying_cache, i) && (*n < context->cache_size); (*n)++, i++) {
+      context->r[*n] = nodeid(context->flying_cache, i);
+    }
+  }
+  if (context->dst && (*n < context->cache_size)) {
+    context->r[*n] = context->dst;
+    (*n)++;
+  }
+
+  return context->r;
+}
+
+static const void *proximity_get_metadata(struct peersampler_context *context, int *metadata_size)
+{
+  return get_metadata(context->local_cache, metadata_size);
+}
+
+static int proximity_grow_neighbourhood(struct peersampler_context *context, int n)
+{
+  context->cache_size += n;
+
+  return context->cache_size;
+}
+
+static int proximity_shrink_neighbourhood(struct peersampler_context *context, int n)
+{
+  if (context->cache_size < n) {
+    return -1;
+  }
+  context->cache_size -= n;
+
+  return context->cache_size;
+}
+
+static int proximity_remove_neighbour(struct peersampler_context *context, const struct nodeID *neighbour)
+{
+  return cache_del(context->local_cache, neighbour);
+}
+
+static int proximity_change_metadata(struct peersampler_context *context, const void *metadata, int metadata_size)
+{
+  return proximity_proto_change_metadata(context->pc, metadata, metadata_size);
+}
+
+struct peersampler_iface proximity = {
+  .init = proximity_init,
+  .change_metadata = proximity_change_metadata,
+  .add_neighbour = proximity_add_neighbour,
+  .parse_data = proximity_parse_data,
+  .get_neighbourhood = proximity_get_neighbourhood,
+  .get_metadata = proximity_get_metadata,
+  .grow_neighbourhood = proximity_grow_neighbourhood,
+  .shrink_neighbourhood = proximity_shrink_neighbourhood,
+  .remove_neighbour = proximity_remove_neighbour,
+};
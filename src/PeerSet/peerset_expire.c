@@ -0,0 +1,142 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *  Copyright (c) 2010 Csaba Kiraly
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "peer.h"
+#include "peerset.h"
+#include "peerset_private.h"
+
+static int64_t tv_us(const struct timeval *tv)
+{
+  return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static int64_t now_us(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return tv_us(&now);
+}
+
+static void bucket_insert(struct peerset *h, int slot, int bucket)
+{
+  struct peer_slot *s = &h->slots[slot];
+
+  s->bucket = bucket;
+  s->prev = -1;
+  s->next = h->wheel[bucket];
+  if (s->next >= 0) {
+    h->slots[s->next].prev = slot;
+  }
+  h->wheel[bucket] = slot;
+}
+
+/* Bucket of the tick in which the peer in position i expires */
+static int expiry_bucket(const struct peerset *h, int i)
+{
+  return (tv_us(&h->priv[i].last_seen) + h->expire) / h->tick % WHEEL_SIZE;
+}
+
+void wheel_init(struct peerset *h)
+{
+  int i;
+
+  for (i = 0; i < WHEEL_SIZE; i++) {
+    h->wheel[i] = -1;
+  }
+  if (h->expire) {
+    // a peer never expires more than WHEEL_SIZE - 2 ticks in the future
+    h->tick = h->expire / (WHEEL_SIZE - 2) + 1;
+    h->wheel_tick = now_us() / h->tick;
+  }
+}
+
+/* The peer in the slot has just been added */
+void wheel_add(struct peerset *h, int slot)
+{
+  int i = h->slots[slot].index;
+
+  gettimeofday(&h->priv[i].last_seen, NULL);
+  if (h->expire) {
+    bucket_insert(h, slot, expiry_bucket(h, i));
+  }
+}
+
+/* The peer in the slot is being removed */
+void wheel_del(struct peerset *h, int slot)
+{
+  struct peer_slot *s = &h->slots[slot];
+
+  if (h->expire == 0) {
+    return;
+  }
+  if (s->prev >= 0) {
+    h->slots[s->prev].next = s->next;
+  } else {
+    h->wheel[s->bucket] = s->next;
+  }
+  if (s->next >= 0) {
+    h->slots[s->next].prev = s->prev;
+  }
+}
+
+int peerset_touch(struct peerset *h, struct peer *p)
+{
+  if (p < h->elements || p >= h->elements + h->n_elements) {
+    return -1;
+  }
+  gettimeofday(&h->priv[p - h->elements].last_seen, NULL);
+
+  return 0;
+}
+
+int peerset_expire(struct peerset *h, peerset_expire_cb cb, void *arg)
+{
+  int64_t now, now_tick;
+  int n = 0;
+
+  if (h->expire == 0) {
+    return 0;
+  }
+  now = now_us();
+  now_tick = now / h->tick;
+  if (now_tick - h->wheel_tick > WHEEL_SIZE) {
+    h->wheel_tick = now_tick - WHEEL_SIZE;	// visit every bucket once
+  }
+
+  // a tick is processed when it is over
+  for (; h->wheel_tick < now_tick; h->wheel_tick++) {
+    int b = h->wheel_tick % WHEEL_SIZE;
+    int slot = h->wheel[b];
+
+    while (slot >= 0) {
+      int next = h->slots[slot].next;
+      int i = h->slots[slot].index;
+      struct peer *p = &h->elements[i];
+
+      if (tv_us(&h->priv[i].last_seen) + h->expire <= now) {
+        if (cb) {
+          cb(h, p, arg);
+        }
+        peerset_remove_peer(h, p->id);
+        n++;
+      } else if (expiry_bucket(h, i) != b) {
+        // active after the insertion: move it forward
+        wheel_del(h, slot);
+        bucket_insert(h, slot, expiry_bucket(h, i));
+      }
+      slot = next;
+    }
+  }
+
+  return n;
+}
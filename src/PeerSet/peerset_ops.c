@@ -10,42 +10,222 @@
 #include <string.h>
 #include <limits.h>
 
-#include "peerset_private.h"
 #include "peer.h"
 #include "peerset.h"
 #include "chunkidset.h"
 #include "net_helper.h"
 #include "config.h"
+#include "nodeid_map.h"
+#include "peerset_private.h"
 
 #define DEFAULT_SIZE_INCREMENT 32
+#define DEFAULT_WINDOW 256
+#define DEFAULT_REQUEST_TIMEOUT 2000000
+/* Both can be lowered at build time, to exhaust the slots in the tests */
+#ifndef SLOT_BITS
+#define SLOT_BITS 20
+#endif
+#define SLOT_MASK ((1 << SLOT_BITS) - 1)
+#ifndef MAX_SLOTS
+#define MAX_SLOTS (SLOT_MASK + 1)
+#endif
+/* handles keep 32 - SLOT_BITS bits of the generation; the last value is never used */
+#define GEN_MAX ((1u << (32 - SLOT_BITS)) - 1)
 
 struct nodeID;
 
+static int array_resize(void *array, size_t size)
+{
+  void **a = array;
+  void *res = realloc(*a, size);
+
+  if (res == NULL && size) {
+    return -1;
+  }
+  *a = res;
+
+  return 0;
+}
+
+/* Add slots up to size, putting them in the free list */
+static int slots_grow(struct peerset *h, int size)
+{
+  int i;
+
+  if (size > MAX_SLOTS) {
+    return -1;
+  }
+  if (size > h->slots_size) {
+    if (array_resize(&h->slots, size * sizeof(struct peer_slot)) < 0) {
+      return -1;
+    }
+    for (i = size - 1; i >= h->slots_size; i--) {
+      h->slots[i].index = h->free_slot;
+      h->slots[i].gen = 0;
+      h->free_slot = i;
+    }
+    h->slots_size = size;
+  }
+
+  return 0;
+}
+
+/*
+ * Invalidate the handles of a slot and free it; a slot whose generation
+ * would wrap is retired instead, so that a stale handle never becomes
+ * valid again (and no handle is PEERSET_NO_HANDLE)
+ */
+static void slot_release(struct peerset *h, int slot)
+{
+  if (++h->slots[slot].gen >= GEN_MAX) {
+    h->slots[slot].index = -1;
+
+    return;
+  }
+  h->slots[slot].index = h->free_slot;
+  h->free_slot = slot;
+}
+
+/* Resize the elements (the new slots, if any, are put in the free list) */
+static int peerset_resize(struct peerset *h, int size)
+{
+  if (size > MAX_SLOTS) {
+    return -1;
+  }
+  if (array_resize(&h->elements, size * sizeof(struct peer)) < 0 ||
+      array_resize(&h->slot_of, size * sizeof(int)) < 0 ||
+      array_resize(&h->priv, size * sizeof(struct peer_private)) < 0 ||
+      array_resize(&h->bits, size * h->words * sizeof(uint64_t)) < 0 ||
+      array_resize(&h->col_rtt, size * sizeof(double)) < 0 ||
+      array_resize(&h->col_throughput, size * sizeof(double)) < 0 ||
+      array_resize(&h->col_loss, size * sizeof(double)) < 0 ||
+      array_resize(&h->col_dup, size * sizeof(double)) < 0 ||
+      array_resize(&h->col_outstanding, size * sizeof(int)) < 0 ||
+      array_resize(&h->col_cb_size, size * sizeof(int)) < 0) {
+    return -1;
+  }
+  if (slots_grow(h, size) < 0) {
+    return -1;
+  }
+  h->size = size;
+
+  return 0;
+}
+
+static uint64_t *peer_row(const struct peerset *h, int i)
+{
+  return h->bits + (size_t)i * h->words;
+}
+
+/* Account for peer i having (inc > 0) or not having (inc < 0) a chunk */
+static void avail_update(struct peerset *h, int i, int chunk_id, int inc)
+{
+  int c, p;
+
+  if (chunk_id < 0) {
+    return;
+  }
+  c = chunk_id % h->window;
+  if (h->avail_id[c] != chunk_id) {
+    if (inc < 0 || h->avail_id[c] > chunk_id) {
+      return;	/* not counted, or out of the window */
+    }
+    // a new chunk enters the window, replacing an old one
+    h->avail_id[c] = chunk_id;
+    h->avail_count[c] = 0;
+    for (p = 0; p < h->n_elements; p++) {
+      peer_row(h, p)[c / 64] &= ~(1ULL << (c % 64));
+    }
+  }
+  h->avail_count[c] += inc;
+  if (inc > 0) {
+    peer_row(h, i)[c / 64] |= 1ULL << (c % 64);
+  } else {
+    peer_row(h, i)[c / 64] &= ~(1ULL << (c % 64));
+  }
+}
+
+static void avail_update_bmap(struct peerset *h, int i, const struct chunkID_set *bmap, int inc)
+{
+  int j, n;
+
+  n = chunkID_set_size(bmap);
+  for (j = 0; j < n; j++) {
+    avail_update(h, i, chunkID_set_get_chunk(bmap, j), inc);
+  }
+}
+
+static void avail_clear(struct peerset *h)
+{
+  int c;
+
+  for (c = 0; c < h->window; c++) {
+    h->avail_id[c] = -1;
+    h->avail_count[c] = 0;
+  }
+}
+
 struct peerset *peerset_init(const char *config)
 {
   struct peerset *p;
   struct tag *cfg_tags;
-  int res;
+  int res, size, expire;
 
-  p = malloc(sizeof(struct peerset));
+  p = calloc(1, sizeof(struct peerset));
   if (p == NULL) {
     return NULL;
   }
-  p->n_elements = 0;
+  p->free_slot = -1;
   cfg_tags = config_parse(config);
   if (!cfg_tags) {
     free(p);
     return NULL;
   }
-  res = config_value_int(cfg_tags, "size", &p->size);
+  res = config_value_int(cfg_tags, "size", &size);
   if (!res) {
-    p->size = 0;
+    size = 0;
+  }
+  res = config_value_int(cfg_tags, "window", &p->window);
+  if (!res || p->window <= 0) {
+    p->window = DEFAULT_WINDOW;
+  }
+  p->words = (p->window + 63) / 64;
+  p->window = p->words * 64;
+  res = config_value_int(cfg_tags, "request_timeout", &p->request_timeout);
+  if (!res || p->request_timeout <= 0) {
+    p->request_timeout = DEFAULT_REQUEST_TIMEOUT;
   }
+  res = config_value_int(cfg_tags, "expire", &expire);
+  p->expire = (res && expire > 0) ? expire : 0;
   free(cfg_tags);
-  if (p->size) {
-    p->elements = malloc(p->size * sizeof(struct peer));
-  } else {
-    p->elements = NULL;
+  p->avail_id = malloc(p->window * sizeof(int));
+  p->avail_count = malloc(p->window * sizeof(int));
+  if (p->avail_id == NULL || p->avail_count == NULL) {
+    free(p->avail_id);
+    free(p->avail_count);
+    free(p);
+    return NULL;
+  }
+  avail_clear(p);
+  wheel_init(p);
+  p->index = nodeid_map_init(size);
+  if (p->index == NULL || peerset_resize(p, size) < 0) {
+    if (p->index) nodeid_map_free(p->index);
+    free(p->elements);
+    free(p->slot_of);
+    free(p->slots);
+    free(p->priv);
+    free(p->avail_id);
+    free(p->avail_count);
+    free(p->bits);
+    free(p->col_rtt);
+    free(p->col_throughput);
+    free(p->col_loss);
+    free(p->col_dup);
+    free(p->col_outstanding);
+    free(p->col_cb_size);
+    free(p);
+    return NULL;
   }
 
   return p;
@@ -54,26 +234,41 @@ struct peerset *peerset_init(const char *config)
 int peerset_add_peer(struct peerset *h, struct nodeID *id)
 {
   struct peer *e;
+  int slot;
+
   if (peerset_check(h, id) >= 0) {
     return 0;
   }
 
   if (h->n_elements == h->size) {
-    int *res;
-
-    res = realloc(h->elements, (h->size + DEFAULT_SIZE_INCREMENT) * sizeof(struct peer));
-    if (res == NULL) {
+    if (peerset_resize(h, h->size + DEFAULT_SIZE_INCREMENT) < 0) {
       return -1;
     }
-    h->size += DEFAULT_SIZE_INCREMENT;
-    h->elements = (struct peer*) res;
   }
-  e = &(h->elements[h->n_elements++]);
+  if (h->free_slot < 0) {
+    slots_grow(h, h->slots_size + DEFAULT_SIZE_INCREMENT > MAX_SLOTS ? MAX_SLOTS : h->slots_size + DEFAULT_SIZE_INCREMENT);
+    if (h->free_slot < 0) {
+      return -1;	/* all the slots are retired */
+    }
+  }
+  e = &(h->elements[h->n_elements]);
   e->id = nodeid_dup(id);
+  if (e->id == NULL || nodeid_map_put(h->index, e->id, h->n_elements) < 0) {
+    if (e->id) nodeid_free(e->id);
+    return -1;
+  }
+  slot = h->free_slot;
+  h->free_slot = h->slots[slot].index;
+  h->slots[slot].index = h->n_elements;
+  h->slot_of[h->n_elements++] = slot;
   gettimeofday(&e->creation_timestamp,NULL);
   e->bmap = chunkID_set_init("type=bitmap");
   timerclear(&e->bmap_timestamp);
   e->cb_size = INT_MAX;
+  memset(&e->stats, 0, sizeof(e->stats));
+  memset(&h->priv[h->n_elements - 1], 0, sizeof(struct peer_private));
+  memset(peer_row(h, h->n_elements - 1), 0, h->words * sizeof(uint64_t));
+  wheel_add(h, slot);
 
   return h->n_elements;
 }
@@ -104,12 +299,25 @@ struct peer *peerset_get_peer(const struct peerset *h, const struct nodeID *id)
 }
 
 int peerset_remove_peer(struct peerset *h, const struct nodeID *id){
-  int i = peerset_check(h,id);
+  int i = nodeid_map_del(h->index, id);
   if (i >= 0) {
     struct peer *e = h->elements + i;
+    int slot = h->slot_of[i], last = --h->n_elements;
+
+    wheel_del(h, slot);
     nodeid_free(e->id);
+    avail_update_bmap(h, i, e->bmap, -1);
     chunkID_set_free(e->bmap);
-    memmove(e, e + 1, ((h->n_elements--) - (i+1)) * sizeof(struct peer));
+    slot_release(h, slot);
+    if (i != last) {
+      // the last peer takes the place of the removed one
+      *e = h->elements[last];
+      h->priv[i] = h->priv[last];
+      memcpy(peer_row(h, i), peer_row(h, last), h->words * sizeof(uint64_t));
+      h->slot_of[i] = h->slot_of[last];
+      h->slots[h->slot_of[i]].index = i;
+      nodeid_map_put(h->index, e->id, i);
+    }
     return i;
   }
   return -1;
@@ -117,15 +325,32 @@ int peerset_remove_peer(struct peerset *h, const struct nodeID *id){
 
 int peerset_check(const struct peerset *h, const struct nodeID *id)
 {
-  int i;
+  return nodeid_map_get(h->index, id);
+}
 
-  for (i = 0; i < h->n_elements; i++) {
-    if (nodeid_equal(h->elements[i].id, id)) {
-      return i;
-    }
+uint32_t peerset_get_handle(const struct peerset *h, const struct nodeID *id)
+{
+  int i = peerset_check(h, id);
+  int slot;
+
+  if (i < 0) {
+    return PEERSET_NO_HANDLE;
   }
+  slot = h->slot_of[i];
 
-  return -1;
+  return (h->slots[slot].gen << SLOT_BITS) | slot;
+}
+
+struct peer *peerset_get_peer_by_handle(const struct peerset *h, uint32_t handle)
+{
+  uint32_t slot = handle & SLOT_MASK;
+
+  if (handle == PEERSET_NO_HANDLE || slot >= h->slots_size ||
+      ((h->slots[slot].gen << SLOT_BITS) | slot) != handle) {
+    return NULL;
+  }
+
+  return &h->elements[h->slots[slot].index];
 }
 
 void peerset_clear(struct peerset *h, int size)
@@ -137,11 +362,77 @@ void peerset_clear(struct peerset *h, int size)
     nodeid_free(e->id);
     chunkID_set_free(e->bmap);
   }
+  avail_clear(h);
+  wheel_init(h);
+  nodeid_map_clear(h->index);
 
+  // invalidate all the handles, and rebuild the free list
+  h->free_slot = -1;
+  for (i = h->slots_size - 1; i >= 0; i--) {
+    if (h->slots[i].gen < GEN_MAX) {
+      slot_release(h, i);
+    }
+  }
   h->n_elements = 0;
-  h->size = size;
-  h->elements = realloc(h->elements, size * sizeof(struct peer));
-  if (h->elements == NULL) {
+  if (peerset_resize(h, size) < 0) {
     h->size = 0;
   }
 }
+
+int peerset_set_bmap(struct peerset *h, struct peer *p, struct chunkID_set *bmap)
+{
+  int res, i = p - h->elements;
+
+  avail_update_bmap(h, i, p->bmap, -1);
+  memset(peer_row(h, i), 0, h->words * sizeof(uint64_t));
+  chunkID_set_clear(p->bmap, chunkID_set_size(bmap));
+  res = chunkID_set_union(p->bmap, bmap);
+  avail_update_bmap(h, i, p->bmap, 1);
+  gettimeofday(&p->bmap_timestamp, NULL);
+  h->priv[i].last_seen = p->bmap_timestamp;
+
+  return res < 0 ? res : chunkID_set_size(p->bmap);
+}
+
+int peerset_chunk_availability(const struct peerset *h, int chunk_id)
+{
+  int c;
+
+  if (chunk_id < 0) {
+    return -1;
+  }
+  c = chunk_id % h->window;
+
+  return h->avail_id[c] == chunk_id ? h->avail_count[c] : -1;
+}
+
+const struct peerset_view *peerset_get_view(struct peerset *h)
+{
+  struct peerset_view *v = &h->view;
+  int i;
+
+  // the statistics live in the peers: copy them in the columns
+  for (i = 0; i < h->n_elements; i++) {
+    const struct peer *e = &h->elements[i];
+
+    h->col_rtt[i] = e->stats.rtt;
+    h->col_throughput[i] = e->stats.throughput;
+    h->col_loss[i] = e->stats.loss;
+    h->col_dup[i] = e->stats.dup;
+    h->col_outstanding[i] = e->stats.outstanding;
+    h->col_cb_size[i] = e->cb_size;
+  }
+  v->n_peers = h->n_elements;
+  v->window = h->window;
+  v->words = h->words;
+  v->bits = h->bits;
+  v->chunk_ids = h->avail_id;
+  v->rtt = h->col_rtt;
+  v->throughput = h->col_throughput;
+  v->loss = h->col_loss;
+  v->dup = h->col_dup;
+  v->outstanding = h->col_outstanding;
+  v->cb_size = h->col_cb_size;
+
+  return v;
+}
@@ -1,10 +1,74 @@
 #ifndef PEERSET_PRIVATE
 #define PEERSET_PRIVATE
 
+/*
+ * Slot map: peers are kept dense in elements (so that they can be iterated
+ * quickly), and handles refer to slots, which know where the peer is
+ */
+struct peer_slot {
+  int index;  // position in elements, or next free slot
+  uint32_t gen;  // incremented when the slot is freed
+  int bucket, prev, next;  // expiry timer wheel links (slots, -1 = none)
+};
+
+#define WHEEL_SIZE 64
+
+#define MAX_PENDING 16
+
+/* Chunk request sent to a peer */
+struct pending_request {
+  uint16_t trans_id;
+  int left;  // chunks not received yet
+  int replied;
+  struct timeval sent;
+};
+
+/* Per-peer state used to compute the statistics */
+struct peer_private {
+  struct pending_request pending[MAX_PENDING];  // oldest first
+  int n_pending;
+  int rx_bytes;
+  struct timeval rx_start;
+  struct timeval last_seen;  // last activity, for the expiry
+};
+
 struct peerset {
   int size;  //  
   int n_elements; // Number of ids in this array of chunks ids
   struct peer *elements;  // id number
+  int *slot_of;  // slot of each element
+  struct peer_slot *slots;  // slots_size slots (never shrinks)
+  int slots_size;
+  int free_slot;  // first free slot, -1 if none
+  struct nodeid_map *index;  // nodeID -> position in elements
+  /*
+   * Chunk window (column chunk_id % window): how many peers have each
+   * chunk, and which peers have it (one row of bits per peer)
+   */
+  int window;  // multiple of 64
+  int words;  // words per row
+  int *avail_id;  // id of the chunk in each column
+  int *avail_count;
+  uint64_t *bits;  // rows parallel to elements
+  /* Columns of the peer view, parallel to elements */
+  double *col_rtt, *col_throughput, *col_loss, *col_dup;
+  int *col_outstanding, *col_cb_size;
+  struct peerset_view view;
+  struct peer_private *priv;  // parallel to elements
+  int request_timeout;  // us
+  /*
+   * Expiry: every peer is in the wheel bucket of (about) the tick at
+   * which it expires; activity only updates last_seen, and the peers
+   * are moved forward when their bucket is reached
+   */
+  int64_t expire;  // us, 0 = never
+  int64_t tick;  // us
+  int64_t wheel_tick;  // next tick to be processed
+  int wheel[WHEEL_SIZE];  // first slot of each bucket
 };
 
+void wheel_init(struct peerset *h);
+void wheel_add(struct peerset *h, int slot);
+void wheel_del(struct peerset *h, int slot);
+
 #endif /* PEERSET_PRIVATE */
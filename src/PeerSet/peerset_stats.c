@@ -0,0 +1,164 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *  Copyright (c) 2010 Csaba Kiraly
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "peer.h"
+#include "peerset.h"
+#include "peerset_private.h"
+
+#define ALPHA 0.125	/* weight of a new sample in the averages */
+#define BETA 0.25	/* weight of a new sample in the RTT variation */
+#define THROUGHPUT_PERIOD 100000	/* us */
+
+static int64_t us_between(const struct timeval *from, const struct timeval *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_usec - from->tv_usec);
+}
+
+static void ewma(double *avg, double sample)
+{
+  *avg += ALPHA * (sample - *avg);
+}
+
+static struct peer_private *peer_priv(const struct peerset *h, const struct peer *p)
+{
+  if (p < h->elements || p >= h->elements + h->n_elements) {
+    return NULL;
+  }
+
+  return &h->priv[p - h->elements];
+}
+
+static void pending_pop(struct peer_private *pp)
+{
+  memmove(pp->pending, pp->pending + 1, --pp->n_pending * sizeof(struct pending_request));
+}
+
+/* The chunks of the oldest request are lost */
+static void request_lost(struct peer *p, struct peer_private *pp)
+{
+  int i;
+
+  for (i = 0; i < pp->pending[0].left; i++) {
+    ewma(&p->stats.loss, 1);
+  }
+  p->stats.outstanding -= pp->pending[0].left;
+  if (p->stats.outstanding < 0) {
+    p->stats.outstanding = 0;
+  }
+  pending_pop(pp);
+}
+
+static void expire_requests(const struct peerset *h, struct peer *p, struct peer_private *pp, const struct timeval *now)
+{
+  while (pp->n_pending && us_between(&pp->pending[0].sent, now) > h->request_timeout) {
+    request_lost(p, pp);
+  }
+}
+
+int peerset_sent_request(struct peerset *h, struct peer *p, uint16_t trans_id, int n)
+{
+  struct peer_private *pp = peer_priv(h, p);
+  struct pending_request *r;
+  struct timeval now;
+
+  if (pp == NULL) {
+    return -1;
+  }
+  gettimeofday(&now, NULL);
+  expire_requests(h, p, pp, &now);
+  if (pp->n_pending == MAX_PENDING) {
+    request_lost(p, pp);
+  }
+  r = &pp->pending[pp->n_pending++];
+  r->trans_id = trans_id;
+  r->left = n;
+  r->replied = 0;
+  r->sent = now;
+  p->stats.outstanding += n;
+
+  return p->stats.outstanding;
+}
+
+int peerset_received_reply(struct peerset *h, struct peer *p, uint16_t trans_id)
+{
+  struct peer_private *pp = peer_priv(h, p);
+  struct timeval now;
+  int i;
+
+  if (pp == NULL) {
+    return -1;
+  }
+  gettimeofday(&now, NULL);
+  pp->last_seen = now;
+  expire_requests(h, p, pp, &now);
+  for (i = 0; i < pp->n_pending; i++) {
+    struct pending_request *r = &pp->pending[i];
+
+    if (r->trans_id == trans_id && !r->replied) {
+      double sample = us_between(&r->sent, &now);
+
+      r->replied = 1;
+      if (p->stats.rtt == 0) {
+        p->stats.rtt = sample;
+        p->stats.rtt_var = sample / 2;
+      } else {
+        p->stats.rtt_var += BETA * ((sample > p->stats.rtt ? sample - p->stats.rtt : p->stats.rtt - sample) - p->stats.rtt_var);
+        ewma(&p->stats.rtt, sample);
+      }
+
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int peerset_received_chunk(struct peerset *h, struct peer *p, int size, int duplicate)
+{
+  struct peer_private *pp = peer_priv(h, p);
+  struct timeval now;
+  int64_t elapsed;
+
+  if (pp == NULL) {
+    return -1;
+  }
+  gettimeofday(&now, NULL);
+  pp->last_seen = now;
+  expire_requests(h, p, pp, &now);
+  ewma(&p->stats.dup, duplicate ? 1 : 0);
+  if (pp->n_pending) {
+    ewma(&p->stats.loss, 0);
+    p->stats.outstanding--;
+    if (--pp->pending[0].left <= 0) {
+      pending_pop(pp);
+    }
+  }
+
+  if (!timerisset(&pp->rx_start)) {
+    pp->rx_start = now;
+  }
+  pp->rx_bytes += size;
+  elapsed = us_between(&pp->rx_start, &now);
+  if (elapsed >= THROUGHPUT_PERIOD) {
+    double sample = pp->rx_bytes * 1000000.0 / elapsed;
+
+    if (p->stats.throughput == 0) {
+      p->stats.throughput = sample;
+    } else {
+      ewma(&p->stats.throughput, sample);
+    }
+    pp->rx_start = now;
+    pp->rx_bytes = 0;
+  }
+
+  return 1;
+}
@@ -6,146 +6,374 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "scheduler_la.h"
+#include "sched_private.h"
+#include "config.h"
+#include "prng.h"
 
 #define MAX(A,B)    ((A)>(B) ? (A) : (B))
 #define MIN(A,B)    ((A)<(B) ? (A) : (B))
 
 /**
-  * casted evaluator for generic use in generic selector functions
+  * scratch buffers owned by a scheduler context; each selector step uses its own slot
   */
-typedef double (*evaluateFunction)(void*);
+enum sched_buf {
+  BUF_IW,
+  BUF_TREE,
+  BUF_WEIGHTS,
+  BUF_INDEX,
+  BUF_PEER_WEIGHTS,
+  BUF_CHUNK_WEIGHTS,
+  BUF_PAIR_WEIGHTS,
+  BUF_FILTERED,
+  BUF_PEERS_SELECTED,
+  BUF_CHUNKS_SELECTED,
+  BUF_PAIRS,
+  BUF_PAIRS_SELECTED,
+  BUF_MAX
+};
+
+struct sched_context {
+  struct prng rng;
+  void *buf[BUF_MAX];
+  size_t buf_size[BUF_MAX];
+};
 
 struct iw {
   int index;
+  uint32_t tie;
   double weight;
 };
 
-static int cmp_iw_reverse(const void *a, const void *b)
+static void *scratch(struct sched_context *ctx, enum sched_buf b, size_t nmemb, size_t size)
+{
+  size_t needed = nmemb * size;
+
+  if (needed > ctx->buf_size[b]) {
+    void *res;
+
+    needed = MAX(needed, 2 * ctx->buf_size[b]);
+    res = realloc(ctx->buf[b], needed);
+    if (res == NULL) {
+      return NULL;
+    }
+    ctx->buf[b] = res;
+    ctx->buf_size[b] = needed;
+  }
+
+  return ctx->buf[b];
+}
+
+struct sched_context *schedContextInit(const char *config)
+{
+  struct sched_context *ctx;
+  struct tag *cfg_tags;
+  int seed;
+
+  ctx = calloc(1, sizeof(struct sched_context));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  cfg_tags = config_parse(config);
+  if (!cfg_tags) {
+    free(ctx);
+    return NULL;
+  }
+  if (!config_value_int(cfg_tags, "seed", &seed)) {
+    seed = rand();
+  }
+  free(cfg_tags);
+  prng_seed(&ctx->rng, seed);
+
+  return ctx;
+}
+
+void schedContextSeed(struct sched_context *ctx, unsigned int seed)
+{
+  prng_seed(&ctx->rng, seed);
+}
+
+struct prng *schedContextPrng(struct sched_context *ctx)
 {
-  const struct iw *a1 = (const struct iw *) a;
-  const struct iw *b1 = (const struct iw *) b;
-  return a1->weight==b1->weight ? 0 : (a1->weight<b1->weight ? 1 : -1);
+  return &ctx->rng;
+}
+
+void schedContextFree(struct sched_context *ctx)
+{
+  int i;
+
+  for (i = 0; i < BUF_MAX; i++) {
+    free(ctx->buf[i]);
+  }
+  free(ctx);
 }
 
 /**
-  * Select best N of K based using a given evaluator function
+  * context used by the legacy (context-less) selector functions: not thread safe!
   */
-void selectBests(size_t size,unsigned char *base, size_t nmemb, double(*evaluate)(void *),unsigned char *bests,size_t *bests_len){
-  struct iw iws[nmemb];
-  int i;
+static struct sched_context *default_context(void)
+{
+  static struct sched_context *ctx;
 
-  // calculate weights
-  for (i=0; i<nmemb; i++){
-     iws[i].index = i;
-     iws[i].weight = evaluate(base + size*i);
+  if (ctx == NULL) {
+    ctx = schedContextInit(NULL);
   }
 
-  // sort in descending order
-  qsort(iws, nmemb, sizeof(struct iw), cmp_iw_reverse);
-
-  // ensure uniform random tie
-  for (i=0; i<nmemb; i++){
-    int j, k;
-    for (j=i; j<nmemb && iws[i].weight == iws[j].weight; j++);
-    for (k=i; k<j; k++){
-      struct iw iwt = iws[k];
-      int r = i + (rand() % (j-i));
-      iws[k] = iws[r];
-      iws[r] = iwt;
+  return ctx;
+}
+
+/**
+  * a comes before b in descending order of weight (uniform random order among equal weights)
+  */
+static inline int iw_before(const struct iw *a, const struct iw *b)
+{
+  if (a->weight != b->weight) {
+    return a->weight > b->weight;
+  }
+
+  return a->tie < b->tie;
+}
+
+static inline void iw_swap(struct iw *a, struct iw *b)
+{
+  struct iw tmp = *a;
+
+  *a = *b;
+  *b = tmp;
+}
+
+/**
+  * Quicksort specialised for struct iw (much faster than qsort() calling a
+  * comparison function); thanks to the random ties the keys are all different,
+  * so the worst case is unlikely. Only the first k elements are fully sorted.
+  */
+static void sort_iw(struct iw *a, size_t n, size_t k)
+{
+  while (n > 16) {
+    size_t i, j, m = n / 2;
+    struct iw pivot;
+
+    // median of three
+    if (iw_before(&a[m], &a[0])) iw_swap(&a[m], &a[0]);
+    if (iw_before(&a[n - 1], &a[0])) iw_swap(&a[n - 1], &a[0]);
+    if (iw_before(&a[n - 1], &a[m])) iw_swap(&a[n - 1], &a[m]);
+    pivot = a[m];
+    i = 0;
+    j = n - 1;
+    while (1) {
+      while (iw_before(&a[i], &pivot)) i++;
+      while (iw_before(&pivot, &a[j])) j--;
+      if (i >= j) break;
+      iw_swap(&a[i++], &a[j--]);
     }
+    // a[0..j] come before a[j+1..n-1]
+    if (j + 1 < k) {
+      sort_iw(a + j + 1, n - j - 1, k - j - 1);
+    }
+    n = j + 1;
   }
+  {
+    size_t i, j;
 
-  *bests_len = MIN(*bests_len, nmemb);
+    for (i = 1; i < n; i++) {
+      struct iw tmp = a[i];
 
-  // copy bests in their place
-  for (i=0; i<*bests_len; i++){
-     memcpy(bests + size*i, base + size*iws[i].index, size);
+      for (j = i; j > 0 && iw_before(&tmp, &a[j - 1]); j--) {
+        a[j] = a[j - 1];
+      }
+      a[j] = tmp;
+    }
   }
-  
 }
 
 /**
-  * Select N of K with weigthed random choice, without replacement (multiple selection), based on a given evaluator function
+  * Select the indexes of the best N of K weights
   */
-void selectWeighted(size_t size,unsigned char *base, size_t nmemb, double(*weight)(void *),unsigned char *selected,size_t *selected_len){
-  int i,j,k;
-  double weights[nmemb];
-  double w_sum=0;
-  double selected_index[nmemb];
-  int s=0;
-  int s_max = MIN (*selected_len, nmemb);;
-
-  // calculate weights
-  for (i=0; i<nmemb; i++){
-     weights[i] = weight(base + size*i);
-     // weights should not be negative
-     weights[i] = MAX (weights[i], 0);
-     w_sum += weights[i];
-  }
-
-  // all weights shuold not be zero, but if if happens, do something
-  if (w_sum == 0) {
-    for (i=0; i<nmemb; i++){
-      weights[i] = 1;
-      w_sum += weights[i];
+static size_t selectBests(struct sched_context *ctx, const double *weights, size_t nmemb, int *selected, size_t selected_len)
+{
+  struct iw *iws;
+  size_t i;
+
+  iws = scratch(ctx, BUF_IW, nmemb, sizeof(struct iw));
+  if (iws == NULL) {
+    return 0;
+  }
+  for (i = 0; i < nmemb; i++) {
+    iws[i].index = i;
+    iws[i].tie = prng_next(&ctx->rng);
+    iws[i].weight = weights[i];
+  }
+
+  // sort in descending order
+  selected_len = MIN(selected_len, nmemb);
+  sort_iw(iws, nmemb, selected_len);
+
+  for (i = 0; i < selected_len; i++) {
+    selected[i] = iws[i].index;
+  }
+
+  return selected_len;
+}
+
+/**
+  * Fenwick tree of the weights (t[1..n]), to sample and remove them in O(log n)
+  */
+static void fenwick_build(double *t, const double *weights, size_t n)
+{
+  size_t i, j;
+
+  for (i = 1; i <= n; i++) {
+    t[i] = weights[i - 1];
+  }
+  for (i = 1; i <= n; i++) {
+    j = i + (i & -i);
+    if (j <= n) {
+      t[j] += t[i];
     }
   }
+}
+
+static void fenwick_add(double *t, size_t n, size_t i, double d)
+{
+  for (i++; i <= n; i += i & -i) {
+    t[i] += d;
+  }
+}
 
-  while (s < s_max) {
-    // select one randomly
-    double t = w_sum * (rand() / (RAND_MAX + 1.0));
-    //search for it in the CDF
-    double cdf = 0;
-    for (j=0; j<nmemb; j++){
-      cdf += weights[j];
-      //printf("(%f <? %f\n",t,cdf);
-      if (t < cdf) {
-        int already_selected=0;
-        for (k=0; k<s; k++) {
-          if (selected_index[k] == j)  already_selected=1;
-        }
-        if (!already_selected){ 
-          //printf("selected %d(%f) for %d\n",j,weights[j],k);
-          memcpy(selected + size*s, base + size*j, size);
-          selected_index[s++]=j;
-        }
-        break;
-      }
+/**
+  * Index of the element where the CDF crosses x
+  */
+static size_t fenwick_find(const double *t, size_t n, double x)
+{
+  size_t pos = 0, step = 1;
+
+  while (step * 2 <= n) {
+    step *= 2;
+  }
+  for (; step; step /= 2) {
+    if (pos + step <= n && t[pos + step] <= x) {
+      pos += step;
+      x -= t[pos];
     }
   }
-  *selected_len=s;
+
+  return pos;
 }
 
 /**
-  * Select best N of K with the given ordering method
+  * Pick the element where the CDF crosses x, or nmemb if no positive weight is left
   */
-void selectWithOrdering(SchedOrdering ordering, size_t size, unsigned char *base, size_t nmemb, double(*evaluate)(void *), unsigned char *selected,size_t *selected_len){
-  if (ordering == SCHED_WEIGHTED) selectWeighted(size, base, nmemb, evaluate, selected, selected_len);
-  else selectBests(size, base, nmemb, evaluate, selected, selected_len);
+static size_t pickWeighted(const double *tree, const double *weights, size_t nmemb, double x)
+{
+  size_t i = fenwick_find(tree, nmemb, x);
+
+  if (i >= nmemb || weights[i] <= 0) {
+    // rounding errors: take the first element still available
+    for (i = 0; i < nmemb && weights[i] <= 0; i++);
+  }
+
+  return i;
 }
 
 /**
-  * Select best N of K peers with the given ordering method
+  * Select the indexes of N of K weights with weigthed random choice, without replacement (multiple selection)
+  * Note: weights are modified
   */
-void selectPeers(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, peerEvaluateFunction peerevaluate, schedPeerID *selected, size_t *selected_len ){
-  selectWithOrdering(ordering, sizeof(peers[0]), (void*)peers, peers_len, (evaluateFunction)peerevaluate, (void*)selected, selected_len);
+static size_t selectWeighted(struct sched_context *ctx, double *weights, size_t nmemb, int *selected, size_t selected_len)
+{
+  double *tree = scratch(ctx, BUF_TREE, nmemb + 1, sizeof(double));
+  size_t i, s;
+  double w_sum = 0;
+  int uniform = 0;
+
+  if (tree == NULL) {
+    return 0;
+  }
+  selected_len = MIN(selected_len, nmemb);
+  for (i = 0; i < nmemb; i++) {
+    // weights should not be negative
+    weights[i] = MAX(weights[i], 0);
+    w_sum += weights[i];
+  }
+  fenwick_build(tree, weights, nmemb);
+
+  for (s = 0; s < selected_len; s++) {
+    size_t last = w_sum > 0 ? pickWeighted(tree, weights, nmemb, w_sum * prng_double(&ctx->rng)) : nmemb;
+
+    if (last == nmemb && !uniform) {
+      // only zero weights left: keep on with uniform choice among the others
+      // (the selected ones are marked with negative weights)
+      for (i = 0, w_sum = 0; i < nmemb; i++) {
+        weights[i] = weights[i] < 0 ? 0 : 1;
+        w_sum += weights[i];
+      }
+      fenwick_build(tree, weights, nmemb);
+      uniform = 1;
+      last = pickWeighted(tree, weights, nmemb, w_sum * prng_double(&ctx->rng));
+    }
+    if (last == nmemb) break;
+    selected[s] = last;
+    // remove it, so that it cannot be selected again
+    w_sum -= weights[last];
+    fenwick_add(tree, nmemb, last, -weights[last]);
+    weights[last] = -1;
+  }
+
+  return s;
 }
 
 /**
-  * Select best N of K chunks with the given ordering method
+  * Select the indexes of the best N of K weights with the given ordering method
   */
-void selectChunks(SchedOrdering ordering, schedChunkID *chunks, size_t chunks_len, chunkEvaluateFunction chunkevaluate, schedChunkID *selected, size_t *selected_len ){
-  selectWithOrdering(ordering, sizeof(chunks[0]), (void*)chunks,chunks_len, (evaluateFunction)chunkevaluate, (void*)selected, selected_len);
+static size_t selectWithOrdering(struct sched_context *ctx, SchedOrdering ordering, double *weights, size_t nmemb, int *selected, size_t selected_len)
+{
+  if (ordering == SCHED_WEIGHTED) {
+    return selectWeighted(ctx, weights, nmemb, selected, selected_len);
+  }
+
+  return selectBests(ctx, weights, nmemb, selected, selected_len);
 }
 
 /**
-  * Select best N of K peer-chunk pairs with the given ordering method
+  * Select at most selected_len of the candidates (indexes in weights, or all the weights if cand is NULL)
   */
-void selectPairs(SchedOrdering ordering, struct PeerChunk *pairs, size_t pairs_len, pairEvaluateFunction evaluate, struct PeerChunk *selected, size_t *selected_len ){
-  selectWithOrdering(ordering, sizeof(pairs[0]), (void*)pairs, pairs_len, (evaluateFunction)evaluate, (void*)selected, selected_len);
+size_t schedSelectIndexes(struct sched_context *ctx, SchedOrdering ordering, const double *weights, const int *cand, size_t nmemb, int *selected, size_t selected_len)
+{
+  double *w = scratch(ctx, BUF_WEIGHTS, nmemb, sizeof(double));
+  int *idx = scratch(ctx, BUF_INDEX, nmemb, sizeof(int));
+  size_t i;
+
+  if (w == NULL || idx == NULL) {
+    return 0;
+  }
+  for (i = 0; i < nmemb; i++) {
+    w[i] = weights[cand ? cand[i] : i];
+  }
+  selected_len = selectWithOrdering(ctx, ordering, w, nmemb, idx, selected_len);
+  for (i = 0; i < selected_len; i++) {
+    selected[i] = cand ? cand[idx[i]] : idx[i];
+  }
+
+  return selected_len;
 }
 
+/**
+  * Select best N of K peer-chunk pairs with the given ordering method, using precomputed weights
+  */
+static void selectPairsWeighted(struct sched_context *ctx, SchedOrdering ordering, const struct PeerChunk *pairs, const double *weights, size_t pairs_len, struct PeerChunk *selected, size_t *selected_len ){
+  int *sel = scratch(ctx, BUF_PAIRS_SELECTED, *selected_len, sizeof(int));
+  size_t i;
+
+  if (sel == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  *selected_len = schedSelectIndexes(ctx, ordering, weights, NULL, pairs_len, sel, *selected_len);
+  for (i = 0; i < *selected_len; i++) {
+    selected[i] = pairs[sel[i]];
+  }
+}
 
 /**
   * Filter a list of peers. Include a peer if the filter function is true with at least one of the given chunks
@@ -203,35 +431,43 @@ void filterPairs(struct PeerChunk *pairs, size_t *pairs_len,
 }
 
 /**
-  * Select at most N of K peers, among those where filter is true with at least one of the chunks.
+  * Indexes of the peers for which filter is true with at least one of the chunks
   */
-void selectPeersForChunks(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
-                     schedPeerID *selected, size_t *selected_len,	//out, inout
-                     filterFunction filter,
-                     peerEvaluateFunction evaluate){
-
-  size_t filtered_len=peers_len;
-  schedPeerID filtered[filtered_len];
+static size_t filterPeersIdx(schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, int *filtered, filterFunction filter)
+{
+  size_t p, c, f = 0;
 
-  filterPeers2(peers, peers_len, chunks,chunks_len, filtered, &filtered_len, filter);
+  for (p = 0; p < peers_len; p++) {
+    for (c = 0; c < chunks_len; c++) {
+      if (!filter || filter(peers[p], chunks[c])) {
+        filtered[f++] = p;
+        break;
+      }
+    }
+  }
 
-  selectPeers(ordering, filtered, filtered_len, evaluate, selected, selected_len);
+  return f;
 }
 
-void selectChunksForPeers(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
-                     schedChunkID *selected, size_t *selected_len,	//out, inout
-                     filterFunction filter,
-                     chunkEvaluateFunction evaluate){
-
-  size_t filtered_len=chunks_len;
-  schedChunkID filtered[filtered_len];
+/**
+  * Indexes of the chunks for which filter is true with at least one of the peers
+  */
+static size_t filterChunksIdx(schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, int *filtered, filterFunction filter)
+{
+  size_t p, c, f = 0;
 
-  filterChunks2(peers, peers_len, chunks,chunks_len, filtered, &filtered_len, filter);
+  for (c = 0; c < chunks_len; c++) {
+    for (p = 0; p < peers_len; p++) {
+      if (!filter || filter(peers[p], chunks[c])) {
+        filtered[f++] = c;
+        break;
+      }
+    }
+  }
 
-  selectChunks(ordering, filtered, filtered_len, evaluate, selected, selected_len);
+  return f;
 }
 
-
 void toPairsPeerFirst(schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
                      struct PeerChunk *pairs, size_t *pairs_len) {	//out, inout
   size_t p,c;
@@ -266,71 +502,355 @@ void toPairs(schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t
   toPairsChunkFirst(peers, peers_len, chunks, chunks_len, pairs, pairs_len);
 }
 
+/*----------------- selection on precomputed weights --------------*/
+
+void schedSelectPeerFirstWeights(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, const double *peer_w, size_t peers_len, schedChunkID *chunks, const double *chunk_w, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter)
+{
+  int *filtered = scratch(ctx, BUF_FILTERED, MAX(peers_len, chunks_len), sizeof(int));
+  int *c = scratch(ctx, BUF_CHUNKS_SELECTED, *selected_len, sizeof(int));
+  size_t n, i;
+  int p;
+
+  if (filtered == NULL || c == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  n = filterPeersIdx(peers, peers_len, chunks, chunks_len, filtered, filter);
+  if (schedSelectIndexes(ctx, ordering, peer_w, filtered, n, &p, 1) == 0) {
+    *selected_len = 0;
+    return;
+  }
+  n = filterChunksIdx(&peers[p], 1, chunks, chunks_len, filtered, filter);
+  *selected_len = schedSelectIndexes(ctx, ordering, chunk_w, filtered, n, c, *selected_len);
+  for (i = 0; i < *selected_len; i++) {
+    selected[i].peer = peers[p];
+    selected[i].chunk = chunks[c[i]];
+  }
+}
+
+void schedSelectChunkFirstWeights(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, const double *peer_w, size_t peers_len, schedChunkID *chunks, const double *chunk_w, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter)
+{
+  int *filtered = scratch(ctx, BUF_FILTERED, MAX(peers_len, chunks_len), sizeof(int));
+  int *p = scratch(ctx, BUF_PEERS_SELECTED, *selected_len, sizeof(int));
+  size_t n, i;
+  int c;
+
+  if (filtered == NULL || p == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  n = filterChunksIdx(peers, peers_len, chunks, chunks_len, filtered, filter);
+  if (schedSelectIndexes(ctx, ordering, chunk_w, filtered, n, &c, 1) == 0) {
+    *selected_len = 0;
+    return;
+  }
+  n = filterPeersIdx(peers, peers_len, &chunks[c], 1, filtered, filter);
+  *selected_len = schedSelectIndexes(ctx, ordering, peer_w, filtered, n, p, *selected_len);
+  for (i = 0; i < *selected_len; i++) {
+    selected[i].peer = peers[p[i]];
+    selected[i].chunk = chunks[c];
+  }
+}
+
+void schedSelectComposedWeights(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, const double *peer_w, size_t peers_len, schedChunkID *chunks, const double *chunk_w, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter, double2op weightcombine)
+{
+  struct PeerChunk *pairs = scratch(ctx, BUF_PAIRS, peers_len * chunks_len, sizeof(struct PeerChunk));
+  double *w = scratch(ctx, BUF_PAIR_WEIGHTS, peers_len * chunks_len, sizeof(double));
+  size_t p, c, pairs_len = 0;
+
+  if (pairs == NULL || w == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  for (c = 0; c < chunks_len; c++) {
+    for (p = 0; p < peers_len; p++) {
+      if (!filter || filter(peers[p], chunks[c])) {
+        pairs[pairs_len].peer = peers[p];
+        pairs[pairs_len].chunk = chunks[c];
+        w[pairs_len++] = weightcombine(peer_w[p], chunk_w[c]);
+      }
+    }
+  }
+  selectPairsWeighted(ctx, ordering, pairs, w, pairs_len, selected, selected_len);
+}
+
 /*----------------- scheduler_la implementations --------------*/
 
-void schedSelectPeerFirst(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+static double *evaluatePeers(struct sched_context *ctx, schedPeerID *peers, size_t peers_len, peerEvaluateFunction evaluate)
+{
+  double *w = scratch(ctx, BUF_PEER_WEIGHTS, peers_len, sizeof(double));
+  size_t i;
+
+  if (w) {
+    for (i = 0; i < peers_len; i++) {
+      w[i] = evaluate(&peers[i]);
+    }
+  }
+
+  return w;
+}
+
+static double *evaluateChunks(struct sched_context *ctx, schedChunkID *chunks, size_t chunks_len, chunkEvaluateFunction evaluate)
+{
+  double *w = scratch(ctx, BUF_CHUNK_WEIGHTS, chunks_len, sizeof(double));
+  size_t i;
+
+  if (w) {
+    for (i = 0; i < chunks_len; i++) {
+      w[i] = evaluate(&chunks[i]);
+    }
+  }
+
+  return w;
+}
+
+void schedCtxSelectPeerFirst(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
                      struct PeerChunk *selected, size_t *selected_len,	//out, inout
                      filterFunction filter,
                      peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate){
+  double *pw = evaluatePeers(ctx, peers, peers_len, peerevaluate);
+  double *cw = evaluateChunks(ctx, chunks, chunks_len, chunkevaluate);
 
-  size_t p_len=1;
-  schedPeerID p[p_len];
-  size_t c_len=*selected_len;
-  schedChunkID c[c_len];
-  selectPeersForChunks(ordering, peers, peers_len, chunks, chunks_len, p, &p_len, filter, peerevaluate);
-  selectChunksForPeers(ordering, p, p_len, chunks, chunks_len, c, &c_len, filter, chunkevaluate);
-
-  toPairsPeerFirst(p,p_len,c,c_len,selected,selected_len);
+  if (pw == NULL || cw == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectPeerFirstWeights(ctx, ordering, peers, pw, peers_len, chunks, cw, chunks_len, selected, selected_len, filter);
 }
 
-void schedSelectChunkFirst(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+void schedCtxSelectChunkFirst(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
                      struct PeerChunk *selected, size_t *selected_len,	//out, inout
                      filterFunction filter,
                      peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate){
+  double *pw = evaluatePeers(ctx, peers, peers_len, peerevaluate);
+  double *cw = evaluateChunks(ctx, chunks, chunks_len, chunkevaluate);
 
-  size_t p_len=*selected_len;
-  schedPeerID p[p_len];
-  size_t c_len=1;
-  schedChunkID c[c_len];
-  selectChunksForPeers(ordering, peers, peers_len, chunks, chunks_len, c, &c_len, filter, chunkevaluate);
-  selectPeersForChunks(ordering, peers, peers_len, c, c_len, p, &p_len, filter, peerevaluate);
-
-  toPairsChunkFirst(p,p_len,c,c_len,selected,selected_len);
+  if (pw == NULL || cw == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectChunkFirstWeights(ctx, ordering, peers, pw, peers_len, chunks, cw, chunks_len, selected, selected_len, filter);
 }
 
-void schedSelectHybrid(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+void schedCtxSelectHybrid(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
                      struct PeerChunk *selected, size_t *selected_len,	//out, inout
                      filterFunction filter,
                      pairEvaluateFunction pairevaluate)
+{
+  size_t i, pairs_len=peers_len*chunks_len;
+  struct PeerChunk *pairs = scratch(ctx, BUF_PAIRS, pairs_len, sizeof(struct PeerChunk));
+  double *w = scratch(ctx, BUF_PAIR_WEIGHTS, pairs_len, sizeof(double));
+
+  if (pairs == NULL || w == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  toPairs(peers,peers_len,chunks,chunks_len,pairs,&pairs_len);
+  filterPairs(pairs,&pairs_len,filter);
+  for (i = 0; i < pairs_len; i++) {
+    w[i] = pairevaluate(&pairs[i]);
+  }
+  selectPairsWeighted(ctx,ordering,pairs,w,pairs_len,selected,selected_len);
+}
+
+/**
+  * Combine peer and chunk weights; every peer and every chunk is evaluated only once
+  */
+void schedCtxSelectComposed(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate, double2op weightcombine)
+{
+  double *pw = evaluatePeers(ctx, peers, peers_len, peerevaluate);
+  double *cw = evaluateChunks(ctx, chunks, chunks_len, chunkevaluate);
+
+  if (pw == NULL || cw == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectComposedWeights(ctx, ordering, peers, pw, peers_len, chunks, cw, chunks_len, selected, selected_len, filter, weightcombine);
+}
+
+/*----------------- batch evaluators --------------*/
+
+void schedEvaluatePeersRandom(void *arg, const schedPeerID *peers, size_t n, double *weights)
+{
+  struct prng *r = &((struct sched_context *)arg)->rng;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    weights[i] = prng_double(r);
+  }
+}
+
+void schedEvaluateChunksRandom(void *arg, const schedChunkID *chunks, size_t n, double *weights)
+{
+  schedEvaluatePeersRandom(arg, NULL, n, weights);
+}
+
+void schedEvaluateChunksAge(void *arg, const schedChunkID *chunks, size_t n, double *weights)
+{
+  const uint64_t *ts = arg;
+  size_t i;
+
+  if (n == 0) {
+    return;
+  }
+  if (ts) {
+    uint64_t min = ts[0];
+
+    for (i = 1; i < n; i++) {
+      min = MIN(min, ts[i]);
+    }
+    for (i = 0; i < n; i++) {
+      weights[i] = (double)(ts[i] - min) + 1;
+    }
+  } else {
+    schedChunkID min = chunks[0];
+
+    for (i = 1; i < n; i++) {
+      min = MIN(min, chunks[i]);
+    }
+    for (i = 0; i < n; i++) {
+      weights[i] = (double)(chunks[i] - min) + 1;
+    }
+  }
+}
+
+void schedEvaluatePeersBandwidth(void *arg, const schedPeerID *peers, size_t n, double *weights)
+{
+  const double *bw = arg;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    weights[i] = MAX(bw[i], 0);
+  }
+}
+
+static double *evaluatePeersBatch(struct sched_context *ctx, schedPeerID *peers, size_t peers_len, peerEvaluateBatchFunction evaluate, void *arg)
+{
+  double *w = scratch(ctx, BUF_PEER_WEIGHTS, peers_len, sizeof(double));
+
+  if (w) {
+    evaluate(arg, peers, peers_len, w);
+  }
+
+  return w;
+}
+
+static double *evaluateChunksBatch(struct sched_context *ctx, schedChunkID *chunks, size_t chunks_len, chunkEvaluateBatchFunction evaluate, void *arg)
+{
+  double *w = scratch(ctx, BUF_CHUNK_WEIGHTS, chunks_len, sizeof(double));
+
+  if (w) {
+    evaluate(arg, chunks, chunks_len, w);
+  }
+
+  return w;
+}
+
+void schedCtxSelectPeerFirstBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateBatchFunction peerevaluate, void *peerarg, chunkEvaluateBatchFunction chunkevaluate, void *chunkarg)
+{
+  double *pw = evaluatePeersBatch(ctx, peers, peers_len, peerevaluate, peerarg);
+  double *cw = evaluateChunksBatch(ctx, chunks, chunks_len, chunkevaluate, chunkarg);
+
+  if (pw == NULL || cw == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectPeerFirstWeights(ctx, ordering, peers, pw, peers_len, chunks, cw, chunks_len, selected, selected_len, filter);
+}
+
+void schedCtxSelectChunkFirstBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateBatchFunction peerevaluate, void *peerarg, chunkEvaluateBatchFunction chunkevaluate, void *chunkarg)
+{
+  double *pw = evaluatePeersBatch(ctx, peers, peers_len, peerevaluate, peerarg);
+  double *cw = evaluateChunksBatch(ctx, chunks, chunks_len, chunkevaluate, chunkarg);
+
+  if (pw == NULL || cw == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectChunkFirstWeights(ctx, ordering, peers, pw, peers_len, chunks, cw, chunks_len, selected, selected_len, filter);
+}
+
+void schedCtxSelectComposedBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateBatchFunction peerevaluate, void *peerarg, chunkEvaluateBatchFunction chunkevaluate, void *chunkarg, double2op weightcombine)
+{
+  double *pw = evaluatePeersBatch(ctx, peers, peers_len, peerevaluate, peerarg);
+  double *cw = evaluateChunksBatch(ctx, chunks, chunks_len, chunkevaluate, chunkarg);
+
+  if (pw == NULL || cw == NULL) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectComposedWeights(ctx, ordering, peers, pw, peers_len, chunks, cw, chunks_len, selected, selected_len, filter, weightcombine);
+}
+
+void schedCtxSelectHybridBatch(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     pairEvaluateBatchFunction pairevaluate, void *pairarg)
 {
   size_t pairs_len=peers_len*chunks_len;
-  struct PeerChunk pairs[pairs_len];
+  struct PeerChunk *pairs = scratch(ctx, BUF_PAIRS, pairs_len, sizeof(struct PeerChunk));
+  double *w = scratch(ctx, BUF_PAIR_WEIGHTS, pairs_len, sizeof(double));
+
+  if (pairs == NULL || w == NULL) {
+    *selected_len = 0;
+    return;
+  }
   toPairs(peers,peers_len,chunks,chunks_len,pairs,&pairs_len);
   filterPairs(pairs,&pairs_len,filter);
-  selectPairs(ordering,pairs,pairs_len,pairevaluate,selected,selected_len);
+  pairevaluate(pairarg, pairs, pairs_len, w);
+  selectPairsWeighted(ctx,ordering,pairs,w,pairs_len,selected,selected_len);
 }
 
+/*----------------- legacy (context-less) functions --------------*/
 
-peerEvaluateFunction peer_ev;
-chunkEvaluateFunction chunk_ev;
-double2op peerchunk_wc;
+void schedSelectPeerFirst(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate){
+  schedCtxSelectPeerFirst(default_context(), ordering, peers, peers_len, chunks, chunks_len, selected, selected_len, filter, peerevaluate, chunkevaluate);
+}
+
+void schedSelectChunkFirst(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate){
+  schedCtxSelectChunkFirst(default_context(), ordering, peers, peers_len, chunks, chunks_len, selected, selected_len, filter, peerevaluate, chunkevaluate);
+}
 
-double combinedWeight(struct PeerChunk* pc){
-  return peerchunk_wc(peer_ev(&pc->peer),chunk_ev(&pc->chunk));
+void schedSelectHybrid(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter,
+                     pairEvaluateFunction pairevaluate)
+{
+  schedCtxSelectHybrid(default_context(), ordering, peers, peers_len, chunks, chunks_len, selected, selected_len, filter, pairevaluate);
 }
 
 /**
   * Convenience function for combining peer and chunk weights
-  * not thread safe!
+  * not thread safe! (use schedCtxSelectComposed for that)
   */
 void schedSelectComposed(SchedOrdering ordering, schedPeerID *peers, size_t peers_len, schedChunkID *chunks, size_t chunks_len, 	//in
                      struct PeerChunk *selected, size_t *selected_len,	//out, inout
                      filterFunction filter,
                      peerEvaluateFunction peerevaluate, chunkEvaluateFunction chunkevaluate, double2op weightcombine)
 {
-  peer_ev=peerevaluate;
-  chunk_ev=chunkevaluate;
-  peerchunk_wc=weightcombine;
-  schedSelectHybrid(ordering,peers,peers_len,chunks,chunks_len,selected,selected_len,filter,combinedWeight);
-
+  schedCtxSelectComposed(default_context(), ordering, peers, peers_len, chunks, chunks_len, selected, selected_len, filter, peerevaluate, chunkevaluate, weightcombine);
 }
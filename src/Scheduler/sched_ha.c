@@ -0,0 +1,745 @@
+/*
+ *  Copyright (c) 2010 Csaba Kiraly
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "peer.h"
+#include "chunk.h"
+#include "chunkbuffer.h"
+#include "chunkidset.h"
+#include "peerset.h"
+#include "grapes_coords.h"
+#include "scheduler_ha.h"
+#include "scheduler_la.h"
+#include "sched_private.h"
+#include "config.h"
+
+enum chunk_eval {CHUNK_LATEST, CHUNK_OLDEST, CHUNK_RANDOM, CHUNK_RAREST, CHUNK_EDF};
+enum peer_eval {PEER_RANDOM, PEER_FRESH, PEER_BANDWIDTH, PEER_RTT};
+
+struct eval_name {
+  const char *name;
+  int eval;
+};
+
+static const struct eval_name chunk_evals[] = {
+  {"latest", CHUNK_LATEST},
+  {"oldest", CHUNK_OLDEST},
+  {"random", CHUNK_RANDOM},
+  {"rarest_first", CHUNK_RAREST},
+  {"edf", CHUNK_EDF},
+  {NULL, 0}
+};
+
+static const struct eval_name peer_evals[] = {
+  {"random", PEER_RANDOM},
+  {"fresh", PEER_FRESH},
+  {"bandwidth", PEER_BANDWIDTH},
+  {"rtt", PEER_RTT},
+  {NULL, 0}
+};
+
+static struct sched_context *ctx;
+static SchedOrdering ordering;
+static enum chunk_eval push_eval;
+static enum chunk_eval pull_eval;
+static enum peer_eval peer_eval;
+
+/* Deadline of a chunk (in the chunks' timestamp timebase) */
+struct deadline {
+  int id;
+  int64_t time;
+};
+
+#define NO_DEADLINE INT64_MAX
+
+static struct chunk_buffer *cb;
+static struct peerset *pset;
+static const struct peerset_view *view;	/* of pset, refreshed by prepare() */
+static const struct peer *view_peers;
+static int64_t playout_delay;	/* 0: chunk deadlines are not considered */
+static int64_t default_rtt;
+static int64_t now;
+static int one_way;	/* chunks are pushed, not requested */
+static int (*base_filter)(schedPeerID, schedChunkID);
+
+/* Position of a chunk ID in the chunks array */
+struct chunk_index {
+  int id;
+  int index;
+};
+
+static int budget;	/* 0: no limit on the requests per peer */
+
+static double *peer_w, *chunk_w, *finish, *rate;
+static int *order, *assigned;
+static int *id_map;	/* chunk ID - min ID -> position in the chunks array */
+static int id_map_size;
+static struct deadline *deadlines;
+static struct chunk_index *chunk_idx;
+static int deadlines_len;
+static int peer_w_size, chunk_w_size;
+static uint64_t *holders, *free_peers;	/* bitmaps of the peers */
+static size_t holders_size;
+
+static int eval_parse(const struct tag *cfg_tags, const char *tag, const struct eval_name *names, int *eval)
+{
+  const char *val;
+  int i;
+
+  val = config_value_str(cfg_tags, tag);
+  if (val == NULL) {
+    return 1;
+  }
+  for (i = 0; names[i].name; i++) {
+    if (!strcmp(val, names[i].name)) {
+      *eval = names[i].eval;
+
+      return 1;
+    }
+  }
+  fprintf(stderr, "Scheduler: unknown %s evaluator %s\n", tag, val);
+
+  return -1;
+}
+
+int schedInit(const char *cfg)
+{
+  struct tag *cfg_tags;
+  const char *val;
+  int res, pe = CHUNK_LATEST, le = CHUNK_RAREST, ev = PEER_RANDOM;
+  int delay = 0, rtt = 100000, max_req = 0;
+  SchedOrdering o = SCHED_BEST;
+
+  cfg_tags = config_parse(cfg);
+  if (!cfg_tags) {
+    return -1;
+  }
+  val = config_value_str(cfg_tags, "ordering");
+  if (val) {
+    if (!strcmp(val, "weighted")) {
+      o = SCHED_WEIGHTED;
+    } else if (strcmp(val, "best")) {
+      fprintf(stderr, "Scheduler: unknown ordering %s\n", val);
+      free(cfg_tags);
+
+      return -1;
+    }
+  }
+  res = eval_parse(cfg_tags, "push", chunk_evals, &pe);
+  if (res > 0) res = eval_parse(cfg_tags, "pull", chunk_evals, &le);
+  if (res > 0) res = eval_parse(cfg_tags, "peer", peer_evals, &ev);
+  config_value_int(cfg_tags, "playout_delay", &delay);
+  config_value_int(cfg_tags, "rtt", &rtt);
+  config_value_int(cfg_tags, "budget", &max_req);
+  free(cfg_tags);
+  if (res < 0) {
+    return res;
+  }
+  if ((pe == CHUNK_EDF || le == CHUNK_EDF) && delay <= 0) {
+    fprintf(stderr, "Scheduler: edf needs a playout_delay\n");
+
+    return -1;
+  }
+
+  if (ctx) {
+    schedContextFree(ctx);
+  }
+  ctx = schedContextInit(cfg);
+  if (ctx == NULL) {
+    return -1;
+  }
+  ordering = o;
+  push_eval = pe;
+  pull_eval = le;
+  peer_eval = ev;
+  playout_delay = delay > 0 ? delay : 0;
+  default_rtt = rtt;
+  budget = max_req > 0 ? max_req : 0;
+
+  return 1;
+}
+
+void schedSetChunkBuffer(struct chunk_buffer *buffer)
+{
+  cb = buffer;
+}
+
+void schedSetPeerSet(struct peerset *peers)
+{
+  pset = peers;
+}
+
+static int sched_ready(int peers_len, int chunks_len)
+{
+  if (ctx == NULL && schedInit(NULL) < 0) {
+    return 0;
+  }
+  if (peers_len > peer_w_size) {
+    double *w = realloc(peer_w, peers_len * sizeof(double));
+    double *t = realloc(finish, peers_len * sizeof(double));
+    double *r = realloc(rate, peers_len * sizeof(double));
+    int *a = realloc(assigned, peers_len * sizeof(int));
+    uint64_t *f = realloc(free_peers, (peers_len + 63) / 64 * sizeof(uint64_t));
+
+    if (w) peer_w = w;
+    if (t) finish = t;
+    if (r) rate = r;
+    if (a) assigned = a;
+    if (f) free_peers = f;
+    if (w == NULL || t == NULL || r == NULL || a == NULL || f == NULL) {
+      return 0;
+    }
+    peer_w_size = peers_len;
+  }
+  if (chunks_len > chunk_w_size) {
+    double *w = realloc(chunk_w, chunks_len * sizeof(double));
+    int *o = realloc(order, chunks_len * sizeof(int));
+    struct deadline *d = realloc(deadlines, chunks_len * sizeof(struct deadline));
+    struct chunk_index *ci = realloc(chunk_idx, chunks_len * sizeof(struct chunk_index));
+
+    if (w) chunk_w = w;
+    if (o) order = o;
+    if (d) deadlines = d;
+    if (ci) chunk_idx = ci;
+    if (w == NULL || o == NULL || d == NULL || ci == NULL) {
+      return 0;
+    }
+    chunk_w_size = chunks_len;
+  }
+
+  return 1;
+}
+
+/* Position of the peer in the view, or -1 if it is not a peer of pset */
+static int view_index(schedPeerID p)
+{
+  if (view == NULL || p < view_peers || p >= view_peers + view->n_peers) {
+    return -1;
+  }
+
+  return p - view_peers;
+}
+
+/* 1 if the peer has the chunk, 0 if not, looking at the view first */
+static int peer_has(schedPeerID p, schedChunkID c)
+{
+  int i = view_index(p);
+
+  if (i >= 0) {
+    int res = peerset_view_has(view, i, c);
+
+    if (res >= 0) {
+      return res;
+    }
+  }
+
+  return p->bmap && chunkID_set_check(p->bmap, c) >= 0;
+}
+
+/* The peer does not have the chunk, so it might be interested in it */
+static int needs(schedPeerID p, schedChunkID c)
+{
+  return !peer_has(p, c);
+}
+
+/* The peer has the chunk, so the chunk can be requested from it */
+static int has(schedPeerID p, schedChunkID c)
+{
+  return peer_has(p, c);
+}
+
+/* Measured RTT of the peer (see struct peer_stats), or estimated, or the configured one */
+static int64_t peer_rtt(schedPeerID p)
+{
+  double rtt;
+
+  if (p->stats.rtt > 0) {
+    return p->stats.rtt;
+  }
+  rtt = coord_distance(NULL, p->id);
+
+  return rtt > 0 ? rtt : default_rtt;
+}
+
+static int cmp_deadline(const void *a, const void *b)
+{
+  const struct deadline *d1 = a, *d2 = b;
+
+  return d1->id - d2->id;
+}
+
+static int cmp_chunk(const void *a, const void *b)
+{
+  const struct chunk *c1 = a, *c2 = b;
+
+  return c1->id - c2->id;
+}
+
+/*
+ * Compute the deadlines of the chunks, sorted by ID. The timestamps of
+ * the chunks we do not have are extrapolated from the ones in the buffer,
+ * and "now" is the timestamp of the most recent chunk we received.
+ */
+static void compute_deadlines(schedChunkID *chunks, int chunks_len)
+{
+  const struct chunk *buff = NULL;
+  struct chunk key;
+  double interval = 0;
+  int i, n = 0;
+
+  if (playout_delay == 0) {
+    deadlines_len = 0;
+    return;
+  }
+  if (cb) {
+    buff = cb_get_chunks(cb, &n);
+  }
+  if (n > 1) {
+    interval = (double)(buff[n - 1].timestamp - buff[0].timestamp) / (buff[n - 1].id - buff[0].id);
+  }
+  now = n ? buff[n - 1].timestamp : 0;
+  for (i = 0; i < chunks_len; i++) {
+    const struct chunk *c;
+
+    deadlines[i].id = chunks[i];
+    deadlines[i].time = NO_DEADLINE;
+    if (n == 0) {
+      continue;
+    }
+    key.id = chunks[i];
+    c = bsearch(&key, buff, n, sizeof(struct chunk), cmp_chunk);
+    if (c) {
+      deadlines[i].time = c->timestamp + playout_delay;
+    } else if (n > 1) {
+      deadlines[i].time = buff[n - 1].timestamp + (int64_t)((chunks[i] - buff[n - 1].id) * interval) + playout_delay;
+    }
+  }
+  deadlines_len = chunks_len;
+  qsort(deadlines, chunks_len, sizeof(struct deadline), cmp_deadline);
+}
+
+/* The chunk can still reach the peer before its playout deadline */
+static int in_time(schedPeerID p, schedChunkID c)
+{
+  struct deadline key, *d;
+  int64_t rtt;
+
+  key.id = c;
+  d = bsearch(&key, deadlines, deadlines_len, sizeof(struct deadline), cmp_deadline);
+  if (d == NULL || d->time == NO_DEADLINE) {
+    return 1;
+  }
+  rtt = peer_rtt(p);
+
+  return d->time - now >= (one_way ? rtt / 2 : rtt);
+}
+
+static int filter(schedPeerID p, schedChunkID c)
+{
+  return base_filter(p, c) && (playout_delay == 0 || in_time(p, c));
+}
+
+static double weight_combine(double pw, double cw)
+{
+  return pw * cw;
+}
+
+/*
+ * Measured throughput of the peers; the peers without measurements are
+ * assumed to be as fast as the average of the others
+ */
+static void compute_rates(schedPeerID *peers, int peers_len)
+{
+  double sum = 0;
+  int i, n = 0;
+
+  for (i = 0; i < peers_len; i++) {
+    rate[i] = peers[i]->stats.throughput;
+    if (rate[i] > 0) {
+      sum += rate[i];
+      n++;
+    }
+  }
+  for (i = 0; i < peers_len; i++) {
+    if (rate[i] <= 0) {
+      rate[i] = n ? sum / n : 1;
+    }
+  }
+}
+
+static int cmp_chunk_index(const void *a, const void *b)
+{
+  const struct chunk_index *c1 = a, *c2 = b;
+
+  return c1->id - c2->id;
+}
+
+/*
+ * Build the bitmaps of the peers having each chunk (words 64 bit words
+ * per chunk), going through every buffermap only once
+ */
+static void set_holder(int chunk, int peer, int words)
+{
+  holders[(size_t)chunk * words + peer / 64] |= 1ULL << (peer % 64);
+}
+
+/* Fill the holders of the peer at position i using the view, if possible */
+static int view_holders(int i, schedPeerID p, schedChunkID *chunks, int chunks_len, int words)
+{
+  int j, v = view_index(p);
+
+  if (v < 0) {
+    return 0;
+  }
+  for (j = 0; j < chunks_len; j++) {
+    int res = peerset_view_has(view, v, chunks[j]);
+
+    if (res < 0) {
+      res = p->bmap && chunkID_set_check(p->bmap, chunks[j]) >= 0;
+    }
+    if (res) {
+      set_holder(j, i, words);
+    }
+  }
+
+  return 1;
+}
+
+static int build_holders(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len, int words)
+{
+  size_t n = (size_t)chunks_len * words;
+  int i, j, min, max;
+
+  if (n > holders_size) {
+    uint64_t *h = realloc(holders, n * sizeof(uint64_t));
+
+    if (h == NULL) {
+      return -1;
+    }
+    holders = h;
+    holders_size = n;
+  }
+  memset(holders, 0, n * sizeof(uint64_t));
+  min = max = chunks_len ? chunks[0] : 0;
+  for (i = 1; i < chunks_len; i++) {
+    if (chunks[i] < min) min = chunks[i];
+    if (chunks[i] > max) max = chunks[i];
+  }
+
+  /* usually the chunk IDs are (almost) contiguous: direct lookup table */
+  if ((int64_t)max - min < 2 * chunks_len + 64) {
+    int range = max - min + 1;
+
+    if (range > id_map_size) {
+      int *m = realloc(id_map, range * sizeof(int));
+
+      if (m == NULL) {
+        return -1;
+      }
+      id_map = m;
+      id_map_size = range;
+    }
+    for (i = 0; i < range; i++) {
+      id_map[i] = -1;
+    }
+    for (i = 0; i < chunks_len; i++) {
+      id_map[chunks[i] - min] = i;
+    }
+    for (i = 0; i < peers_len; i++) {
+      int size = peers[i]->bmap ? chunkID_set_size(peers[i]->bmap) : 0;
+
+      if (view_holders(i, peers[i], chunks, chunks_len, words)) {
+        continue;
+      }
+      for (j = 0; j < size; j++) {
+        int id = chunkID_set_get_chunk(peers[i]->bmap, j);
+
+        if (id >= min && id <= max && id_map[id - min] >= 0) {
+          set_holder(id_map[id - min], i, words);
+        }
+      }
+    }
+
+    return 0;
+  }
+
+  for (i = 0; i < chunks_len; i++) {
+    chunk_idx[i].id = chunks[i];
+    chunk_idx[i].index = i;
+  }
+  qsort(chunk_idx, chunks_len, sizeof(struct chunk_index), cmp_chunk_index);
+  for (i = 0; i < peers_len; i++) {
+    int size = peers[i]->bmap ? chunkID_set_size(peers[i]->bmap) : 0;
+
+    if (view_holders(i, peers[i], chunks, chunks_len, words)) {
+      continue;
+    }
+    for (j = 0; j < size; j++) {
+      struct chunk_index key, *c;
+
+      key.id = chunkID_set_get_chunk(peers[i]->bmap, j);
+      c = bsearch(&key, chunk_idx, chunks_len, sizeof(struct chunk_index), cmp_chunk_index);
+      if (c) {
+        set_holder(c->index, i, words);
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void evaluate_peers(schedPeerID *peers, int peers_len)
+{
+  struct timeval now, age;
+  int i;
+
+  compute_rates(peers, peers_len);
+  switch (peer_eval) {
+    case PEER_RANDOM:
+      schedEvaluatePeersRandom(ctx, peers, peers_len, peer_w);
+      break;
+    case PEER_FRESH:
+      gettimeofday(&now, NULL);
+      for (i = 0; i < peers_len; i++) {
+        timersub(&now, &peers[i]->bmap_timestamp, &age);
+        peer_w[i] = 1.0 / (1.0 + age.tv_sec + age.tv_usec / 1000000.0);
+      }
+      break;
+    case PEER_BANDWIDTH:
+      schedEvaluatePeersBandwidth(rate, peers, peers_len, peer_w);
+      break;
+    case PEER_RTT:
+      for (i = 0; i < peers_len; i++) {
+        peer_w[i] = 1000.0 / (1000.0 + peer_rtt(peers[i]));
+      }
+      break;
+  }
+}
+
+static void evaluate_chunks(enum chunk_eval eval, schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len)
+{
+  int words = (peers_len + 63) / 64;
+  int i, p, max;
+
+  switch (eval) {
+    case CHUNK_LATEST:
+      schedEvaluateChunksAge(NULL, chunks, chunks_len, chunk_w);
+      break;
+    case CHUNK_OLDEST:
+      max = chunks_len ? chunks[0] : 0;
+      for (i = 1; i < chunks_len; i++) {
+        if (chunks[i] > max) max = chunks[i];
+      }
+      for (i = 0; i < chunks_len; i++) {
+        chunk_w[i] = max - chunks[i] + 1;
+      }
+      break;
+    case CHUNK_RANDOM:
+      schedEvaluateChunksRandom(ctx, chunks, chunks_len, chunk_w);
+      break;
+    case CHUNK_RAREST:
+      for (i = 0; i < chunks_len; i++) {
+        const uint64_t *h;
+        int n = pset ? peerset_chunk_availability(pset, chunks[i]) : -1;
+
+        if (n >= 0) {
+          chunk_w[i] = peerset_size(pset) - n + 1;
+          continue;
+        }
+        /* not tracked by the PeerSet: count the holders */
+        h = holders + (size_t)i * words;
+        for (n = 0, p = 0; p < words; p++) {
+          n += __builtin_popcountll(h[p]);
+        }
+        chunk_w[i] = peers_len - n + 1;
+      }
+      break;
+    case CHUNK_EDF:
+      /* the closer the deadline, the more urgent the chunk */
+      for (i = 0; i < chunks_len; i++) {
+        struct deadline key, *d;
+
+        key.id = chunks[i];
+        d = bsearch(&key, deadlines, chunks_len, sizeof(struct deadline), cmp_deadline);
+        if (d->time == NO_DEADLINE) {
+          chunk_w[i] = 0;
+        } else {
+          double slack = d->time > now ? (d->time - now) / 1000.0 : 0;
+
+          chunk_w[i] = 1.0 / (1.0 + slack);
+        }
+      }
+      break;
+  }
+}
+
+/*
+ * Request planner: assign each chunk (in order of weight) to exactly one
+ * of the peers having it (see build_holders()), without exceeding the per-peer budget. Each
+ * chunk goes to the peer that would complete it first, given the chunks
+ * already assigned to it and its throughput (ties are broken by the peer
+ * weight).
+ */
+static void partition(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len,
+                      struct PeerChunk *selected, int *selected_len)
+{
+  int words = (peers_len + 63) / 64;
+  int max_req = budget ? budget : chunks_len;
+  size_t n, i;
+  int p, w, s = 0;
+
+  n = schedSelectIndexes(ctx, ordering, chunk_w, NULL, chunks_len, order, chunks_len);
+  for (p = 0; p < peers_len; p++) {
+    assigned[p] = 0;
+    finish[p] = 1 / rate[p];
+  }
+  for (w = 0; w < words; w++) {
+    free_peers[w] = ~0ULL;
+  }
+  if (budget) {
+    // the chunks already requested count against the budget
+    for (p = 0; p < peers_len; p++) {
+      assigned[p] = peers[p]->stats.outstanding;
+      finish[p] = (assigned[p] + 1) / rate[p];
+      if (assigned[p] >= max_req) {
+        free_peers[p / 64] &= ~(1ULL << (p % 64));
+      }
+    }
+  }
+  for (i = 0; i < n && s < *selected_len; i++) {
+    const uint64_t *h = holders + (size_t)order[i] * words;
+    schedChunkID c = chunks[order[i]];
+    double best_time = 0;
+    int best = -1;
+
+    for (w = 0; w < words; w++) {
+      uint64_t bits = h[w] & free_peers[w];
+
+      while (bits) {
+        p = w * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        if (best >= 0 && (finish[p] > best_time || (finish[p] == best_time && peer_w[p] <= peer_w[best]))) {
+          continue;
+        }
+        if (playout_delay && !in_time(peers[p], c)) {
+          continue;
+        }
+        best = p;
+        best_time = finish[p];
+      }
+    }
+    if (best >= 0) {
+      finish[best] = (++assigned[best] + 1) / rate[best];
+      if (assigned[best] >= max_req) {
+        free_peers[best / 64] &= ~(1ULL << (best % 64));
+      }
+      selected[s].peer = peers[best];
+      selected[s++].chunk = c;
+    }
+  }
+  *selected_len = s;
+}
+
+/* CHUNK_RAREST needs the holders of the chunks the PeerSet does not track */
+static int untracked(schedChunkID *chunks, int chunks_len)
+{
+  int i;
+
+  for (i = 0; pset && i < chunks_len; i++) {
+    if (peerset_chunk_availability(pset, chunks[i]) < 0) {
+      return 1;
+    }
+  }
+
+  return pset == NULL;
+}
+
+/* Evaluate peers and chunks, and set up the pair filter */
+static int prepare(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len,
+                   enum chunk_eval eval, int (*f)(schedPeerID, schedChunkID), int push)
+{
+  if (!sched_ready(peers_len, chunks_len)) {
+    return 0;
+  }
+  base_filter = f;
+  one_way = push;
+  view = pset ? peerset_get_view(pset) : NULL;
+  view_peers = pset ? peerset_get_peers(pset) : NULL;
+  if (f == has || (eval == CHUNK_RAREST && untracked(chunks, chunks_len))) {
+    if (build_holders(peers, peers_len, chunks, chunks_len, (peers_len + 63) / 64) < 0) {
+      return 0;
+    }
+  }
+  compute_deadlines(chunks, chunks_len);
+  evaluate_peers(peers, peers_len);
+  evaluate_chunks(eval, peers, peers_len, chunks, chunks_len);
+
+  return 1;
+}
+
+void schedSelectPushList(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len, 	//in
+                     struct PeerChunk *selected, int *selected_len)	//out, inout
+{
+  size_t len = *selected_len;
+
+  if (!prepare(peers, peers_len, chunks, chunks_len, push_eval, needs, 1)) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectChunkFirstWeights(ctx, ordering, peers, peer_w, peers_len, chunks, chunk_w, chunks_len, selected, &len, filter);
+  *selected_len = len;
+}
+
+void schedSelectRequestList(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len, 	//in
+                     struct PeerChunk *selected, int *selected_len)	//out, inout
+{
+  if (!prepare(peers, peers_len, chunks, chunks_len, pull_eval, has, 0)) {
+    *selected_len = 0;
+    return;
+  }
+  partition(peers, peers_len, chunks, chunks_len, selected, selected_len);
+}
+
+void schedSelectOfferList(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len, 	//in
+                     struct PeerChunk *selected, int *selected_len)	//out, inout
+{
+  size_t len = *selected_len;
+
+  if (!prepare(peers, peers_len, chunks, chunks_len, push_eval, needs, 0)) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectComposedWeights(ctx, ordering, peers, peer_w, peers_len, chunks, chunk_w, chunks_len, selected, &len, filter, weight_combine);
+  *selected_len = len;
+}
+
+void schedSelectProposeList(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len, 	//in
+                     struct PeerChunk *selected, int *selected_len)	//out, inout
+{
+  size_t len = *selected_len;
+
+  if (!prepare(peers, peers_len, chunks, chunks_len, push_eval, needs, 0)) {
+    *selected_len = 0;
+    return;
+  }
+  schedSelectPeerFirstWeights(ctx, ordering, peers, peer_w, peers_len, chunks, chunk_w, chunks_len, selected, &len, filter);
+  *selected_len = len;
+}
+
+void schedSelectAcceptList(schedPeerID *peers, int peers_len, schedChunkID *chunks, int chunks_len, 	//in
+                     struct PeerChunk *selected, int *selected_len)	//out, inout
+{
+  if (!prepare(peers, peers_len, chunks, chunks_len, pull_eval, has, 0)) {
+    *selected_len = 0;
+    return;
+  }
+  partition(peers, peers_len, chunks, chunks_len, selected, selected_len);
+}
@@ -0,0 +1,30 @@
+#ifndef SCHED_PRIVATE_H
+#define SCHED_PRIVATE_H
+
+#include "scheduler_la.h"
+
+struct prng;
+
+struct prng *schedContextPrng(struct sched_context *ctx);
+
+/*
+ * Select (in order) at most selected_len indexes among the candidate
+ * indexes cand (or among all the weights, if cand is NULL)
+ */
+size_t schedSelectIndexes(struct sched_context *ctx, SchedOrdering ordering, const double *weights, const int *cand, size_t nmemb, int *selected, size_t selected_len);
+
+/*
+ * Selector functions working on precomputed weights: peer_w and chunk_w
+ * are parallel to peers and chunks
+ */
+void schedSelectPeerFirstWeights(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, const double *peer_w, size_t peers_len, schedChunkID *chunks, const double *chunk_w, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter);
+void schedSelectChunkFirstWeights(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, const double *peer_w, size_t peers_len, schedChunkID *chunks, const double *chunk_w, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter);
+void schedSelectComposedWeights(struct sched_context *ctx, SchedOrdering ordering, schedPeerID *peers, const double *peer_w, size_t peers_len, schedChunkID *chunks, const double *chunk_w, size_t chunks_len, 	//in
+                     struct PeerChunk *selected, size_t *selected_len,	//out, inout
+                     filterFunction filter, double2op weightcombine);
+
+#endif	/* SCHED_PRIVATE_H */
@@ -0,0 +1,370 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_helper.h"
+#include "../Cache/topocache.h"
+#include "../prng.h"
+
+#define N_NODES 256
+
+static struct nodeID *ids[N_NODES];
+
+/* Entries i = from, from + step, ... must be in the cache, with metadata i */
+static int check(struct peer_cache *c, int from, int step)
+{
+  int i, res = 1;
+
+  for (i = 0; i < N_NODES; i++) {
+    int in = i >= from && (i - from) % step == 0;
+    int meta = i;
+
+    res = res && cache_metadata_update(c, ids[i], &meta, sizeof(meta)) == in;
+  }
+
+  return res;
+}
+
+/* p2 is better than p1 if its metadata is smaller */
+static int rank_meta(const void *target, const void *p1, const void *p2)
+{
+  return *(const int *)p2 < *(const int *)p1 ? 2 : 1;
+}
+
+/* Ranking by metadata (with many ties): same order as inserting one entry at a time */
+static int rank_test(void)
+{
+  struct peer_cache *c, *r;
+  const int *meta;
+  int expected[64];
+  int i, j, k, n = 0, size, res = 1;
+
+  c = cache_init(64, sizeof(int), 0);
+  for (i = 0; i < 64; i++) {
+    int m = i % 8;
+
+    cache_add(c, ids[63 - i], &m, sizeof(m));	/* entry j is ids[j], with metadata (63 - j) % 8 */
+  }
+  r = cache_rank(c, rank_meta, ids[0], NULL);
+
+  for (j = 1; j < 64; j++) {
+    int pos = 0;
+
+    for (k = 0; k < n; k++) {
+      pos += (63 - expected[k]) % 8 < (63 - j) % 8;
+    }
+    memmove(expected + pos + 1, expected + pos, (n++ - pos) * sizeof(int));
+    expected[pos] = j;
+  }
+  meta = get_metadata(r, &size);
+  for (i = 0; i < n; i++) {
+    res = res && nodeid(r, i) && nodeid_equal(nodeid(r, i), ids[expected[i]]) && meta[i] == (63 - expected[i]) % 8;
+  }
+  res = res && nodeid(r, n) == NULL;
+  printf("%d: Ranked cache\n", res);
+  cache_free(c);
+  cache_free(r);
+
+  return !res;
+}
+
+/* Dump a cache as the topology protocols do */
+static int dump(uint8_t *buff, int size, const struct peer_cache *c)
+{
+  int i, len = cache_header_dump(buff, c, 0);
+
+  for (i = 0; nodeid(c, i); i++) {
+    len += entry_dump(buff + len, c, i, size - len);
+  }
+
+  return len;
+}
+
+/* Parse messages in a view, and merge them in a cache */
+static int view_test(void)
+{
+  static uint8_t buff[16 * 1024];
+  struct peer_cache *local, *remote, *v, *m;
+  int i, len, meta, source, res = 1;
+
+  local = cache_init(64, sizeof(int), 0);
+  remote = cache_init(64, sizeof(int), 0);
+  for (i = 0; i < 48; i++) {
+    meta = i;
+    cache_add(i < 32 ? local : remote, ids[i], &meta, sizeof(meta));
+  }
+  for (i = 16; i < 32; i++) {
+    meta = i + 1000;
+    cache_add(remote, ids[i], &meta, sizeof(meta));
+  }
+  len = dump(buff, sizeof(buff), remote);
+  v = cache_view_init(8);
+  for (i = 0; i < 10; i++) {
+    res = res && entries_parse(v, local, buff, len) == 32;
+  }
+  for (i = 0; i < 32; i++) {
+    res = res && nodeid(v, i) && nodeid_equal(nodeid(v, i), nodeid(remote, i));
+  }
+  res = res && entries_parse(v, local, buff, len - 1) < 0;
+  printf("%d: Message parsed in a view\n", res);
+
+  entries_parse(v, local, buff, len);
+  m = merge_caches(local, v, 64, &source);
+  cache_free(local);
+  cache_check(m);
+  for (i = 0; i < 49; i++) {
+    meta = i;
+    res = res && cache_metadata_update(m, ids[i], &meta, sizeof(meta)) == (i < 48);
+  }
+  for (i = 0; nodeid(m, i); i++);
+  res = res && i == 48;
+  printf("%d: View merged in a cache of %d entries\n", res, i);
+
+  cache_free(m);
+  cache_free(v);
+  cache_free(remote);
+
+  return !res;
+}
+
+/* Compact messages: same entries and metadata, in less space */
+static int compact_test(void)
+{
+  static uint8_t buff[16 * 1024], cbuff[16 * 1024];
+  struct peer_cache *c, *v;
+  struct meta_dict d;
+  const int *m;
+  int i, len, clen, meta, size, res;
+
+  c = cache_init(64, sizeof(int), 0);
+  for (i = 0; i < 48; i++) {
+    meta = i % 4;
+    cache_add(c, ids[i], &meta, sizeof(meta));
+  }
+  len = dump(buff, sizeof(buff), c);
+  d.n = 0;
+  clen = cache_header_dump_compact(cbuff, c, 0);
+  for (i = 0; nodeid(c, i); i++) {
+    clen += entry_dump_compact(cbuff + clen, c, i, sizeof(cbuff) - clen, &d);
+  }
+  v = cache_view_init(8);
+  res = entries_parse_compact(v, NULL, cbuff, clen) == 48 && d.n == 4;
+  m = get_metadata(v, &size);
+  for (i = 0; i < 48; i++) {
+    res = res && nodeid_equal(nodeid(v, i), nodeid(c, i)) && size == sizeof(int) && m[i] == (47 - i) % 4;
+  }
+  res = res && clen < len / 2;
+  res = res && entries_parse_compact(v, NULL, cbuff, clen - 1) < 0;
+  printf("%d: Compact message of %d bytes (plain: %d)\n", res, clen, len);
+
+  cache_free(v);
+  cache_free(c);
+
+  return !res;
+}
+
+/* Messages with flags are undumped in a new cache; malformed ones are refused */
+static int undump_test(void)
+{
+  static uint8_t buff[16 * 1024];
+  struct peer_cache *c, *u;
+  int i, len, meta, res = 1;
+
+  c = cache_init(21, sizeof(int), 0);	/* the last entry of a full cache is not dumped */
+  for (i = 0; i < 20; i++) {
+    meta = i;
+    cache_add(c, ids[i], &meta, sizeof(meta));
+    cache_flags_set(c, 0, i % 3);
+  }
+  len = cache_header_dump(buff, c, 0);
+  for (i = 0; nodeid(c, i); i++) {
+    len += entry_dump_flags(buff + len, c, i, sizeof(buff) - len);
+  }
+  u = entries_undump_flags(buff, len);
+  for (i = 0; u && i < 20; i++) {
+    meta = 19 - i;
+    res = res && nodeid_equal(nodeid(u, i), ids[19 - i]) && cache_flags(u, i) == (19 - i) % 3 &&
+          cache_metadata_update(u, ids[19 - i], &meta, sizeof(meta)) == 1;
+  }
+  res = res && u && nodeid(u, 20) == NULL;
+  if (u) cache_free(u);
+  res = res && entries_undump_flags(buff, len - 1) == NULL && entries_undump_flags(buff, len + 3) == NULL;
+  buff[0] = 0x7f;	/* a huge cache size is not trusted */
+  u = entries_undump_flags(buff, len);
+  res = res && u && nodeid(u, 19) && nodeid(u, 20) == NULL;
+  if (u) cache_free(u);
+  printf("%d: Undumped messages, malformed ones refused\n", res);
+  cache_free(c);
+
+  return !res;
+}
+
+/* Random samples: moved out of the cache, in order, each entry equally likely */
+static int rand_test(void)
+{
+  struct prng r;
+  struct peer_cache *c, *s;
+  int count[64] = {0};
+  const int *m;
+  int i, j, k, meta, res = 1;
+
+  prng_seed(&r, 1);
+  for (k = 0; k < 1000; k++) {
+    c = cache_init(64, sizeof(int), 0);
+    for (i = 0; i < 64; i++) {
+      meta = i;
+      cache_add(c, ids[i], &meta, sizeof(meta));
+    }
+    s = rand_cache(c, 16, &r);
+    for (i = 0; nodeid(s, i); i++);
+    for (j = 0; nodeid(c, j); j++);
+    res = res && i == 16 && j == 48;
+    for (i = 0; i < 64; i++) {
+      meta = i;
+      j = cache_metadata_update(s, ids[i], &meta, sizeof(meta));
+      count[i] += j;
+      res = res && j + cache_metadata_update(c, ids[i], &meta, sizeof(meta)) == 1;
+    }
+    m = get_metadata(c, &j);
+    for (i = 1; nodeid(c, i); i++) {
+      res = res && m[i - 1] > m[i];
+    }
+    cache_free(s);
+    cache_free(c);
+  }
+  /* each entry is picked 250 times on average */
+  for (i = 0; i < 64; i++) {
+    res = res && count[i] > 150 && count[i] < 350;
+  }
+  printf("%d: Random samples\n", res);
+
+  return !res;
+}
+
+/* Blacklisted nodes are refused by the merges, and the blacklist follows the cache */
+static int blacklist_test(void)
+{
+  struct peer_cache *c, *remote, *m, *r;
+  int i, meta, source, size, res;
+
+  c = cache_init(8, sizeof(int), 0);
+  remote = cache_init(8, sizeof(int), 0);
+  cache_blacklist_init(c, 0, 0);
+  for (i = 0; i < 8; i++) {
+    meta = i;
+    cache_add(i < 4 ? c : remote, ids[i], &meta, sizeof(meta));
+  }
+  res = nodeid_equal(cache_blacklist(c, ids[1]), ids[1]) && cache_pos(c, ids[1]) < 0;
+  cache_blacklist(c, ids[5]);
+  cache_add(remote, ids[1], &meta, sizeof(meta));
+  m = merge_caches(c, remote, 8, &source);
+  res = res && cache_pos(m, ids[5]) < 0 && cache_pos(m, ids[1]) < 0 && cache_pos(m, ids[4]) >= 0;
+  r = cache_rank(m, NULL, NULL, NULL);
+  res = res && cache_blacklisted(r, ids[5]) && cache_blacklisted(r, ids[1]) && !cache_blacklisted(c, ids[5]);
+  cache_add(r, ids[5], &meta, sizeof(meta));
+  res = res && !cache_blacklisted(r, ids[5]);
+  cache_free(m);
+
+  for (i = 0; i < 20; i++) {
+    cache_blacklist(r, ids[100 + i]);
+  }
+  res = res && cache_blacklisted(r, ids[119]) && !cache_blacklisted(r, ids[111]) && !cache_blacklisted(r, ids[1]);
+  m = cache_union(r, remote, &size);
+  res = res && m && cache_blacklisted(m, ids[119]) && cache_pos(m, ids[6]) >= 0;
+  printf("%d: Blacklists\n", res);
+
+  cache_free(m);
+  cache_free(r);
+  cache_free(c);
+  cache_free(remote);
+
+  return !res;
+}
+
+/* Blacklisted nodes are forgiven after the timeout, and the blacklist can be larger than the cache */
+static int blacklist_expire_test(void)
+{
+  struct peer_cache *c;
+  int i, res = 1;
+
+  c = cache_init(4, 0, 0);
+  cache_blacklist_init(c, N_NODES, 100000);
+  for (i = 0; i < N_NODES; i++) {
+    cache_blacklist(c, ids[i]);
+  }
+  cache_unblacklist(c, ids[7]);
+  for (i = 0; i < N_NODES; i++) {
+    res = res && cache_blacklisted(c, ids[i]) == (i != 7);
+  }
+  cache_blacklist(c, ids[7]);
+  res = res && cache_blacklisted(c, ids[0]) && cache_blacklisted(c, ids[7]);
+  usleep(150000);
+  cache_blacklist(c, ids[3]);
+  res = res && !cache_blacklisted(c, ids[0]) && !cache_blacklisted(c, ids[7]) && cache_blacklisted(c, ids[3]);
+  printf("%d: Blacklist expiry\n", res);
+  cache_free(c);
+
+  return !res;
+}
+
+int main(int argc, char *argv[])
+{
+  struct peer_cache *c1, *c2, *m;
+  int i, n, meta, source, res = 0;
+
+  for (i = 0; i < N_NODES; i++) {
+    ids[i] = create_node("10.0.1.1", 1000 + i);
+  }
+
+  c1 = cache_init(N_NODES, sizeof(int), 0);
+  c2 = cache_init(N_NODES, sizeof(int), 0);
+  for (i = 0; i < N_NODES; i++) {
+    meta = i;
+    cache_add(c1, ids[i], &meta, sizeof(meta));
+    if (i % 2) {
+      cache_add(c2, ids[i], &meta, sizeof(meta));
+    }
+  }
+  i = cache_add(c1, ids[7], &meta, sizeof(meta)) == -1 && check(c1, 0, 1);
+  printf("%d: %d entries, duplicates refused\n", i, N_NODES);
+  res |= !i;
+
+  for (i = 0; i < N_NODES; i += 2) {
+    cache_del(c1, ids[i]);
+  }
+  i = check(c1, 1, 2);
+  printf("%d: Even entries removed\n", i);
+  res |= !i;
+
+  m = merge_caches(c1, c2, N_NODES, &source);
+  cache_check(m);
+  i = check(m, 1, 2);
+  for (n = 0; nodeid(m, n); n++);
+  printf("%d: Merged cache with %d entries (expected %d)\n", i && n == N_NODES / 2, n, N_NODES / 2);
+  res |= !(i && n == N_NODES / 2);
+
+  res |= rank_test();
+  res |= view_test();
+  res |= compact_test();
+  res |= undump_test();
+  res |= rand_test();
+  res |= blacklist_test();
+  res |= blacklist_expire_test();
+
+  cache_free(c1);
+  cache_free(c2);
+  cache_free(m);
+  for (i = 0; i < N_NODES; i++) {
+    nodeid_free(ids[i]);
+  }
+
+  return res;
+}
@@ -27,5 +27,11 @@ int main(int argc, char *argv[])
   printf("%d: Is %d = ...?\n", res, dummy);
   free(cfg_tags);
 
-  return 0;
+  /* Nothing after the terminator of the last value is parsed */
+  cfg_tags = config_parse("size=10\0len=7");
+  res = config_value_int(cfg_tags, "size", &size) && !config_value_int(cfg_tags, "len", &len);
+  printf("%d: Is %d = %d, and len not set?\n", res, size, 10);
+  free(cfg_tags);
+
+  return !res;
 }
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "net_helper.h"
+#include "grapes_coords.h"
+#include "../coords.h"
+
+#define N_NODES 32
+#define ROUNDS 20000
+
+static struct nodeID *nodes[N_NODES];
+static double pos[N_NODES][2], height[N_NODES];
+
+/* Real RTT between two nodes, in usecs */
+static double rtt(int i, int j)
+{
+  double dx = pos[i][0] - pos[j][0], dy = pos[i][1] - pos[j][1];
+  double d = dx * dx + dy * dy, r = d > 1 ? d : 1;
+  int k;
+
+  for (k = 0; k < 50; k++) {
+    r = (r + d / r) / 2;
+  }
+
+  return r + height[i] + height[j];
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t buff[COORD_SIZE];
+  int i, j, k, res, good = 0, pairs = 0;
+
+  srand(42);
+  for (i = 0; i < N_NODES; i++) {
+    nodes[i] = create_node("10.0.0.1", 5000 + i);
+    pos[i][0] = rand() % 100000;
+    pos[i][1] = rand() % 100000;
+    height[i] = 1000 + rand() % 10000;
+  }
+  res = coords_init(nodes[0], "size=64") == 0 && coord_distance(NULL, nodes[1]) < 0;
+  printf("%d: Unknown peers have no distance\n", res);
+
+  /* every node is local, and measures the RTT to random peers */
+  for (k = 0; k < ROUNDS; k++) {
+    i = rand() % N_NODES;
+    j = rand() % N_NODES;
+    if (i != j) {
+      coord_dump(buff, nodes[j]);
+      coord_update(nodes[i], nodes[j], buff, rtt(i, j));
+    }
+  }
+  for (i = 0; i < N_NODES; i++) {
+    for (j = i + 1; j < N_NODES; j++) {
+      double d = coord_distance(nodes[i], nodes[j]), r = rtt(i, j);
+
+      pairs++;
+      if (d > r * 0.8 && d < r * 1.2) {
+        good++;
+      }
+    }
+  }
+  i = good * 10 >= pairs * 9;
+  printf("%d: %d of %d distances within 20%% of the RTT\n", i, good, pairs);
+  res = res && i;
+  i = coord_distance(NULL, nodes[0]) == 0 && coord_distance(nodes[3], nodes[5]) == coord_distance(nodes[5], nodes[3]);
+  printf("%d: Distance is symmetric\n", i);
+  res = res && i;
+
+  return !res;
+}
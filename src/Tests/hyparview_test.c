@@ -0,0 +1,147 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "net_helper.h"
+#include "peersampler.h"
+#include "grapes_timers.h"
+
+#define N_NODES 8
+#define BASE_PORT 5580
+
+static struct nodeID *nodes[N_NODES];
+static struct psample_context *contexts[N_NODES];
+
+/* Run the overlay for some usecs; the messages from and to the dead node are lost */
+static void run(uint64_t usecs, int dead)
+{
+  static uint8_t buff[64 * 1024];
+  uint64_t end = timers_now() + usecs;
+
+  while (timers_now() < end) {
+    int i;
+
+    for (i = 0; i < N_NODES; i++) {
+      struct timeval tout = {0, 1000};
+
+      while (wait4data(nodes[i], &tout, NULL) > 0) {
+        struct nodeID *remote;
+        int len;
+
+        len = recv_from_peer(nodes[i], &remote, buff, sizeof(buff));
+        if (len > 0 && i != dead && (dead < 0 || !nodeid_equal(remote, nodes[dead]))) {
+          psample_dispatch(nodes[i], buff, len);
+        }
+        if (len > 0) {
+          nodeid_free(remote);
+        }
+        tout.tv_sec = 0;
+        tout.tv_usec = 0;
+      }
+    }
+    timers_run();
+  }
+}
+
+/* Number of nodes (but the dead one) having id in their neighbourhood */
+static int known_by(const struct nodeID *id, int dead)
+{
+  int i, j, n, res = 0;
+
+  for (i = 0; i < N_NODES; i++) {
+    const struct nodeID **cache = psample_get_cache(contexts[i], &n);
+
+    for (j = 0; i != dead && j < n; j++) {
+      if (nodeid_equal(cache[j], id)) {
+        res++;
+      }
+    }
+  }
+
+  return res;
+}
+
+/* Every live node has a neighbour, and the neighbourhoods are symmetric */
+static int connected(int dead)
+{
+  int i, j, n;
+
+  for (i = 0; i < N_NODES; i++) {
+    const struct nodeID **cache;
+
+    if (i == dead) {
+      continue;
+    }
+    cache = psample_get_cache(contexts[i], &n);
+    if (n == 0) {
+      return 0;
+    }
+    for (j = 0; j < n; j++) {
+      const struct nodeID **other;
+      int k, m;
+
+      for (k = 0; !nodeid_equal(nodes[k], cache[j]); k++);
+      other = psample_get_cache(contexts[k], &m);
+      for (; m > 0 && !nodeid_equal(other[m - 1], nodes[i]); m--);
+      if (m == 0) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  const struct nodeID **cache;
+  char cfg[128];
+  uint64_t start;
+  int i, n, res, dead;
+
+  for (i = 0; i < N_NODES; i++) {
+    nodes[i] = net_helper_init("127.0.0.1", BASE_PORT + i, "");
+    if (nodes[i] == NULL) {
+      fprintf(stderr, "Error creating my socket (127.0.0.1:%d)!\n", BASE_PORT + i);
+
+      return -1;
+    }
+    sprintf(cfg, "protocol=hyparview,cache_size=2,passive_size=5,period=200000,keepalive_period=100000,seed=%d", i + 1);
+    contexts[i] = psample_init(nodes[i], NULL, 0, cfg);
+    if (contexts[i] == NULL) {
+      fprintf(stderr, "Error initialising the peer sampler!\n");
+
+      return -1;
+    }
+  }
+
+  /* Everyone joins through the first node */
+  for (i = 1; i < N_NODES; i++) {
+    psample_add_peer(contexts[i], nodes[0], NULL, 0);
+  }
+  run(2000000, -1);
+  res = connected(-1);
+  printf("%d: Symmetric active views after the joins\n", res);
+
+  /* One of the neighbours of the first node crashes */
+  cache = psample_get_cache(contexts[0], &n);
+  for (dead = 0; n && !nodeid_equal(nodes[dead], cache[0]); dead++);
+  start = timers_now();
+  while (known_by(nodes[dead], dead) && timers_now() - start < 2000000) {
+    run(10000, dead);
+  }
+  i = known_by(nodes[dead], dead) == 0;
+  printf("%d: Crashed node %d removed after %dms\n", i, dead, (int)((timers_now() - start) / 1000));
+  res = res && i && timers_now() - start < 1000000;
+  run(1000000, dead);
+  i = connected(dead);
+  printf("%d: Active views repaired\n", i);
+  res = res && i;
+
+  return !res;
+}
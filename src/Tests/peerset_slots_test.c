@@ -0,0 +1,48 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "net_helper.h"
+#include "peer.h"
+#include "peerset.h"
+
+/* peerset_ops.c is built with SLOT_BITS=28 and MAX_SLOTS=32: 32 slots of 15 generations */
+#define N_HANDLES (32 * 15)
+
+int main(int argc, char *argv[])
+{
+  struct peerset *ps;
+  struct nodeID *ids[2];
+  int i, n, res;
+
+  ps = peerset_init("size=0");
+  ids[0] = create_node("10.0.0.1", 1000);
+  ids[1] = create_node("10.0.0.1", 1001);
+
+  /* Every add takes a new handle, until all the slots are retired */
+  for (n = 0; n <= N_HANDLES && peerset_add_peer(ps, ids[n % 2]) > 0; n++) {
+    peerset_remove_peer(ps, ids[n % 2]);
+  }
+  res = n == N_HANDLES && peerset_size(ps) == 0;
+  printf("%d: %d handles before retiring all the slots\n", res, n);
+
+  i = peerset_add_peer(ps, ids[0]) < 0 && peerset_size(ps) == 0 && peerset_check(ps, ids[0]) < 0;
+  printf("%d: Adding a peer fails\n", i);
+  res = res && i;
+
+  peerset_clear(ps, 0);
+  i = peerset_add_peer(ps, ids[1]) < 0 && peerset_size(ps) == 0;
+  printf("%d: Still failing after clearing the set\n", i);
+  res = res && i;
+
+  nodeid_free(ids[0]);
+  nodeid_free(ids[1]);
+
+  return !res;
+}
@@ -0,0 +1,239 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "net_helper.h"
+#include "peer.h"
+#include "peerset.h"
+#include "chunkidset.h"
+
+#define N_PEERS 4
+
+static int check(const struct peerset *ps, int id, int expected)
+{
+  int n = peerset_chunk_availability(ps, id);
+
+  printf("%d: chunk %d is available from %d peers (expected %d)\n", n == expected, id, n, expected);
+
+  return n != expected;
+}
+
+/* The view must agree with the buffermaps (peer 0: 68 ... 73, peer i: i ... 9) */
+static int view_test(struct peerset *ps, struct nodeID **ids)
+{
+  const struct peerset_view *v = peerset_get_view(ps);
+  int p0 = peerset_check(ps, ids[0]), p2 = peerset_check(ps, ids[2]);
+  int res;
+
+  res = v->n_peers == N_PEERS && v->window == 64 &&
+        peerset_view_has(v, p0, 70) == 1 && peerset_view_has(v, p0, 3) == 0 &&
+        peerset_view_has(v, p2, 3) == 1 && peerset_view_has(v, p2, 70) == 0 &&
+        peerset_view_has(v, p2, 6) == -1 && v->cb_size[p2] == peerset_get_peers(ps)[p2].cb_size;
+  printf("%d: Is the view consistent with the buffermaps?\n", res);
+
+  return !res;
+}
+
+/* Handles must survive the removal of other peers, and lookups must stay correct */
+static int handles_test(void)
+{
+  struct peerset *ps;
+  struct nodeID *ids[200];
+  uint32_t handles[200];
+  int i, res = 0;
+
+  ps = peerset_init("size=0");
+  for (i = 0; i < 200; i++) {
+    ids[i] = create_node("10.0.0.1", 1000 + i);
+    peerset_add_peer(ps, ids[i]);
+    handles[i] = peerset_get_handle(ps, ids[i]);
+  }
+  for (i = 0; i < 200; i += 3) {
+    peerset_remove_peer(ps, ids[i]);
+  }
+  for (i = 0; i < 200; i++) {
+    struct peer *p = peerset_get_peer_by_handle(ps, handles[i]);
+
+    if (i % 3 == 0) {
+      if (p || peerset_check(ps, ids[i]) >= 0) {
+        res = 1;
+      }
+    } else if (p == NULL || !nodeid_equal(p->id, ids[i]) || p != peerset_get_peer(ps, ids[i])) {
+      res = 1;
+    }
+  }
+  i = peerset_size(ps) == 200 - 67;
+  printf("%d: %d peers left, handles and lookups correct? %d\n", i, peerset_size(ps), !res);
+  res |= !i;
+
+  peerset_clear(ps, 0);
+  if (peerset_get_peer_by_handle(ps, handles[1])) {
+    printf("Handle still valid after clearing the set!\n");
+    res = 1;
+  }
+
+  /* a slot reused many times must not make a stale handle valid again */
+  peerset_add_peer(ps, ids[0]);
+  handles[0] = peerset_get_handle(ps, ids[0]);
+  for (i = 0; i < 10000; i++) {
+    uint32_t h;
+
+    peerset_remove_peer(ps, ids[i % 2]);
+    peerset_add_peer(ps, ids[(i + 1) % 2]);
+    h = peerset_get_handle(ps, ids[(i + 1) % 2]);
+    if (h == PEERSET_NO_HANDLE || peerset_get_peer_by_handle(ps, h) == NULL ||
+        peerset_get_peer_by_handle(ps, handles[0])) {
+      break;
+    }
+  }
+  printf("%d: Stale handles after %d reuses of a slot\n", i == 10000, i);
+  res |= i != 10000;
+  for (i = 0; i < 200; i++) {
+    nodeid_free(ids[i]);
+  }
+
+  return res;
+}
+
+/* Statistics computed from the requests, replies and chunks */
+static int stats_test(void)
+{
+  struct peerset *ps;
+  struct nodeID *id;
+  struct peer *p;
+  int res;
+
+  ps = peerset_init("request_timeout=50000");
+  id = create_node("10.0.0.2", 2000);
+  peerset_add_peer(ps, id);
+  p = peerset_get_peer(ps, id);
+
+  peerset_sent_request(ps, p, 1, 4);
+  usleep(10000);
+  peerset_received_reply(ps, p, 1);
+  peerset_received_chunk(ps, p, 1000, 0);
+  peerset_received_chunk(ps, p, 1000, 1);
+  res = p->stats.rtt >= 10000 && p->stats.outstanding == 2 && p->stats.dup > 0;
+  printf("%d: RTT %gus, %d outstanding chunks, dup %g\n", res, p->stats.rtt, p->stats.outstanding, p->stats.dup);
+
+  /* the 2 missing chunks are lost after the request timeout */
+  usleep(60000);
+  peerset_sent_request(ps, p, 2, 1);
+  res = res && p->stats.outstanding == 1 && p->stats.loss > 0;
+  printf("%d: %d outstanding chunks, loss %g\n", res, p->stats.outstanding, p->stats.loss);
+
+  peerset_clear(ps, 0);
+  nodeid_free(id);
+
+  return !res;
+}
+
+static void expired(struct peerset *h, struct peer *p, void *arg)
+{
+  (*(int *)arg)++;
+}
+
+/* Peers that are not active for 62ms must be removed */
+static int expire_test(void)
+{
+  struct peerset *ps;
+  struct nodeID *ids[10];
+  int i, n = 0, res;
+
+  ps = peerset_init("expire=62000");
+  for (i = 0; i < 10; i++) {
+    ids[i] = create_node("10.0.0.3", 3000 + i);
+    peerset_add_peer(ps, ids[i]);
+  }
+  usleep(40000);
+  for (i = 0; i < 10; i += 2) {
+    peerset_touch(ps, peerset_get_peer(ps, ids[i]));
+  }
+  res = peerset_expire(ps, expired, &n) == 0;
+  usleep(30000);
+  res = res && peerset_expire(ps, expired, &n) == 5 && n == 5 && peerset_size(ps) == 5;
+  for (i = 0; i < 10; i++) {
+    res = res && (peerset_check(ps, ids[i]) >= 0) == (i % 2 == 0);
+  }
+  printf("%d: %d peers expired, the active ones are still there\n", res, n);
+  usleep(40000);
+  i = peerset_expire(ps, NULL, NULL) == 5 && peerset_size(ps) == 0;
+  printf("%d: The other peers expired later\n", i);
+
+  peerset_clear(ps, 0);
+  for (i = 0; i < 10; i++) {
+    nodeid_free(ids[i]);
+  }
+
+  return !(res && i);
+}
+
+int main(int argc, char *argv[])
+{
+  struct peerset *ps;
+  struct nodeID *ids[N_PEERS];
+  struct chunkID_set *bmap;
+  int i, j, res = 0;
+
+  ps = peerset_init("size=4,window=64");
+  bmap = chunkID_set_init("size=0");
+  if (ps == NULL || bmap == NULL) {
+    fprintf(stderr, "Error initialising the peer set\n");
+
+    return -1;
+  }
+  for (i = 0; i < N_PEERS; i++) {
+    ids[i] = create_node("127.0.0.1", 6000 + i);
+    peerset_add_peer(ps, ids[i]);
+  }
+
+  /* peer i has chunks i ... 9 */
+  for (i = 0; i < N_PEERS; i++) {
+    chunkID_set_clear(bmap, 0);
+    for (j = i; j < 10; j++) {
+      chunkID_set_add_chunk(bmap, j);
+    }
+    peerset_set_bmap(ps, peerset_get_peer(ps, ids[i]), bmap);
+  }
+  res |= check(ps, 0, 1);
+  res |= check(ps, 2, 3);
+  res |= check(ps, 9, 4);
+  res |= check(ps, 10, -1);
+
+  /* peer 0 moves forward: chunks 68 ... 73 (reusing the slots of 4 ... 9) */
+  chunkID_set_clear(bmap, 0);
+  for (j = 68; j < 74; j++) {
+    chunkID_set_add_chunk(bmap, j);
+  }
+  peerset_set_bmap(ps, peerset_get_peer(ps, ids[0]), bmap);
+  res |= check(ps, 0, 0);
+  res |= check(ps, 9, -1);
+  res |= check(ps, 73, 1);
+  res |= check(ps, 3, 3);
+  res |= view_test(ps, ids);
+
+  /* chunks 4 ... 9 are out of the window, and must not affect 68 ... 73 */
+  peerset_remove_peer(ps, ids[3]);
+  res |= check(ps, 3, 2);
+  res |= check(ps, 2, 2);
+  res |= check(ps, 73, 1);
+
+  chunkID_set_free(bmap);
+  peerset_clear(ps, 0);
+  for (i = 0; i < N_PEERS; i++) {
+    nodeid_free(ids[i]);
+  }
+
+  res |= handles_test();
+  res |= stats_test();
+  res |= expire_test();
+
+  return res;
+}
@@ -0,0 +1,331 @@
+/*
+ *  Copyright (c) 2010 Csaba Kiraly
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "peer.h"
+#include "chunk.h"
+#include "chunkbuffer.h"
+#include "chunkidset.h"
+#include "net_helper.h"
+#include "peerset.h"
+#include "scheduler_la.h"
+#include "scheduler_ha.h"
+
+#define N_PEERS 8
+#define N_CHUNKS 16
+#define N_SEL 6
+
+static struct peer peers[N_PEERS];
+
+/* peer i is missing the chunks with id % (i + 2) == 0 */
+static int needs(schedPeerID p, schedChunkID c)
+{
+  return c % ((p - peers) + 2) == 0;
+}
+
+static double peer_weight(schedPeerID *p)
+{
+  return (*p - peers) % 3;
+}
+
+static double chunk_weight(schedChunkID *c)
+{
+  return *c;
+}
+
+static double add(double a, double b)
+{
+  return a + b;
+}
+
+static void pairs_print(const char *name, const struct PeerChunk *pc, size_t n)
+{
+  size_t i;
+
+  printf("%s:", name);
+  for (i = 0; i < n; i++) {
+    printf(" (%d, %d)", (int)(pc[i].peer - peers), pc[i].chunk);
+  }
+  printf("\n");
+}
+
+static int run(struct sched_context *ctx, SchedOrdering ordering, struct PeerChunk *sel, size_t *sel_len)
+{
+  schedPeerID p[N_PEERS];
+  schedChunkID c[N_CHUNKS];
+  int i;
+
+  for (i = 0; i < N_PEERS; i++) {
+    p[i] = &peers[i];
+  }
+  for (i = 0; i < N_CHUNKS; i++) {
+    c[i] = i;
+  }
+  schedCtxSelectComposed(ctx, ordering, p, N_PEERS, c, N_CHUNKS, sel, sel_len, needs, peer_weight, chunk_weight, add);
+
+  return *sel_len;
+}
+
+/* Batch evaluators: bandwidth of the peers, age of the chunks */
+static int batch_test(struct sched_context *ctx)
+{
+  schedPeerID p[N_PEERS];
+  schedChunkID c[N_CHUNKS];
+  struct PeerChunk sel[N_SEL];
+  size_t sel_len = N_SEL;
+  double bw[N_PEERS], best = -1;
+  int i, j, res;
+
+  for (i = 0; i < N_PEERS; i++) {
+    p[i] = &peers[i];
+    bw[i] = 100 * i;
+  }
+  for (i = 0; i < N_CHUNKS; i++) {
+    c[i] = i;
+  }
+  for (i = 0; i < N_PEERS; i++) {
+    for (j = 0; j < N_CHUNKS; j++) {
+      if (needs(p[i], c[j]) && bw[i] + j + 1 > best) {
+        best = bw[i] + j + 1;
+      }
+    }
+  }
+  schedCtxSelectComposedBatch(ctx, SCHED_BEST, p, N_PEERS, c, N_CHUNKS, sel, &sel_len, needs,
+                              schedEvaluatePeersBandwidth, bw, schedEvaluateChunksAge, NULL, add);
+  pairs_print("Batch", sel, sel_len);
+  res = sel_len == N_SEL && bw[sel[0].peer - peers] + sel[0].chunk + 1 == best;
+  printf("%d: Is the best weight %g?\n", res, best);
+
+  return !res;
+}
+
+/* Each chunk must be requested once, from a peer having it */
+static int ha_test(void)
+{
+  struct peer hp[3];
+  schedPeerID p[3];
+  schedChunkID c[N_CHUNKS];
+  struct PeerChunk sel[N_CHUNKS];
+  int sel_len = N_CHUNKS, seen[N_CHUNKS] = {0};
+  int i, j, res = 0;
+
+  if (schedInit("pull=rarest_first,peer=random,seed=7") < 0 || schedInit("peer=nonsense") >= 0) {
+    printf("schedInit() does not check the configuration!\n");
+
+    return 1;
+  }
+  memset(hp, 0, sizeof(hp));
+  for (i = 0; i < 3; i++) {
+    p[i] = &hp[i];
+    hp[i].bmap = chunkID_set_init("size=0");
+    for (j = 0; j < N_CHUNKS; j++) {
+      if (j % (i + 2) == 0) {
+        chunkID_set_add_chunk(hp[i].bmap, j);
+      }
+    }
+  }
+  for (i = 0; i < N_CHUNKS; i++) {
+    c[i] = i;
+  }
+  schedSelectRequestList(p, 3, c, N_CHUNKS, sel, &sel_len);
+  for (i = 0; i < sel_len; i++) {
+    printf("Request %d from peer %d\n", sel[i].chunk, (int)(sel[i].peer - hp));
+    if (chunkID_set_check(sel[i].peer->bmap, sel[i].chunk) < 0 || seen[sel[i].chunk]++) {
+      res = 1;
+    }
+  }
+  /* chunks 1, 5, 7, 11, 13 are not available */
+  i = sel_len == N_CHUNKS - 5;
+  printf("%d: Requested %d chunks, each once from a peer having it? %d\n", i, sel_len, !res);
+  for (i = 0; i < 3; i++) {
+    chunkID_set_free(hp[i].bmap);
+  }
+
+  return res || sel_len != N_CHUNKS - 5;
+}
+
+/* Chunks that cannot arrive before their deadline must not be pushed */
+static int edf_test(void)
+{
+  struct chunk_buffer *cb;
+  struct peer hp;
+  schedPeerID p = &hp;
+  schedChunkID c[10];
+  struct PeerChunk sel[10];
+  int sel_len = 10, i, res;
+
+  cb = cb_init("size=10");
+  for (i = 0; i < 10; i++) {
+    struct chunk ch;
+
+    memset(&ch, 0, sizeof(ch));
+    ch.id = i;
+    ch.timestamp = i * 40000;
+    cb_add_chunk(cb, &ch);
+    c[i] = i;
+  }
+  memset(&hp, 0, sizeof(hp));
+  /*
+   * now = 360000: chunk i has 40000 * i - 160000us left, and needs
+   * 50000us to be pushed, or 100000us to be offered
+   */
+  schedInit("push=edf,playout_delay=200000,rtt=100000");
+  schedSetChunkBuffer(cb);
+  schedSelectPushList(&p, 1, c, 10, sel, &sel_len);
+  res = sel_len == 1 && sel[0].chunk == 6;
+  printf("%d: EDF pushed chunk %d (expected 6)\n", res, sel_len ? sel[0].chunk : -1);
+  sel_len = 10;
+  schedSelectOfferList(&p, 1, c, 10, sel, &sel_len);
+  i = sel_len == 3 && sel[0].chunk == 7 && sel[2].chunk == 9;
+  printf("%d: EDF offered %d chunks, first %d (expected 3, first 7)\n", i, sel_len, sel_len ? sel[0].chunk : -1);
+  res = res && i;
+  schedSetChunkBuffer(NULL);
+  cb_destroy(cb);
+
+  return !res;
+}
+
+/* Rarest first with a PeerSet: the chunks it does not track are counted in the buffermaps */
+static int rarest_test(void)
+{
+  struct peerset *ps;
+  struct chunkID_set *bmap;
+  struct nodeID *id;
+  schedPeerID p[3];
+  schedChunkID c[2] = {36, 5};
+  struct PeerChunk sel[2];
+  int sel_len = 2, i, res;
+
+  ps = peerset_init("size=0,window=64");
+  bmap = chunkID_set_init("size=0");
+  for (i = 0; i < 3; i++) {
+    id = create_node("127.0.0.1", 7000 + i);
+    peerset_add_peer(ps, id);
+    nodeid_free(id);
+  }
+  /* every peer has chunk 36, only peer 2 has chunk 5 */
+  chunkID_set_add_chunk(bmap, 36);
+  peerset_set_bmap(ps, &peerset_get_peers(ps)[0], bmap);
+  peerset_set_bmap(ps, &peerset_get_peers(ps)[1], bmap);
+  /* chunk 100 takes the place of 36 in the window */
+  chunkID_set_add_chunk(bmap, 5);
+  chunkID_set_add_chunk(bmap, 100);
+  peerset_set_bmap(ps, &peerset_get_peers(ps)[2], bmap);
+  for (i = 0; i < 3; i++) {
+    p[i] = &peerset_get_peers(ps)[i];
+  }
+
+  schedInit("pull=rarest_first");
+  schedSetPeerSet(ps);
+  schedSelectRequestList(p, 3, c, 2, sel, &sel_len);
+  res = peerset_chunk_availability(ps, 36) < 0 && sel_len == 2 && sel[0].chunk == 5;
+  printf("%d: Rarest chunk %d (expected 5)\n", res, sel_len ? sel[0].chunk : -1);
+  schedSetPeerSet(NULL);
+  chunkID_set_free(bmap);
+  peerset_clear(ps, 0);
+
+  return !res;
+}
+
+/* Request planning for 64 peers x 1000 chunks, with budgets */
+static int plan_test(void)
+{
+  static struct peer hp[64];
+  static schedPeerID p[64];
+  static schedChunkID c[1000];
+  static struct PeerChunk sel[1000];
+  int count[64] = {0}, seen[1000] = {0};
+  struct timeval t0, t1;
+  int sel_len = 1000, i, j, res = 0;
+
+  srand(1);
+  for (i = 0; i < 64; i++) {
+    p[i] = &hp[i];
+    hp[i].bmap = chunkID_set_init("size=500");
+    for (j = 0; j < 1000; j++) {
+      if (rand() % 2) {
+        chunkID_set_add_chunk(hp[i].bmap, j);
+      }
+    }
+  }
+  for (j = 0; j < 1000; j++) {
+    c[j] = j;
+  }
+  schedInit("budget=20");
+  gettimeofday(&t0, NULL);
+  for (i = 0; i < 100; i++) {
+    sel_len = 1000;
+    schedSelectRequestList(p, 64, c, 1000, sel, &sel_len);
+  }
+  gettimeofday(&t1, NULL);
+  for (i = 0; i < sel_len; i++) {
+    if (chunkID_set_check(sel[i].peer->bmap, sel[i].chunk) < 0 || seen[sel[i].chunk]++ ||
+        ++count[sel[i].peer - hp] > 20) {
+      res = 1;
+    }
+  }
+  printf("%d: Planned %d requests in %ldus, respecting the budgets? %d\n", sel_len == 1000 && !res, sel_len,
+         ((t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec) / 100, !res);
+  for (i = 0; i < 64; i++) {
+    chunkID_set_free(hp[i].bmap);
+  }
+
+  return res || sel_len != 1000;
+}
+
+int main(int argc, char *argv[])
+{
+  struct sched_context *c1, *c2;
+  struct PeerChunk s1[N_SEL], s2[N_SEL];
+  size_t l1 = N_SEL, l2 = N_SEL;
+  int res = 0, i;
+
+  c1 = schedContextInit("seed=42");
+  c2 = schedContextInit("seed=42");
+  if (c1 == NULL || c2 == NULL) {
+    fprintf(stderr, "Error creating the scheduler contexts\n");
+
+    return -1;
+  }
+
+  run(c1, SCHED_WEIGHTED, s1, &l1);
+  run(c2, SCHED_WEIGHTED, s2, &l2);
+  pairs_print("Weighted (ctx 1)", s1, l1);
+  pairs_print("Weighted (ctx 2)", s2, l2);
+  i = (l1 == l2) && !memcmp(s1, s2, l1 * sizeof(struct PeerChunk));
+  printf("%d: Same seed, same selection?\n", i);
+  res |= !i;
+
+  l1 = N_SEL;
+  run(c1, SCHED_BEST, s1, &l1);
+  pairs_print("Best", s1, l1);
+  for (i = 0; i < l1; i++) {
+    if (!needs(s1[i].peer, s1[i].chunk)) {
+      printf("Filter not respected for (%d, %d)!\n", (int)(s1[i].peer - peers), s1[i].chunk);
+      res = 1;
+    }
+  }
+  i = l1 == N_SEL && add(peer_weight(&s1[0].peer), chunk_weight(&s1[0].chunk)) == 16;
+  printf("%d: Is the best weight %g = 16?\n", i, l1 ? add(peer_weight(&s1[0].peer), chunk_weight(&s1[0].chunk)) : -1);
+  res |= !i;
+
+  res |= batch_test(c1);
+
+  schedContextFree(c1);
+  schedContextFree(c2);
+
+  res |= ha_test();
+  res |= edf_test();
+  res |= rarest_test();
+  res |= plan_test();
+
+  return res;
+}
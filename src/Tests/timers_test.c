@@ -0,0 +1,111 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "grapes_timers.h"
+
+struct counter {
+  struct timer *t;
+  uint64_t period;
+  uint64_t start;
+  int n;
+  int early;	/* fired before its deadline */
+  int max;	/* removed after max expirations (0: never) */
+};
+
+static void count(void *p)
+{
+  struct counter *c = p;
+
+  c->n++;
+  if (timers_now() < c->start + c->n * c->period) {
+    c->early++;
+  }
+  if (c->n == c->max) {
+    timer_del(c->t);
+    c->t = NULL;
+  }
+}
+
+static void counter_init(struct counter *c, uint64_t period, int max)
+{
+  c->period = period;
+  c->start = timers_now();
+  c->n = 0;
+  c->early = 0;
+  c->max = max;
+  c->t = timer_add(period, count, c);
+}
+
+/* Sleep until the next deadline, as an event loop would do */
+static void run_for(uint64_t usecs)
+{
+  uint64_t end = timers_now() + usecs;
+
+  while (timers_now() < end) {
+    struct timeval tout;
+
+    if (timers_next(&tout) < 0 || tout.tv_sec * 1000000ull + tout.tv_usec > end - timers_now()) {
+      tout.tv_sec = 0;
+      tout.tv_usec = end - timers_now();
+    }
+    select(0, NULL, NULL, NULL, &tout);
+    timers_run();
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct counter fast, slow, once, far;
+  struct timeval tout;
+  int res, i;
+
+  res = timers_next(&tout) < 0;
+  printf("%d: No timers, no deadline\n", res);
+
+  counter_init(&fast, 10000, 0);
+  counter_init(&slow, 25000, 0);
+  counter_init(&once, 5000, 1);
+  counter_init(&far, 150000, 0);	/* farther than the first level of the wheel */
+  i = timers_next(&tout) == 0 && tout.tv_sec == 0 && tout.tv_usec <= 5000;
+  printf("%d: Next deadline in %ldus\n", i, (long)tout.tv_usec);
+  res = res && i;
+
+  run_for(205000);
+  printf("Fired: %d %d %d %d\n", fast.n, slow.n, once.n, far.n);
+  i = fast.n >= 15 && fast.n <= 20 && slow.n >= 6 && slow.n <= 8 && once.n == 1 && once.t == NULL && far.n == 1;
+  printf("%d: Periodic and one shot timers\n", i);
+  res = res && i;
+  i = !fast.early && !slow.early && !once.early && !far.early;
+  printf("%d: No timer fired early\n", i);
+  res = res && i;
+
+  /* a late loop does not delay the following expirations */
+  usleep(35000);
+  i = timers_run();
+  printf("%d: %d timers fired after a late wakeup\n", i >= 2, i);
+  res = res && i >= 2;
+
+  timer_mod(fast.t, 100000);
+  fast.n = 0;
+  run_for(50000);
+  printf("%d: Period changed (%d expirations)\n", fast.n == 0, fast.n);
+  res = res && fast.n == 0;
+
+  timer_del(fast.t);
+  timer_del(slow.t);
+  timer_del(far.t);
+  i = timers_next(&tout) < 0;
+  printf("%d: All timers removed\n", i);
+  res = res && i;
+
+  return !res;
+}
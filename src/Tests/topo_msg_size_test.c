@@ -12,28 +12,76 @@
 
 #include "net_helper.h"
 #include "peersampler.h"
+#include "grapes_coords.h"
+#include "grapes_msg_types.h"
+#include "../Cache/proto.h"
+#include "../int_coding.h"
 
-static int cache_size = 100;
+static int cache_size = 500;
+
+/* Parse a fragment with the given header (and a payload of size bytes) */
+static int frag_parse(struct psample_context *context, uint32_t total, int idx, int frag_size, int size)
+{
+  static uint8_t buff[64 * 1024];
+
+  buff[0] = MSG_TYPE_TOPOLOGY;
+  buff[1] = NCAST_QUERY | TOPO_F_EXT;
+  int_cpy(buff + 2, 1);
+  int_cpy(buff + 6, total);
+  int16_cpy(buff + 10, idx);
+  int16_cpy(buff + 12, frag_size);
+
+  return psample_parse_data(context, buff, 14 + size);
+}
+
+/* Receive and dispatch the messages arriving in 500ms */
+static int receive(struct nodeID *myID)
+{
+  static uint8_t buff[64 * 1024];
+  struct timeval tout = {0, 500000};
+  int n = 0;
+
+  while (wait4data(myID, &tout, NULL) > 0) {
+    struct nodeID *remote;
+    int len;
+
+    len = recv_from_peer(myID, &remote, buff, sizeof(buff));
+    if (len > 0) {
+      psample_dispatch(myID, buff, len);
+      nodeid_free(remote);
+      n++;
+    }
+  }
+
+  return n;
+}
 
 int main(int argc, char *argv[])
 {
-  struct nodeID *myID;
-  struct psample_context *context;
-  int port, res;
-  char psample_cfg[16];
+  struct nodeID *myID, *otherID;
+  struct psample_context *context, *other;
+  int port, res, n, frags;
+  char psample_cfg[64];
 
   myID = net_helper_init("127.0.0.1", 5555, "");
-  if (myID == NULL) {
-    fprintf(stderr, "Error creating my socket (127.0.0.1:5555)!\n");
+  otherID = net_helper_init("127.0.0.1", 5556, "");
+  if (myID == NULL || otherID == NULL) {
+    fprintf(stderr, "Error creating my sockets (127.0.0.1:5555, 127.0.0.1:5556)!\n");
 
     return -1;
   }
-  memset(psample_cfg, 0, sizeof(psample_cfg));
-  sprintf(psample_cfg, "cache_size=%d", cache_size);
+  sprintf(psample_cfg, "cache_size=%d,mtu=512", cache_size);
   context = psample_init(myID, NULL, 0, psample_cfg);
+  sprintf(psample_cfg, "cache_size=%d,bootstrap_period=1", cache_size);
+  other = psample_init(otherID, NULL, 0, psample_cfg);
+
+  /* Let the two peers know each other */
+  psample_add_peer(context, otherID, NULL, 0);
+  receive(otherID);
+  receive(myID);
 
   /* Fill the cache */
-  for (port = 6666; port < 6666 + cache_size; port++) {
+  for (port = 6666; port < 6666 + cache_size - 1; port++) {
     struct nodeID *knownHost;
 
     knownHost = create_node("127.0.0.1", port);
@@ -48,15 +96,137 @@ int main(int argc, char *argv[])
     }
     nodeid_free(knownHost);
   }
-  printf("Waiting 5s...\n");
-  sleep(5);
-  printf("Trying to send a gossiping message...\n");
-  res = psample_parse_data(context, NULL, 0);
+
+  /* The other peer asks for the cache, which is sent in many fragments */
+  printf("Trying to receive a large gossiping message...\n");
+  res = psample_parse_data(other, NULL, 0);
   if (res < 0) {
     fprintf(stderr, "Error sending a gossiping message: %d\n", res);
   }
+  receive(myID);
+  frags = receive(otherID);
+  psample_get_cache(other, &n);
+  res = frags > 1 && n == cache_size;
+  printf("%d: %d entries received in %d datagrams\n", res, n, frags);
+
+  /* Malformed fragments are rejected, without allocating their size */
+  if (res) {
+    int i;
+
+    i = frag_parse(other, 200, 0, 100, 100) == 0;
+    i = i && frag_parse(other, 200, 0, 100, 99) < 0;
+    i = i && frag_parse(other, 200, 2, 100, 100) < 0;
+    i = i && frag_parse(other, 200, 0, 0, 100) < 0;
+    i = i && frag_parse(other, 0xffffffff, 40000, 0xffff, 1000) < 0;
+    i = i && frag_parse(other, 0xffff, 0, 0xffff, 0xffff - 14) < 0;
+    i = i && frag_parse(other, 256 * 60000, 0, 60000, 60000) < 0;
+    i = i && frag_parse(other, 200, 0, 100, -4) < 0;
+    printf("%d: Malformed fragments rejected\n", i);
+    res = res && i;
+  }
+
+  /* Incremental updates of the cache */
+  if (res) {
+    const struct nodeID **cache, **added, **removed;
+    int version, n_added, n_removed, i;
+
+    cache = psample_get_cache(other, &n);
+    version = psample_get_version(other);
+    i = psample_get_changes(other, 0, &added, &n_added, &removed, &n_removed) == version &&
+        n_added == n && n_removed == 0 && psample_get_cache(other, &n) == cache;
+    printf("%d: Version %d, %d peers added, same snapshot\n", i, version, n_added);
+    res = res && i;
+    psample_remove_peer(other, cache[0]);
+    i = psample_get_changes(other, version, &added, &n_added, &removed, &n_removed) == version + 1 &&
+        n_added == 0 && n_removed == 1 && psample_get_changes(other, version + 1, &added, &n_added, &removed, &n_removed) == version + 1 &&
+        n_added == 0 && n_removed == 0;
+    printf("%d: Removed peer reported\n", i);
+    res = res && i;
+  }
+
+  /* A peer that gets new metadata and then leaves is reported as removed */
+  if (res) {
+    const struct nodeID **added, **removed;
+    struct psample_context *m;
+    struct nodeID *peer;
+    int meta = 1, version, n_added, n_removed, i;
+
+    m = psample_init(myID, &meta, sizeof(meta), "instance=3");
+    peer = create_node("127.0.0.1", 7777);
+    psample_add_peer(m, peer, &meta, sizeof(meta));
+    version = psample_get_version(m);
+    meta = 2;
+    psample_add_peer(m, peer, &meta, sizeof(meta));
+    i = psample_get_version(m) == version + 1;
+    psample_remove_peer(m, peer);
+    i = i && psample_get_changes(m, version, &added, &n_added, &removed, &n_removed) == version + 2 &&
+        n_added == 0 && n_removed == 1 && nodeid_equal(removed[0], peer);
+    printf("%d: Peer with new metadata, then removed\n", i);
+    res = res && i;
+    nodeid_free(peer);
+  }
+
+  /* A second overlay on the same sockets */
+  if (res) {
+    struct psample_context *a, *b;
+    const struct nodeID **cache;
+    int i;
+
+    a = psample_init(myID, NULL, 0, "protocol=cyclon,instance=1");
+    b = psample_init(otherID, NULL, 0, "protocol=cyclon,instance=1");
+    i = a && b && psample_init(myID, NULL, 0, "protocol=cyclon,instance=1") == NULL;
+    printf("%d: One context per instance\n", i);
+    res = res && i;
+    if (i) {
+      psample_add_peer(a, otherID, NULL, 0);
+      receive(otherID);
+      receive(myID);
+      cache = psample_get_cache(b, &n);
+      i = n == 1 && nodeid_equal(cache[0], myID);
+      psample_get_cache(a, &n);
+      i = i && n == 1 && psample_get_version(a) > 0;
+      printf("%d: Instance 1 messages dispatched (%d peers)\n", i, n);
+      res = res && i;
+      psample_get_cache(other, &n);
+      i = n == cache_size - 1;
+      printf("%d: Instance 0 unaffected (%d peers)\n", i, n);
+      res = res && i;
+    }
+  }
+
+  /*
+   * Proximity sampling: queries and replies carry their sender, and the
+   * coordinates once the peers know each other understand them
+   */
+  if (res) {
+    struct psample_context *a, *b;
+    const struct nodeID **cache;
+    int i;
+
+    coords_init(myID, "");
+    a = psample_init(myID, NULL, 0, "protocol=proximity,instance=2");
+    b = psample_init(otherID, NULL, 0, "protocol=proximity,instance=2");
+    i = a && b;
+    if (i) {
+      psample_add_peer(a, otherID, NULL, 0);
+      receive(otherID);
+      receive(myID);
+      cache = psample_get_cache(b, &n);
+      i = n == 1 && nodeid_equal(cache[0], myID);
+      cache = psample_get_cache(a, &n);
+      i = i && n == 1 && nodeid_equal(cache[0], otherID);
+      i = i && coord_distance(NULL, otherID) < 0;
+      psample_add_peer(a, otherID, NULL, 0);
+      receive(otherID);
+      receive(myID);
+      i = i && coord_distance(NULL, otherID) > 0;
+    }
+    printf("%d: Proximity shuffle\n", i);
+    res = res && i;
+  }
 
   nodeid_free(myID);
+  nodeid_free(otherID);
 
-  return 0;
+  return !res;
 }
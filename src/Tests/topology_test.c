@@ -24,6 +24,7 @@
 
 #include "net_helper.h"
 #include "peersampler.h"
+#include "grapes_timers.h"
 #include "net_helpers.h"
 
 
@@ -93,7 +94,10 @@ static void loop(struct nodeID *s)
     const struct timeval tout = {1, 0};
     struct timeval t1;
 
-    t1 = tout;
+    /* sleep until the next protocol deadline (at most 1s) */
+    if (timers_next(&t1) < 0 || timercmp(&t1, &tout, >)) {
+      t1 = tout;
+    }
     news = wait4data(s, &t1, NULL);
     if (news > 0) {
       struct nodeID *remote;
@@ -5,14 +5,13 @@
  *      Author: Marco Biazzini
  */
 
-#include <sys/time.h>
-#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "../Cache/topocache.h"
 #include "config.h"
 #include "topman_iface.h"
@@ -21,7 +20,8 @@
 #define DUMB_DEFAULT_CSIZE	20
 #define DUMB_DEFAULT_PERIOD	10
 
-static uint64_t currtime;
+static struct timer *timer;
+static int due;
 static int memory;
 static int cache_size;
 static int current_size;
@@ -32,23 +32,10 @@ static struct peer_cache *local_cache;
 static uint8_t *my_mdata;
 static struct nodeID *me;
 
-static uint64_t gettime(void)
+/* Timer callback: the next dumbParseData() rebuilds the cache */
+static void dumb_expire(void *arg)
 {
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-
-	return tv.tv_usec + tv.tv_sec * 1000000ull;
-}
-
-static int time_to_run(void)
-{
-	if (gettime() - currtime > period) {
-		currtime += period;
-		return 1;
-	}
-
-	return 0;
+	due = 1;
 }
 
 static int dumbInit(struct nodeID *myID, void *metadata, int metadata_size, ranking_function rfun, const char *config)
@@ -85,7 +72,12 @@ static int dumbInit(struct nodeID *myID, void *metadata, int metadata_size, rank
 		memcpy(my_mdata, metadata, mdata_size);
 	}
 	me = myID;
-	currtime = gettime();
+	timer = timer_add(period, dumb_expire, NULL);
+	if (timer == NULL) {
+		cache_free(local_cache);
+		free(my_mdata);
+		return -1;
+	}
 
 	return 0;
 }
@@ -145,9 +137,10 @@ static int dumbParseData(const uint8_t *buff, int len, struct nodeID **peers, in
 	const uint8_t *m_data;
 	int r,j, msize, csize, heritage;
 
-	if (!time_to_run()) {
+	if (!due) {
 		return 1;
 	}
+	due = 0;
 	if (metadata_size != mdata_size) {
 		fprintf(stderr, "DumbTopman : Metadata size mismatch with peer sampler!\n");
 		return 1;
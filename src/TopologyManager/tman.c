@@ -4,20 +4,20 @@
  *  This is free software; see lgpl-2.1.txt
  */
 
-#include <sys/time.h>
-#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "../Cache/blist_cache.h"
 #include "../Cache/blist_proto.h"
 #include "../Cache/proto.h"
 #include "grapes_msg_types.h"
 #include "config.h"
 #include "topman_iface.h"
+#include "../prng.h"
 
 #define TMAN_INIT_PEERS 10 // max # of neighbors in local cache (should be >= than the next)
 #define TMAN_MAX_PREFERRED_PEERS 10 // # of peers to choose a receiver among (should be <= than the previous)
@@ -25,15 +25,19 @@
 #define TMAN_STD_PERIOD 5
 #define TMAN_INIT_PERIOD 1000000
 #define TMAN_RESTART_COUNT 20;
+#define TMAN_BLACKLIST_TIMEOUT 0	// seconds before a blacklisted peer is forgiven (0 -> never)
 
 static  int max_preferred_peers;
 static  int max_gossiping_peers;
 static	int restart_countdown = TMAN_RESTART_COUNT;
 
-static uint64_t currtime;
+static struct timer *timer;
+static int due;
 static int cache_size;
 static struct peer_cache *local_cache;
 static int default_period;
+static int blacklist_size;
+static int blacklist_timeout;
 static int init_cache_size;
 static int period = TMAN_INIT_PERIOD;
 static int active;
@@ -42,6 +46,7 @@ static void *mymeta;
 static int mymeta_size;
 static struct nodeID *restart_peer;
 static uint8_t *zero;
+static struct prng rng;	/* choice of the peer to gossip with */
 
 static rankingFunction userRankFunct;
 
@@ -56,19 +61,22 @@ static int tmanRankFunct (const void *target, const void *p1, const void *p2) {
 	return userRankFunct(target, p1, p2);
 }
 
-static uint64_t gettime(void)
+/* Timer callback: the next tmanParseData() runs a gossiping round */
+static void tman_expire(void *arg)
 {
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
+	due = 1;
+}
 
-	return tv.tv_usec + tv.tv_sec * 1000000ull;
+static void period_set(int p)
+{
+	period = p;
+	timer_mod(timer, period);
 }
 
 static int tmanInit(struct nodeID *myID, void *metadata, int metadata_size, rankingFunction rfun, const char *config)
 {
 	struct tag *cfg_tags;
-	int res;
+	int res, seed;
 
 	cfg_tags = config_parse(config);
 	res = config_value_int(cfg_tags, "cache_size", &init_cache_size);
@@ -89,6 +97,20 @@ static int tmanInit(struct nodeID *myID, void *metadata, int metadata_size, rank
 		default_period = TMAN_STD_PERIOD;
 	}
 	default_period *= 1000000;
+	res = config_value_int(cfg_tags, "blacklist_size", &blacklist_size);
+	if (!res) {
+		blacklist_size = 0;
+	}
+	res = config_value_int(cfg_tags, "blacklist_timeout", &blacklist_timeout);
+	if (!res) {
+		blacklist_timeout = TMAN_BLACKLIST_TIMEOUT;
+	}
+	blist_blacklist_set(blacklist_size, blacklist_timeout * 1000000ull);
+	res = config_value_int(cfg_tags, "seed", &seed);
+	if (!res) {
+		seed = rand();
+	}
+	prng_seed(&rng, seed);
 
 	userRankFunct = rfun;
 	blist_proto_init(myID, metadata, metadata_size);
@@ -101,7 +123,11 @@ static int tmanInit(struct nodeID *myID, void *metadata, int metadata_size, rank
 		return -1;
 	}
 	active = -1;
-	currtime = gettime();
+	timer = timer_add(period, tman_expire, NULL);
+	if (timer == NULL) {
+		blist_cache_free(local_cache);
+		return -1;
+	}
 
 	return 0;
 }
@@ -131,16 +157,6 @@ static int tmanGetNeighbourhoodSize(void)
 	return i;
 }
 
-static int time_to_send(void)
-{
-	if (gettime() - currtime > period) {
-		currtime += period;
-		return 1;
-	}
-
-	return 0;
-}
-
 static int tmanAddNeighbour(struct nodeID *neighbour, void *metadata, int metadata_size)
 {
 	if (!metadata_size) {
@@ -198,7 +214,11 @@ static int tmanParseData(const uint8_t *buff, int len, struct nodeID **peers, in
 	      return -1;
 	    }
 
-		remote_cache = blist_entries_undump(buff + sizeof(struct topo_header), len - sizeof(struct topo_header));
+		remote_cache = blist_proto_parse(buff, len);
+		if (remote_cache == NULL) {
+			fprintf(stderr, "TMAN: Malformed message!\n");
+			return -1;
+		}
 		mdata = blist_get_metadata(remote_cache,&msize);
 		blist_get_metadata(local_cache,&s);
 
@@ -208,7 +228,7 @@ static int tmanParseData(const uint8_t *buff, int len, struct nodeID **peers, in
 			return 1;
 		}
 
-		if (h->type == TMAN_QUERY) {
+		if ((h->type & TOPO_TYPE_MASK) == TMAN_QUERY) {
 			new = blist_cache_rank(local_cache, tmanRankFunct, blist_nodeid(remote_cache, 0), blist_get_metadata(remote_cache, &msize));
 			if (new) {
 				blist_tman_reply(remote_cache, new, max_gossiping_peers);
@@ -223,7 +243,7 @@ static int tmanParseData(const uint8_t *buff, int len, struct nodeID **peers, in
 			if (new) {
 				cache_size = init_cache_size;
 				blist_cache_resize(new,cache_size);
-				period = default_period;
+				period_set(default_period);
 				fprintf(stderr,"RESTARTING TMAN!!!\n");
 			}
 			nodeid_free(restart_peer);
@@ -255,16 +275,17 @@ static int tmanParseData(const uint8_t *buff, int len, struct nodeID **peers, in
 		}
 	}
 
-  if (time_to_send()) {
+  if (due) {
 	uint8_t *meta;
 	struct nodeID *chosen;
 
+	due = 0;
 	blist_cache_update(local_cache);
 
 	if (active > 0 && tmanGetNeighbourhoodSize() < size && !restart_countdown) {
 		fprintf(stderr, "TMAN: Too few peers in cache! Triggering a restart...\n");
 		active = 0;
-		period = TMAN_INIT_PERIOD;
+		period_set(TMAN_INIT_PERIOD);
 	}
 
 	if (active <= 0) {	// active < 0 -> bootstrap phase ; active = 0 -> restart phase
@@ -302,7 +323,7 @@ static int tmanParseData(const uint8_t *buff, int len, struct nodeID **peers, in
 		}
 	}
 	else { // normal phase
-	chosen = blist_rand_peer(local_cache, (void **)&meta, max_preferred_peers);
+	chosen = blist_rand_peer(local_cache, (void **)&meta, max_preferred_peers, &rng);
 	new = blist_cache_rank(local_cache, tmanRankFunct, chosen, meta);
 	if (new==NULL) {
 		fprintf(stderr, "TMAN: No cache could be sent to remote peer!\n");
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "net_helper.h"
+#include "grapes_timers.h"
 #include "tman.h"
 #include "topman_iface.h"
 
@@ -27,6 +28,7 @@ int tmanAddNeighbour(struct nodeID *neighbour, void *metadata, int metadata_size
 
 int tmanParseData(const uint8_t *buff, int len, struct nodeID **peers, int size, const void *metadata, int metadata_size)
 {
+	timers_run();
 	return tm->parseData(buff, len, peers, size, metadata, metadata_size);
 }
 
@@ -0,0 +1,56 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "check.h"
+
+#ifdef GRAPES_CHECKS
+static int level = -1;
+static unsigned int calls;
+
+static int level_from_env(void)
+{
+  const char *s = getenv("GRAPES_CHECKS");
+
+  if (s && strcmp(s, "off") == 0) {
+    return CHECK_OFF;
+  }
+  if (s && strcmp(s, "sampled") == 0) {
+    return CHECK_SAMPLED;
+  }
+
+  return CHECK_FULL;
+}
+
+void check_level_set(enum check_level l)
+{
+  level = l;
+}
+
+int check_enabled(void)
+{
+  if (level < 0) {
+    level = level_from_env();
+  }
+  switch (level) {
+    case CHECK_FULL:
+      return 1;
+    case CHECK_SAMPLED:
+      return calls++ % CHECK_SAMPLE_RATE == 0;
+  }
+
+  return 0;
+}
+
+void check_failed(const char *cond, const char *file, int line)
+{
+  fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+  abort();
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+/*
+ * Internal consistency checks, for debugging. They are compiled in only
+ * if GRAPES_CHECKS is defined (make CHECKS=1), and the level can then be
+ * changed at run time with check_level_set() or with the GRAPES_CHECKS
+ * environment variable ("off", "sampled" or "full"; default: "full").
+ * In the sampled mode, only one check out of CHECK_SAMPLE_RATE runs.
+ *
+ * CHECK(cond) aborts the process if cond is false, CHECK_CALL(f) runs a
+ * checking function; without GRAPES_CHECKS their arguments are not even
+ * evaluated.
+ */
+enum check_level {
+  CHECK_OFF,
+  CHECK_SAMPLED,
+  CHECK_FULL,
+};
+
+#define CHECK_SAMPLE_RATE 64
+
+#ifdef GRAPES_CHECKS
+int check_enabled(void);
+void check_failed(const char *cond, const char *file, int line);
+void check_level_set(enum check_level l);
+
+#define CHECK(cond) do { if (check_enabled() && !(cond)) check_failed(#cond, __FILE__, __LINE__); } while (0)
+#define CHECK_CALL(f) do { if (check_enabled()) f; } while (0)
+#else
+#define CHECK(cond) do { } while (0)
+#define CHECK_CALL(f) do { } while (0)
+#define check_level_set(l) do { } while (0)
+#endif
+
+#endif	/* CHECK_H */
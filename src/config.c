@@ -54,7 +54,10 @@ struct tag *config_parse(const char *cfg)
         return NULL;
       }
       memcpy(res[i++].value, p1 + 1, p - p1 - 1);
-      p++;
+      /* the last value ends at the terminator: do not skip it */
+      if (*p) {
+        p++;
+      }
     } else {
       p = NULL;
     }
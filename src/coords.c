@@ -0,0 +1,257 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "net_helper.h"
+#include "grapes_coords.h"
+#include "coords.h"
+#include "config.h"
+#include "nodeid_map.h"
+#include "int_coding.h"
+
+/*
+ * Vivaldi with height vectors (Dabek et al., SIGCOMM 2004): each RTT
+ * sample moves the local peer away from (or toward) the remote one by a
+ * fraction of the estimation error, weighted by the confidence of the two
+ * peers in their coordinates. The remote coordinates are remembered in a
+ * FIFO, and the local ones are never forgotten
+ */
+#define DIMS 2
+#define CE 0.25		/* error adaptation */
+#define CC 0.25		/* movement */
+#define MAX_ERROR 1.5
+#define MIN_ERROR 0.000001
+#define MIN_HEIGHT 10.0	/* usecs */
+#define MAX_COORD 1e9	/* usecs, fitting in 32 bits */
+#define DEFAULT_SIZE 1024
+
+struct coord {
+  double x[DIMS];
+  double height;
+  double error;
+};
+
+struct coord_entry {
+  struct nodeID *id;
+  struct coord c;
+  int local;
+};
+
+static struct coord_entry *entries;
+static int n_entries;
+static int next;		/* to be replaced */
+static struct nodeid_map *coord_index;
+static struct nodeID *my_id;
+
+/* sqrt(), without requiring libm to the users of the library */
+static double root(double v)
+{
+  double r = v > 1 ? v : 1, prev;
+  int i;
+
+  if (v <= 0) {
+    return 0;
+  }
+  for (i = 0; i < 100; i++) {
+    prev = r;
+    r = (r + v / r) / 2;
+    if (prev - r < r * 1e-9 && r - prev < r * 1e-9) {
+      break;
+    }
+  }
+
+  return r;
+}
+
+static double dist(const struct coord *a, const struct coord *b)
+{
+  double d = 0;
+  int i;
+
+  for (i = 0; i < DIMS; i++) {
+    d += (a->x[i] - b->x[i]) * (a->x[i] - b->x[i]);
+  }
+
+  return root(d) + (a->height + b->height);
+}
+
+static double clamp(double v, double min, double max)
+{
+  return v < min ? min : (v > max ? max : v);
+}
+
+static void vivaldi_update(struct coord *c, const struct coord *r, double rtt)
+{
+  double d = dist(c, r), u[DIMS], norm = 0, w, force;
+  int i;
+
+  w = c->error / (c->error + r->error);
+  c->error = CE * w * (d > rtt ? d - rtt : rtt - d) / rtt + c->error * (1 - CE * w);
+  c->error = clamp(c->error, MIN_ERROR, MAX_ERROR);
+  force = CC * w * (rtt - d);
+  for (i = 0; i < DIMS; i++) {
+    u[i] = c->x[i] - r->x[i];
+    norm += u[i] * u[i];
+  }
+  while (norm < 1e-6) {
+    /* same position: move in a random direction */
+    norm = 0;
+    for (i = 0; i < DIMS; i++) {
+      u[i] = (double)rand() / RAND_MAX - 0.5;
+      norm += u[i] * u[i];
+    }
+  }
+  norm = root(norm);
+  for (i = 0; i < DIMS; i++) {
+    c->x[i] = clamp(c->x[i] + force * u[i] / norm, -MAX_COORD, MAX_COORD);
+  }
+  c->height = clamp(c->height + (c->height + r->height) * force / d, MIN_HEIGHT, MAX_COORD);
+}
+
+static const struct coord *coord_get(const struct nodeID *id)
+{
+  int i = nodeid_map_get(coord_index, id);
+
+  return i < 0 ? NULL : &entries[i].c;
+}
+
+/* The entry of id, added (replacing the oldest remote one) if needed */
+static struct coord_entry *coord_entry(struct nodeID *id, int local)
+{
+  struct coord_entry *e;
+  int i = nodeid_map_get(coord_index, id);
+
+  if (i >= 0) {
+    entries[i].local |= local;
+
+    return &entries[i];
+  }
+  for (i = 0; i < n_entries && entries[next].local; i++) {
+    next = (next + 1) % n_entries;
+  }
+  if (i == n_entries) {
+    return NULL;
+  }
+  e = &entries[next];
+  if (e->id) {
+    nodeid_map_del(coord_index, e->id);
+    nodeid_free(e->id);
+  }
+  e->id = nodeid_dup(id);
+  if (e->id == NULL || nodeid_map_put(coord_index, e->id, next) < 0) {
+    nodeid_free(e->id);
+    e->id = NULL;
+
+    return NULL;
+  }
+  memset(&e->c, 0, sizeof(struct coord));
+  e->c.height = MIN_HEIGHT;
+  e->c.error = MAX_ERROR;
+  e->local = local;
+  next = (next + 1) % n_entries;
+
+  return e;
+}
+
+int coords_init(struct nodeID *myID, const char *config)
+{
+  struct tag *cfg_tags;
+  struct coord_entry *e;
+  int res, size;
+
+  if (entries) {
+    return -1;
+  }
+  cfg_tags = config_parse(config);
+  res = config_value_int(cfg_tags, "size", &size);
+  if (!res) {
+    size = DEFAULT_SIZE;
+  }
+  free(cfg_tags);
+  if (size < 1) {
+    return -1;
+  }
+  entries = calloc(size + 1, sizeof(struct coord_entry));	/* one more for myID */
+  coord_index = nodeid_map_init(size + 1);
+  if (entries == NULL || coord_index == NULL) {
+    nodeid_map_free(coord_index);
+    free(entries);
+    entries = NULL;
+
+    return -1;
+  }
+  n_entries = size + 1;
+  e = coord_entry(myID, 1);
+  if (e == NULL) {
+    return -1;
+  }
+  my_id = e->id;
+
+  return 0;
+}
+
+int coords_enabled(void)
+{
+  return entries != NULL;
+}
+
+double coord_distance(const struct nodeID *a, const struct nodeID *b)
+{
+  const struct coord *ca, *cb;
+
+  if (entries == NULL) {
+    return -1;
+  }
+  ca = coord_get(a ? a : my_id);
+  cb = coord_get(b);
+  if (ca == NULL || cb == NULL) {
+    return -1;
+  }
+
+  return ca == cb ? 0 : dist(ca, cb);
+}
+
+int coord_dump(uint8_t *b, struct nodeID *me)
+{
+  struct coord_entry *e = coord_entry(me, 1);
+
+  if (e == NULL) {
+    return -1;
+  }
+  int_cpy(b, (int32_t)e->c.x[0]);
+  int_cpy(b + 4, (int32_t)e->c.x[1]);
+  int_cpy(b + 8, (int32_t)e->c.height);
+  int_cpy(b + 12, (int32_t)(e->c.error * 65536));
+
+  return COORD_SIZE;
+}
+
+void coord_update(struct nodeID *me, struct nodeID *peer, const uint8_t *b, int rtt)
+{
+  struct coord_entry *e;
+  struct coord r;
+
+  if (nodeid_equal(me, peer)) {
+    return;
+  }
+  r.x[0] = clamp((int32_t)int_rcpy(b), -MAX_COORD, MAX_COORD);
+  r.x[1] = clamp((int32_t)int_rcpy(b + 4), -MAX_COORD, MAX_COORD);
+  r.height = clamp((int32_t)int_rcpy(b + 8), MIN_HEIGHT, MAX_COORD);
+  r.error = clamp((int32_t)int_rcpy(b + 12) / 65536.0, MIN_ERROR, MAX_ERROR);
+  e = coord_entry(peer, 0);
+  if (e && !e->local) {
+    e->c = r;
+  }
+  if (rtt > 0) {
+    e = coord_entry(me, 1);
+    if (e) {
+      vivaldi_update(&e->c, &r, rtt);
+    }
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef COORDS_H
+#define COORDS_H
+
+#include <stdint.h>
+
+/*
+ * Coordinates on the wire: the two positions and the height (in usecs)
+ * and the error (multiplied by 65536), as 32 bit integers
+ */
+#define COORD_SIZE 16
+
+int coords_enabled(void);
+/* Dump the coordinates of a local peer */
+int coord_dump(uint8_t *b, struct nodeID *me);
+/* Store the coordinates of peer, moving me if the RTT to it is known (> 0) */
+void coord_update(struct nodeID *me, struct nodeID *peer, const uint8_t *b, int rtt);
+
+#endif	/* COORDS_H */
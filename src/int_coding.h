@@ -43,4 +43,34 @@ static inline uint16_t int16_rcpy(const uint8_t *p)
   return tmp;
 }
 
+/* Unsigned LEB128: 7 bits per byte, the MSB set on all but the last one */
+static inline int varint_cpy(uint8_t *p, uint32_t v)
+{
+  int n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+
+  return n;
+}
+
+static inline int varint_rcpy(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+  int n = 0, shift = 0;
+
+  *v = 0;
+  do {
+    if (p + n >= end || shift > 28) {
+      return -1;
+    }
+    *v |= (uint32_t)(p[n] & 0x7f) << shift;
+    shift += 7;
+  } while (p[n++] & 0x80);
+
+  return n;
+}
+
 #endif	/* INT_CODING */
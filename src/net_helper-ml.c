@@ -720,3 +720,21 @@ struct nodeID *nodeid_undump(const uint8_t *b, int *len)
   *len = strlen((char*)b) + 1;
   return id_lookup_dup(h);
 }
+
+int nodeid_dump_len(const uint8_t *b, size_t max_len)
+{
+  const uint8_t *end = memchr(b, 0, max_len);
+
+  return end ? end - b + 1 : -1;
+}
+
+/* socketIDs are serialized as strings: no compact form */
+int nodeid_dump_compact(uint8_t *b, const struct nodeID *s, size_t max_write_size)
+{
+  return -1;
+}
+
+int nodeid_compact_expand(uint8_t *b, const uint8_t *c, size_t max_write_size, int *len)
+{
+  return -1;
+}
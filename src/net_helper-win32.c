@@ -220,6 +220,41 @@ struct nodeID *nodeid_undump(const uint8_t *b, int *len)
   return res;
 }
 
+int nodeid_dump_len(const uint8_t *b, size_t max_len)
+{
+  return max_len < sizeof(struct sockaddr_in) ? -1 : (int)sizeof(struct sockaddr_in);
+}
+
+int nodeid_dump_compact(uint8_t *b, const struct nodeID *s, size_t max_write_size)
+{
+  static const uint8_t zero[sizeof(s->addr.sin_zero)];
+
+  if (max_write_size < 6 || s->addr.sin_family != AF_INET ||
+      memcmp(s->addr.sin_zero, zero, sizeof(zero))) {
+    return -1;
+  }
+  memcpy(b, &s->addr.sin_addr, 4);
+  memcpy(b + 4, &s->addr.sin_port, 2);
+
+  return 6;
+}
+
+int nodeid_compact_expand(uint8_t *b, const uint8_t *c, size_t max_write_size, int *len)
+{
+  struct sockaddr_in addr;
+
+  if (max_write_size < sizeof(struct sockaddr_in) || *len < 6) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  memcpy(&addr.sin_addr, c, 4);
+  memcpy(&addr.sin_port, c + 4, 2);
+  memcpy(b, &addr, sizeof(struct sockaddr_in));
+  *len = 6;
+
+  return sizeof(struct sockaddr_in);
+}
+
 void nodeid_free(struct nodeID *s)
 {
   free(s);
@@ -0,0 +1,224 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "net_helper.h"
+#include "nodeid_map.h"
+
+#define MIN_BUCKETS 16
+#define MAX_ID_SIZE 256
+
+struct bucket {
+  const struct nodeID *id;	/* NULL if the bucket is empty */
+  uint32_t hash;
+  int value;
+};
+
+/* Open addressing with linear probing, at most half full */
+struct nodeid_map {
+  int n_elements;
+  uint32_t mask;
+  struct bucket *buckets;
+};
+
+uint32_t nodeid_hash_dump(const uint8_t *b, int len)
+{
+  uint32_t h = 2166136261u;	/* FNV-1a */
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ b[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+uint32_t nodeid_hash(const struct nodeID *id)
+{
+  uint8_t buff[MAX_ID_SIZE];
+  int len;
+
+  len = nodeid_dump(buff, id, sizeof(buff));
+
+  return nodeid_hash_dump(buff, len > 0 ? len : 0);
+}
+
+/* The nodeID is serialized as b (two nodeIDs are equal if their dumps are) */
+int nodeid_dump_equal(const struct nodeID *id, const uint8_t *b, int len)
+{
+  uint8_t buff[MAX_ID_SIZE];
+
+  return nodeid_dump(buff, id, sizeof(buff)) == len && memcmp(buff, b, len) == 0;
+}
+
+static int buckets_alloc(struct nodeid_map *m, uint32_t n)
+{
+  m->buckets = calloc(n, sizeof(struct bucket));
+  if (m->buckets == NULL) {
+    return -1;
+  }
+  m->mask = n - 1;
+
+  return 0;
+}
+
+struct nodeid_map *nodeid_map_init(int size)
+{
+  struct nodeid_map *m;
+  uint32_t n = MIN_BUCKETS;
+
+  m = malloc(sizeof(struct nodeid_map));
+  if (m == NULL) {
+    return NULL;
+  }
+  while (n < 2 * (uint32_t)size) {
+    n *= 2;
+  }
+  m->n_elements = 0;
+  if (buckets_alloc(m, n) < 0) {
+    free(m);
+
+    return NULL;
+  }
+
+  return m;
+}
+
+void nodeid_map_free(struct nodeid_map *m)
+{
+  free(m->buckets);
+  free(m);
+}
+
+void nodeid_map_clear(struct nodeid_map *m)
+{
+  memset(m->buckets, 0, (m->mask + 1) * sizeof(struct bucket));
+  m->n_elements = 0;
+}
+
+int nodeid_map_size(const struct nodeid_map *m)
+{
+  return m->n_elements;
+}
+
+static struct bucket *lookup(const struct nodeid_map *m, const struct nodeID *id, uint32_t hash)
+{
+  uint32_t i;
+
+  for (i = hash & m->mask; m->buckets[i].id; i = (i + 1) & m->mask) {
+    if (m->buckets[i].hash == hash && nodeid_equal(m->buckets[i].id, id)) {
+      return &m->buckets[i];
+    }
+  }
+
+  return &m->buckets[i];
+}
+
+static int grow(struct nodeid_map *m)
+{
+  struct bucket *old = m->buckets;
+  uint32_t i, n = m->mask + 1;
+
+  if (buckets_alloc(m, 2 * n) < 0) {
+    m->buckets = old;
+
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (old[i].id) {
+      *lookup(m, old[i].id, old[i].hash) = old[i];
+    }
+  }
+  free(old);
+
+  return 0;
+}
+
+int nodeid_map_get(const struct nodeid_map *m, const struct nodeID *id)
+{
+  return nodeid_map_get_hashed(m, id, nodeid_hash(id));
+}
+
+int nodeid_map_get_hashed(const struct nodeid_map *m, const struct nodeID *id, uint32_t hash)
+{
+  const struct bucket *b = lookup(m, id, hash);
+
+  return b->id ? b->value : -1;
+}
+
+int nodeid_map_get_dump(const struct nodeid_map *m, const uint8_t *b, int len, uint32_t hash)
+{
+  uint32_t i;
+
+  for (i = hash & m->mask; m->buckets[i].id; i = (i + 1) & m->mask) {
+    if (m->buckets[i].hash == hash && nodeid_dump_equal(m->buckets[i].id, b, len)) {
+      return m->buckets[i].value;
+    }
+  }
+
+  return -1;
+}
+
+int nodeid_map_put(struct nodeid_map *m, const struct nodeID *id, int value)
+{
+  return nodeid_map_put_hashed(m, id, nodeid_hash(id), value);
+}
+
+int nodeid_map_put_hashed(struct nodeid_map *m, const struct nodeID *id, uint32_t hash, int value)
+{
+  struct bucket *b = lookup(m, id, hash);
+
+  if (b->id == NULL) {
+    if (2 * (uint32_t)(m->n_elements + 1) > m->mask + 1) {
+      if (grow(m) < 0) {
+        return -1;
+      }
+      b = lookup(m, id, hash);
+    }
+    m->n_elements++;
+  }
+  b->id = id;
+  b->hash = hash;
+  b->value = value;
+
+  return 0;
+}
+
+int nodeid_map_del(struct nodeid_map *m, const struct nodeID *id)
+{
+  return nodeid_map_del_hashed(m, id, nodeid_hash(id));
+}
+
+int nodeid_map_del_hashed(struct nodeid_map *m, const struct nodeID *id, uint32_t hash)
+{
+  struct bucket *b = lookup(m, id, hash);
+  uint32_t i, j;
+  int res;
+
+  if (b->id == NULL) {
+    return -1;
+  }
+  res = b->value;
+  m->n_elements--;
+
+  /* backward shift deletion: no tombstones */
+  i = b - m->buckets;
+  for (j = (i + 1) & m->mask; m->buckets[j].id; j = (j + 1) & m->mask) {
+    uint32_t home = m->buckets[j].hash & m->mask;
+
+    /* can the entry in j move to i (is i in the probe path from home to j)? */
+    if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+      m->buckets[i] = m->buckets[j];
+      i = j;
+    }
+  }
+  m->buckets[i].id = NULL;
+
+  return res;
+}
@@ -0,0 +1,38 @@
+#ifndef NODEID_MAP_H
+#define NODEID_MAP_H
+
+#include <stdint.h>
+
+struct nodeID;
+struct nodeid_map;
+
+/*
+ * Hash table from nodeIDs to (non negative) integers, such as the position
+ * of the node in an array. The nodeIDs are not copied: they must stay valid
+ * (and unchanged) while they are in the map.
+ */
+struct nodeid_map *nodeid_map_init(int size);
+void nodeid_map_free(struct nodeid_map *m);
+void nodeid_map_clear(struct nodeid_map *m);
+int nodeid_map_size(const struct nodeid_map *m);
+
+/* value associated to id, or -1 if id is not in the map */
+int nodeid_map_get(const struct nodeid_map *m, const struct nodeID *id);
+/* add id (or update its value); < 0 on error */
+int nodeid_map_put(struct nodeid_map *m, const struct nodeID *id, int value);
+/* remove id, returning its value (or -1 if id is not in the map) */
+int nodeid_map_del(struct nodeid_map *m, const struct nodeID *id);
+
+uint32_t nodeid_hash(const struct nodeID *id);
+/* nodeid_hash() of a serialized nodeID (see nodeid_dump()) */
+uint32_t nodeid_hash_dump(const uint8_t *b, int len);
+int nodeid_dump_equal(const struct nodeID *id, const uint8_t *b, int len);
+/* lookup by serialized nodeID, without building it */
+int nodeid_map_get_dump(const struct nodeid_map *m, const uint8_t *b, int len, uint32_t hash);
+
+/* Same as above, for callers that keep the nodeid_hash() of their IDs */
+int nodeid_map_get_hashed(const struct nodeid_map *m, const struct nodeID *id, uint32_t hash);
+int nodeid_map_put_hashed(struct nodeid_map *m, const struct nodeID *id, uint32_t hash, int value);
+int nodeid_map_del_hashed(struct nodeid_map *m, const struct nodeID *id, uint32_t hash);
+
+#endif	/* NODEID_MAP_H */
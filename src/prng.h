@@ -0,0 +1,61 @@
+#ifndef PRNG_H
+#define PRNG_H
+
+#include <stdint.h>
+
+/*
+ * Small, fast pseudo random number generator (xorshift64*), to be
+ * embedded in the modules' contexts instead of using the process-wide
+ * (and non reentrant) rand().
+ */
+struct prng {
+  uint64_t s;
+};
+
+static inline void prng_seed(struct prng *r, uint64_t seed)
+{
+  /* splitmix64 step, so that any seed (including 0) gives a good state */
+  seed += 0x9E3779B97F4A7C15ull;
+  seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ull;
+  seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBull;
+  seed ^= seed >> 31;
+  r->s = seed ? seed : 0x2545F4914F6CDD1Dull;
+}
+
+static inline uint32_t prng_next(struct prng *r)
+{
+  uint64_t x = r->s;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  r->s = x;
+
+  return (x * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+/* Unbiased integer in [0, n) (Lemire's multiply and reject) */
+static inline uint32_t prng_uniform(struct prng *r, uint32_t n)
+{
+  uint64_t m = (uint64_t)prng_next(r) * n;
+  uint32_t l = (uint32_t)m;
+
+  if (l < n) {
+    uint32_t t = -n % n;
+
+    while (l < t) {
+      m = (uint64_t)prng_next(r) * n;
+      l = (uint32_t)m;
+    }
+  }
+
+  return m >> 32;
+}
+
+/* Double in [0, 1) */
+static inline double prng_double(struct prng *r)
+{
+  return prng_next(r) * (1.0 / 4294967296.0);
+}
+
+#endif	/* PRNG_H */
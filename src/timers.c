@@ -0,0 +1,225 @@
+/*
+ *  Copyright (c) 2010 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "grapes_timers.h"
+
+/*
+ * Hierarchical timer wheel: level l has WHEEL_SIZE slots of
+ * WHEEL_SIZE^l ticks each. The timers of a slot of level l > 0 are
+ * moved to the lower levels ("cascaded") when the current tick enters
+ * it; the ones expiring too far in the future for the last level are
+ * parked in its farthest slot, and requeued by its cascade
+ */
+#define TICK 1000	/* usecs */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define LEVELS 4
+
+struct timer {
+  uint64_t last;	/* last expiration (or registration) */
+  uint64_t expire;	/* last + period */
+  uint64_t period;
+  timer_callback cb;
+  void *arg;
+  struct timer *next;
+  struct timer **pprev;	/* NULL: not queued */
+};
+
+static struct timer *wheel[LEVELS][WHEEL_SIZE];
+static struct timer *expired;	/* being fired by timers_run() */
+static uint64_t cur;	/* next tick to be processed */
+static int started;
+static int n_timers;
+
+uint64_t timers_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void start(void)
+{
+  if (!started) {
+    cur = timers_now() / TICK;
+    started = 1;
+  }
+}
+
+static void timer_link(struct timer **head, struct timer *t)
+{
+  t->next = *head;
+  if (*head) {
+    (*head)->pprev = &t->next;
+  }
+  *head = t;
+  t->pprev = head;
+}
+
+static void timer_unlink(struct timer *t)
+{
+  if (t->pprev) {
+    *t->pprev = t->next;
+    if (t->next) {
+      t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+  }
+}
+
+static void timer_queue(struct timer *t)
+{
+  uint64_t tick = (t->expire + TICK - 1) / TICK;
+  uint64_t delta;
+  int l;
+
+  if (tick < cur) {
+    tick = cur;
+  }
+  delta = tick - cur;
+  for (l = 0; l < LEVELS - 1 && delta >= 1ull << (WHEEL_BITS * (l + 1)); l++);
+  if (delta >= 1ull << (WHEEL_BITS * LEVELS)) {
+    tick = cur + (1ull << (WHEEL_BITS * LEVELS)) - 1;
+  }
+  timer_link(&wheel[l][(tick >> (WHEEL_BITS * l)) & WHEEL_MASK], t);
+}
+
+static void cascade(int l)
+{
+  struct timer **slot = &wheel[l][(cur >> (WHEEL_BITS * l)) & WHEEL_MASK];
+
+  while (*slot) {
+    struct timer *t = *slot;
+
+    timer_unlink(t);
+    timer_queue(t);
+  }
+}
+
+struct timer *timer_add(uint64_t period, timer_callback cb, void *arg)
+{
+  struct timer *t;
+
+  t = malloc(sizeof(struct timer));
+  if (t == NULL) {
+    return NULL;
+  }
+  start();
+  t->period = period ? period : 1;
+  t->last = timers_now();
+  t->expire = t->last + t->period;
+  t->cb = cb;
+  t->arg = arg;
+  t->pprev = NULL;
+  timer_queue(t);
+  n_timers++;
+
+  return t;
+}
+
+void timer_mod(struct timer *t, uint64_t period)
+{
+  t->period = period ? period : 1;
+  t->expire = t->last + t->period;
+  timer_unlink(t);
+  timer_queue(t);
+}
+
+void timer_del(struct timer *t)
+{
+  if (t == NULL) {
+    return;
+  }
+  timer_unlink(t);
+  n_timers--;
+  free(t);
+}
+
+int timers_run(void)
+{
+  uint64_t now = timers_now();
+  uint64_t tick = now / TICK;
+  int n = 0;
+
+  start();
+  if (n_timers == 0) {
+    cur = cur > tick ? cur : tick + 1;
+
+    return 0;
+  }
+  while (cur <= tick) {
+    struct timer **slot;
+    int l;
+
+    for (l = 1; l < LEVELS && (cur & ((1ull << (WHEEL_BITS * l)) - 1)) == 0; l++);
+    while (--l > 0) {
+      cascade(l);
+    }
+    slot = &wheel[0][cur & WHEEL_MASK];
+    if (*slot) {
+      expired = *slot;
+      expired->pprev = &expired;
+      *slot = NULL;
+    }
+    cur++;	/* timers queued by the callbacks expire from the next tick */
+    while (expired) {
+      struct timer *t = expired;
+
+      timer_unlink(t);
+      t->last = t->expire;
+      if (t->last + t->period <= now) {
+        t->last += (now - t->last) / t->period * t->period;	/* skip the missed periods */
+      }
+      t->expire = t->last + t->period;
+      timer_queue(t);
+      t->cb(t->arg);
+      n++;
+    }
+  }
+
+  return n;
+}
+
+static uint64_t slot_min(const struct timer *t, uint64_t min)
+{
+  for (; t; t = t->next) {
+    if (t->expire < min) {
+      min = t->expire;
+    }
+  }
+
+  return min;
+}
+
+int timers_next(struct timeval *tout)
+{
+  uint64_t min = UINT64_MAX, now;
+  int i, l;
+
+  if (n_timers == 0) {
+    return -1;
+  }
+  /* timers of different levels can expire in the same ticks: scan them all */
+  for (l = 0; l < LEVELS; l++) {
+    for (i = 0; i < WHEEL_SIZE; i++) {
+      min = slot_min(wheel[l][i], min);
+    }
+  }
+  now = timers_now();
+  min = min > now ? min - now : 0;
+  tout->tv_sec = min / 1000000;
+  tout->tv_usec = min % 1000000;
+
+  return 0;
+}
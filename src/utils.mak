@@ -30,6 +30,10 @@ else
 CFLAGS += $(STATIC_CFLAGS)
 endif
 
+ifdef CHECKS
+CFLAGS += -DGRAPES_CHECKS
+endif
+
 ifdef GPROF
 CFLAGS += -pg
 LDFLAGS += -pg